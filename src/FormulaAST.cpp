@@ -1,9 +1,13 @@
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
 #include <functional>
 #include <memory>
 #include <optional>
+#include <iterator>
 #include <sstream>
+#include <string_view>
 
 #include "FormulaAST.h"
 
@@ -70,16 +74,137 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
 /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+constexpr std::string_view FUNCTION_NAMES[] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+
+// Reductions keep LANES independent accumulators, so the compiler can map
+// them onto SIMD registers without reassociating floating-point math. The
+// result therefore does not depend on how the values were evaluated.
+constexpr std::size_t LANES = 4;
+
+double SumKernel(const double* data, std::size_t size) {
+  double acc[LANES] = {};
+  std::size_t i = 0;
+  for (; i + LANES <= size; i += LANES) {
+      for (std::size_t lane = 0; lane < LANES; ++lane) {
+          acc[lane] += data[i + lane];
+      }
+  }
+  double sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+  for (; i < size; ++i) {
+      sum += data[i];
+  }
+  return sum;
+}
+
+// size must be positive; less(a, b) picks the winner.
+template <typename Less>
+double ExtremumKernel(const double* data, std::size_t size, Less less) {
+  double acc[LANES] = {data[0], data[0], data[0], data[0]};
+  std::size_t i = 0;
+  for (; i + LANES <= size; i += LANES) {
+      for (std::size_t lane = 0; lane < LANES; ++lane) {
+          acc[lane] = less(data[i + lane], acc[lane]) ? data[i + lane] : acc[lane];
+      }
+  }
+  double result = acc[0];
+  for (std::size_t lane = 1; lane < LANES; ++lane) {
+      result = less(acc[lane], result) ? acc[lane] : result;
+  }
+  for (; i < size; ++i) {
+      result = less(data[i], result) ? data[i] : result;
+  }
+  return result;
+}
+
+FormulaValue ApplyFunction(Function function, const std::vector<double>& values) {
+  const auto* data = values.data();
+  const auto size = values.size();
+  switch (function) {
+      case Function::Sum:
+          return SumKernel(data, size);
+      case Function::Average:
+          if (size == 0) {
+              return FormulaError(FormulaError::Category::Div0);
+          }
+          return SumKernel(data, size) / static_cast<double>(size);
+      case Function::Min:
+          return size ? ExtremumKernel(data, size, std::less<double>{}) : 0.;
+      case Function::Max:
+          return size ? ExtremumKernel(data, size, std::greater<double>{}) : 0.;
+      case Function::Count:
+          return static_cast<double>(size);
+  }
+  assert(false);
+  return 0.;
+}
+
+// Emits postfix code and tracks the stack depth the program needs.
+class ProgramBuilder {
+public:
+void EmitNumber(double value) {
+  Emit({OpCode::PushNumber, static_cast<std::uint32_t>(program_.numbers.size())}, 1);
+  program_.numbers.push_back(value);
+}
+
+void EmitCell(Position cell) {
+  Emit({OpCode::PushCell, static_cast<std::uint32_t>(program_.cells.size())}, 1);
+  program_.cells.push_back(cell);
+}
+
+void EmitUnary(OpCode op) {
+  Emit({op}, 0);
+}
+
+void EmitBinary(OpCode op) {
+  Emit({op}, -1);
+}
+
+// Scalar arguments must already be on the stack.
+void EmitAggregate(Function function, std::size_t scalar_count,
+                   const std::vector<const CellRange*>& ranges) {
+  Aggregate aggregate{function, static_cast<std::uint32_t>(scalar_count),
+                      static_cast<std::uint32_t>(program_.ranges.size()),
+                      static_cast<std::uint32_t>(ranges.size())};
+  for (const auto* range : ranges) {
+      program_.ranges.push_back(*range);
+  }
+  Emit({OpCode::Aggregate, static_cast<std::uint32_t>(program_.aggregates.size())},
+       1 - static_cast<int>(scalar_count));
+  program_.aggregates.push_back(aggregate);
+}
+
+Program Build() {
+  assert(depth_ == 1);
+  return std::move(program_);
+}
+
+private:
+void Emit(Instruction instruction, int stack_delta) {
+  program_.code.push_back(instruction);
+  depth_ = static_cast<std::size_t>(static_cast<int>(depth_) + stack_delta);
+  program_.stack_depth = std::max(program_.stack_depth, depth_);
+}
+
+Program program_;
+std::size_t depth_ = 0;
+};
+
 class Expr {
 public:
 virtual ~Expr() = default;
 virtual void Print(std::ostream& out) const = 0;
 virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-virtual double Evaluate(const CellLookup& cell_lookup) const = 0;
+virtual FormulaValue Evaluate(const CellLookup& cell_lookup) const = 0;
+virtual void Compile(ProgramBuilder& builder) const = 0;
 
 // higher is tighter
 virtual ExprPrecedence GetPrecedence() const = 0;
 
+// Non-null for a range argument of a function.
+virtual const CellRange* AsRange() const {
+  return nullptr;
+}
+
 void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                 bool right_child = false) const {
   auto precedence = GetPrecedence();
@@ -145,21 +270,32 @@ ExprPrecedence GetPrecedence() const override {
   }
 }
 
-double Evaluate(const CellLookup& cell_lookup) const override {
+FormulaValue Evaluate(const CellLookup& cell_lookup) const override {
     using namespace std::literals;
+    const auto lhs_value = lhs_->Evaluate(cell_lookup);
+    if (std::holds_alternative<FormulaError>(lhs_value)) {
+        return lhs_value;
+    }
+    const auto rhs_value = rhs_->Evaluate(cell_lookup);
+    if (std::holds_alternative<FormulaError>(rhs_value)) {
+        return rhs_value;
+    }
+    const double lhs = std::get<double>(lhs_value);
+    const double rhs = std::get<double>(rhs_value);
+
     switch (type_) {
         case '+' :
-            return lhs_->Evaluate(cell_lookup) + rhs_->Evaluate(cell_lookup);
+            return lhs + rhs;
         case '-' :
-            return lhs_->Evaluate(cell_lookup) - rhs_->Evaluate(cell_lookup);
+            return lhs - rhs;
         case '*' :
-            return lhs_->Evaluate(cell_lookup) * rhs_->Evaluate(cell_lookup);
+            return lhs * rhs;
         case '/' : {
-            const auto temp = lhs_->Evaluate(cell_lookup) / rhs_->Evaluate(cell_lookup);
+            const auto temp = lhs / rhs;
             if (std::isfinite(temp)) {
                 return temp;
             } else {
-                throw FormulaError(FormulaError::Category::Div0);
+                return FormulaError(FormulaError::Category::Div0);
             }
         }
 
@@ -169,6 +305,25 @@ double Evaluate(const CellLookup& cell_lookup) const override {
     throw std::runtime_error("Unknown BinaryOp type"s);
 }
 
+void Compile(ProgramBuilder& builder) const override {
+  lhs_->Compile(builder);
+  rhs_->Compile(builder);
+  switch (type_) {
+      case Add:
+          builder.EmitBinary(OpCode::Add);
+          break;
+      case Subtract:
+          builder.EmitBinary(OpCode::Subtract);
+          break;
+      case Multiply:
+          builder.EmitBinary(OpCode::Multiply);
+          break;
+      case Divide:
+          builder.EmitBinary(OpCode::Divide);
+          break;
+  }
+}
+
 private:
 Type type_;
 std::unique_ptr<Expr> lhs_;
@@ -203,13 +358,17 @@ ExprPrecedence GetPrecedence() const override {
   return EP_UNARY;
 }
 
-double Evaluate(const CellLookup& cell_lookup) const override {
+FormulaValue Evaluate(const CellLookup& cell_lookup) const override {
     using namespace std::literals;
+    const auto value = operand_->Evaluate(cell_lookup);
+    if (std::holds_alternative<FormulaError>(value)) {
+        return value;
+    }
     switch(type_) {
         case '+' :
-            return operand_->Evaluate(cell_lookup);
+            return value;
         case '-' :
-            return (- operand_->Evaluate(cell_lookup));
+            return (- std::get<double>(value));
 
         default :
             throw std::runtime_error("Unknown UnaryOp type"s);
@@ -217,6 +376,13 @@ double Evaluate(const CellLookup& cell_lookup) const override {
     throw std::runtime_error("Unknown UnaryOp type"s);
 }
 
+void Compile(ProgramBuilder& builder) const override {
+  operand_->Compile(builder);
+  if (type_ == UnaryMinus) {
+      builder.EmitUnary(OpCode::Negate);
+  }
+}
+
 private:
 Type type_;
 std::unique_ptr<Expr> operand_;
@@ -224,15 +390,16 @@ std::unique_ptr<Expr> operand_;
 
 class CellExpr final : public Expr {
 public:
-explicit CellExpr(const Position* cell)
+explicit CellExpr(Position cell)
   : cell_(cell) {
 }
 
 void Print(std::ostream& out) const override {
-  if (!cell_->IsValid()) {
+  if (!cell_.IsValid()) {
       out << FormulaError::Category::Ref;
   } else {
-      out << cell_->ToString();
+      char buffer[Position::MAX_STRING_LENGTH];
+      out.write(buffer, cell_.ToChars(buffer) - buffer);
   }
 }
 
@@ -244,12 +411,16 @@ ExprPrecedence GetPrecedence() const override {
   return EP_ATOM;
 }
 
-double Evaluate(const CellLookup& cell_lookup) const override {
-    return cell_lookup(*cell_);
+FormulaValue Evaluate(const CellLookup& cell_lookup) const override {
+    return cell_lookup(cell_);
+}
+
+void Compile(ProgramBuilder& builder) const override {
+  builder.EmitCell(cell_);
 }
 
 private:
-const Position* cell_;
+Position cell_;
 };
 
 class NumberExpr final : public Expr {
@@ -270,14 +441,133 @@ ExprPrecedence GetPrecedence() const override {
   return EP_ATOM;
 }
 
-double Evaluate(const CellLookup&) const override {
+FormulaValue Evaluate(const CellLookup&) const override {
   return value_;
 }
 
+void Compile(ProgramBuilder& builder) const override {
+  builder.EmitNumber(value_);
+}
+
 private:
 double value_;
 };
 
+class RangeExpr final : public Expr {
+public:
+explicit RangeExpr(CellRange range)
+  : range_(range) {
+}
+
+void Print(std::ostream& out) const override {
+  out << range_.ToString();
+}
+
+void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+  Print(out);
+}
+
+ExprPrecedence GetPrecedence() const override {
+  return EP_ATOM;
+}
+
+const CellRange* AsRange() const override {
+  return &range_;
+}
+
+// the grammar only allows ranges as function arguments,
+// and FunctionExpr reads them through AsRange()
+FormulaValue Evaluate(const CellLookup&) const override {
+  assert(false);
+  return FormulaError(FormulaError::Category::Value);
+}
+
+void Compile(ProgramBuilder&) const override {
+  assert(false);
+}
+
+private:
+CellRange range_;
+};
+
+// Aggregate over scalar and range arguments. Scalars are evaluated first,
+// in order, then the ranges are read, so the tree walk and the compiled
+// program feed the kernels the same sequence of values.
+class FunctionExpr final : public Expr {
+public:
+explicit FunctionExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+  : function_(function)
+  , args_(std::move(args)) {
+}
+
+void Print(std::ostream& out) const override {
+  out << '(' << FUNCTION_NAMES[static_cast<int>(function_)];
+  for (const auto& arg : args_) {
+      out << ' ';
+      arg->Print(out);
+  }
+  out << ')';
+}
+
+void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+  out << FUNCTION_NAMES[static_cast<int>(function_)] << '(';
+  bool first = true;
+  for (const auto& arg : args_) {
+      if (!first) {
+          out << ',';
+      }
+      first = false;
+      // an argument list is delimited like parentheses
+      arg->PrintFormula(out, EP_ADD);
+  }
+  out << ')';
+}
+
+ExprPrecedence GetPrecedence() const override {
+  return EP_ATOM;
+}
+
+FormulaValue Evaluate(const CellLookup& cell_lookup) const override {
+    std::vector<double> values;
+    for (const auto& arg : args_) {
+        if (arg->AsRange()) {
+            continue;
+        }
+        const auto value = arg->Evaluate(cell_lookup);
+        if (const auto* error = std::get_if<FormulaError>(&value)) {
+            return *error;
+        }
+        values.push_back(std::get<double>(value));
+    }
+    for (const auto& arg : args_) {
+        if (const auto* range = arg->AsRange()) {
+            if (const auto error = cell_lookup(range->from, range->to, values)) {
+                return *error;
+            }
+        }
+    }
+    return ApplyFunction(function_, values);
+}
+
+void Compile(ProgramBuilder& builder) const override {
+  std::size_t scalar_count = 0;
+  std::vector<const CellRange*> ranges;
+  for (const auto& arg : args_) {
+      if (const auto* range = arg->AsRange()) {
+          ranges.push_back(range);
+      } else {
+          arg->Compile(builder);
+          ++scalar_count;
+      }
+  }
+  builder.EmitAggregate(function_, scalar_count, ranges);
+}
+
+private:
+Function function_;
+std::vector<std::unique_ptr<Expr>> args_;
+};
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
 std::unique_ptr<Expr> MoveRoot() {
@@ -292,6 +582,10 @@ std::forward_list<Position> MoveCells() {
   return std::move(cells_);
 }
 
+std::vector<CellRange> MoveRanges() {
+  return std::move(ranges_);
+}
+
 public:
 void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
   assert(args_.size() >= 1);
@@ -324,17 +618,42 @@ void exitLiteral(FormulaParser::LiteralContext* ctx) override {
 }
 
 void exitCell(FormulaParser::CellContext* ctx) override {
-  auto value_str = ctx->CELL()->getSymbol()->getText();
-  auto value = Position::FromString(value_str);
-  if (!value.IsValid()) {
-      throw FormulaException("Invalid position: " + value_str);
-  }
+  auto value = ParsePosition(ctx->CELL());
 
   cells_.push_front(value);
-  auto node = std::make_unique<CellExpr>(&cells_.front());
+  auto node = std::make_unique<CellExpr>(value);
   args_.push_back(std::move(node));
 }
 
+void exitRange(FormulaParser::RangeContext* ctx) override {
+  const auto first = ParsePosition(ctx->CELL(0));
+  const auto second = ParsePosition(ctx->CELL(1));
+  const CellRange range{{std::min(first.row, second.row), std::min(first.col, second.col)},
+                        {std::max(first.row, second.row), std::max(first.col, second.col)}};
+
+  ranges_.push_back(range);
+  args_.push_back(std::make_unique<RangeExpr>(range));
+}
+
+void exitFunction(FormulaParser::FunctionContext* ctx) override {
+  const auto arg_count = ctx->argument().size();
+  assert(args_.size() >= arg_count);
+
+  const auto first_arg = args_.end() - static_cast<std::ptrdiff_t>(arg_count);
+  std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(first_arg),
+                                          std::make_move_iterator(args_.end()));
+  args_.erase(first_arg, args_.end());
+
+  const auto name = ctx->FUNCTION()->getSymbol()->getText();
+  const auto it = std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES), name);
+  if (it == std::end(FUNCTION_NAMES)) {
+      throw ParsingError("Unknown function: " + name);
+  }
+  const auto function = static_cast<Function>(it - std::begin(FUNCTION_NAMES));
+
+  args_.push_back(std::make_unique<FunctionExpr>(function, std::move(args)));
+}
+
 void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
   assert(args_.size() >= 2);
 
@@ -364,8 +683,18 @@ void visitErrorNode(antlr4::tree::ErrorNode* node) override {
 }
 
 private:
+static Position ParsePosition(antlr4::tree::TerminalNode* node) {
+  auto value_str = node->getSymbol()->getText();
+  auto value = Position::FromString(value_str);
+  if (!value.IsValid()) {
+      throw FormulaException("Invalid position: " + value_str);
+  }
+  return value;
+}
+
 std::vector<std::unique_ptr<Expr>> args_;
 std::forward_list<Position> cells_;
+std::vector<CellRange> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -378,10 +707,299 @@ void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendi
 }
 };
 
+// Recursive-descent parser for the grammar of Formula.g4. It reads the
+// expression in place and allocates nothing but the tree itself; tokens
+// are split exactly like the ANTLR lexer does.
+class DescentParser {
+public:
+explicit DescentParser(std::string_view text)
+    : text_(text) {
+  Advance();
+}
+
+std::unique_ptr<Expr> ParseMain() {
+  auto root = ParseExpr();
+  if (token_ != Token::End) {
+      Fail();
+  }
+  return root;
+}
+
+std::forward_list<Position> MoveCells() {
+  return std::move(cells_);
+}
+
+std::vector<CellRange> MoveRanges() {
+  return std::move(ranges_);
+}
+
+private:
+enum class Token {
+  Number,
+  Cell,
+  Function,
+  Add,
+  Sub,
+  Mul,
+  Div,
+  LeftParen,
+  RightParen,
+  Comma,
+  Colon,
+  End,
+};
+
+// expr: term ((ADD | SUB) term)*
+std::unique_ptr<Expr> ParseExpr() {
+  auto lhs = ParseTerm();
+  while (token_ == Token::Add || token_ == Token::Sub) {
+      const auto type = token_ == Token::Add ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+      Advance();
+      lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), ParseTerm());
+  }
+  return lhs;
+}
+
+// term: unary ((MUL | DIV) unary)*
+std::unique_ptr<Expr> ParseTerm() {
+  auto lhs = ParseUnary();
+  while (token_ == Token::Mul || token_ == Token::Div) {
+      const auto type = token_ == Token::Mul ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+      Advance();
+      lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), ParseUnary());
+  }
+  return lhs;
+}
+
+// unary: (ADD | SUB) unary | primary
+std::unique_ptr<Expr> ParseUnary() {
+  if (token_ == Token::Add || token_ == Token::Sub) {
+      const auto type = token_ == Token::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+      Advance();
+      return std::make_unique<UnaryOpExpr>(type, ParseUnary());
+  }
+  return ParsePrimary();
+}
+
+std::unique_ptr<Expr> ParsePrimary() {
+  switch (token_) {
+  case Token::LeftParen: {
+      Advance();
+      auto expr = ParseExpr();
+      Expect(Token::RightParen);
+      return expr;
+  }
+  case Token::Function:
+      return ParseFunction();
+  case Token::Cell: {
+      const auto cell = ParsePosition(lexeme_);
+      Advance();
+      cells_.push_front(cell);
+      return std::make_unique<CellExpr>(cell);
+  }
+  case Token::Number: {
+      const auto value = ParseNumber(lexeme_);
+      Advance();
+      return std::make_unique<NumberExpr>(value);
+  }
+  default:
+      Fail();
+  }
+}
+
+// FUNCTION '(' argument (',' argument)* ')'
+std::unique_ptr<Expr> ParseFunction() {
+  const auto it = std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES), lexeme_);
+  assert(it != std::end(FUNCTION_NAMES));
+  const auto function = static_cast<Function>(it - std::begin(FUNCTION_NAMES));
+  Advance();
+  Expect(Token::LeftParen);
+
+  std::vector<std::unique_ptr<Expr>> args;
+  args.push_back(ParseArgument());
+  while (token_ == Token::Comma) {
+      Advance();
+      args.push_back(ParseArgument());
+  }
+  Expect(Token::RightParen);
+  return std::make_unique<FunctionExpr>(function, std::move(args));
+}
+
+// argument: CELL ':' CELL | expr
+std::unique_ptr<Expr> ParseArgument() {
+  if (token_ != Token::Cell || PeekChar() != ':') {
+      return ParseExpr();
+  }
+  const auto first = ParsePosition(lexeme_);
+  Advance();
+  Advance();
+  if (token_ != Token::Cell) {
+      Fail();
+  }
+  const auto second = ParsePosition(lexeme_);
+  Advance();
+
+  const CellRange range{{std::min(first.row, second.row), std::min(first.col, second.col)},
+                        {std::max(first.row, second.row), std::max(first.col, second.col)}};
+  ranges_.push_back(range);
+  return std::make_unique<RangeExpr>(range);
+}
+
+void Expect(Token token) {
+  if (token_ != token) {
+      Fail();
+  }
+  Advance();
+}
+
+[[noreturn]] void Fail() const {
+  if (token_ == Token::End) {
+      throw ParsingError("Unexpected end of formula");
+  }
+  throw ParsingError("Error when parsing: " + std::string(lexeme_));
+}
+
+static bool IsDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+void SkipDigits() {
+  while (pos_ < text_.size() && IsDigit(text_[pos_])) {
+      ++pos_;
+  }
+}
+
+bool DigitAt(std::size_t pos) const {
+  return pos < text_.size() && IsDigit(text_[pos]);
+}
+
+char PeekChar() const {
+  auto pos = pos_;
+  while (pos < text_.size() && IsSpace(text_[pos])) {
+      ++pos;
+  }
+  return pos < text_.size() ? text_[pos] : '\0';
+}
+
+void Advance() {
+  while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+      ++pos_;
+  }
+  const auto begin = pos_;
+  if (pos_ == text_.size()) {
+      token_ = Token::End;
+      lexeme_ = {};
+      return;
+  }
+
+  const char c = text_[pos_];
+  if (IsDigit(c) || (c == '.' && DigitAt(pos_ + 1))) {
+      // UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+      SkipDigits();
+      if (pos_ < text_.size() && text_[pos_] == '.' && DigitAt(pos_ + 1)) {
+          ++pos_;
+          SkipDigits();
+      }
+      if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+          auto exponent = pos_ + 1;
+          if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+              ++exponent;
+          }
+          if (DigitAt(exponent)) {
+              pos_ = exponent;
+              SkipDigits();
+          }
+      }
+      token_ = Token::Number;
+  } else if (c >= 'A' && c <= 'Z') {
+      while (pos_ < text_.size() && text_[pos_] >= 'A' && text_[pos_] <= 'Z') {
+          ++pos_;
+      }
+      const auto letters_end = pos_;
+      SkipDigits();
+      if (pos_ != letters_end) {
+          token_ = Token::Cell;
+      } else if (std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES),
+                           text_.substr(begin, pos_ - begin)) != std::end(FUNCTION_NAMES)) {
+          token_ = Token::Function;
+      } else {
+          throw ParsingError("Error when lexing: " + std::string(text_.substr(begin, pos_ - begin)));
+      }
+  } else {
+      switch (c) {
+      case '+': token_ = Token::Add; break;
+      case '-': token_ = Token::Sub; break;
+      case '*': token_ = Token::Mul; break;
+      case '/': token_ = Token::Div; break;
+      case '(': token_ = Token::LeftParen; break;
+      case ')': token_ = Token::RightParen; break;
+      case ',': token_ = Token::Comma; break;
+      case ':': token_ = Token::Colon; break;
+      default:
+          throw ParsingError("Error when lexing: unexpected character '" + std::string(1, c) + "'");
+      }
+      ++pos_;
+  }
+  lexeme_ = text_.substr(begin, pos_ - begin);
+}
+
+static Position ParsePosition(std::string_view text) {
+  const auto value = Position::FromString(text);
+  if (!value.IsValid()) {
+      throw FormulaException("Invalid position: " + std::string(text));
+  }
+  return value;
+}
+
+// Same result as reading the literal with operator>>: overflow is an error,
+// underflow is not.
+static double ParseNumber(std::string_view text) {
+  // strtod needs a terminated string and must not read past the literal
+  // (it would take 0x1 as hexadecimal)
+  char buffer[64];
+  std::string long_text;
+  const char* str = buffer;
+  if (text.size() < sizeof(buffer)) {
+      std::copy(text.begin(), text.end(), buffer);
+      buffer[text.size()] = '\0';
+  } else {
+      long_text = std::string(text);
+      str = long_text.c_str();
+  }
+  const double value = std::strtod(str, nullptr);
+  if (value == HUGE_VAL) {
+      throw ParsingError("Invalid number: " + std::string(text));
+  }
+  return value;
+}
+
+std::string_view text_;
+std::size_t pos_ = 0;
+Token token_ = Token::End;
+std::string_view lexeme_;
+std::forward_list<Position> cells_;
+std::vector<CellRange> ranges_;
+};
+
 }  // namespace
 }  // namespace ASTImpl
 
+FormulaAST ParseFormulaAST(std::string_view expression) {
+ASTImpl::DescentParser parser(expression);
+auto root = parser.ParseMain();
+return FormulaAST(std::move(root), parser.MoveCells(), parser.MoveRanges());
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) {
+const std::string expression{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+return ParseFormulaAST(std::string_view(expression));
+}
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in) {
 using namespace antlr4;
 
 ANTLRInputStream input(in);
@@ -402,12 +1020,12 @@ tree::ParseTree* tree = parser.main();
 ASTImpl::ParseASTListener listener;
 tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges());
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str) {
 std::istringstream in(in_str);
-return ParseFormulaAST(in);
+return ParseFormulaASTWithAntlr(in);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -417,22 +1035,181 @@ for (auto cell : cells_) {
 }
 
 void FormulaAST::Print(std::ostream& out) const {
+assert(root_expr_);
 root_expr_->Print(out);
 }
 
 void FormulaAST::PrintFormula(std::ostream& out) const {
+assert(root_expr_);
 root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const CellLookup& cell_lookup) const {
+FormulaValue FormulaAST::Execute(const CellLookup& cell_lookup) const {
+using ASTImpl::OpCode;
+
+// shallow programs (almost all of them) run on the native stack
+constexpr std::size_t INLINE_STACK_DEPTH = 64;
+double inline_stack[INLINE_STACK_DEPTH];
+std::vector<double> heap_stack;
+double* stack = inline_stack;
+if (program_.stack_depth > INLINE_STACK_DEPTH) {
+    heap_stack.resize(program_.stack_depth);
+    stack = heap_stack.data();
+}
+
+// scratch buffer of aggregate arguments, allocated on first use
+std::vector<double> values;
+
+// top points past the last pushed value
+double* top = stack;
+for (const auto& instruction : program_.code) {
+    switch (instruction.op) {
+        case OpCode::PushNumber :
+            *top++ = program_.numbers[instruction.operand];
+            break;
+        case OpCode::PushCell : {
+            // the first error met ends the evaluation
+            const auto value = cell_lookup(program_.cells[instruction.operand]);
+            if (const auto* error = std::get_if<FormulaError>(&value)) {
+                return *error;
+            }
+            *top++ = std::get<double>(value);
+            break;
+        }
+        case OpCode::Add :
+            --top;
+            top[-1] = top[-1] + top[0];
+            break;
+        case OpCode::Subtract :
+            --top;
+            top[-1] = top[-1] - top[0];
+            break;
+        case OpCode::Multiply :
+            --top;
+            top[-1] = top[-1] * top[0];
+            break;
+        case OpCode::Divide : {
+            --top;
+            const auto temp = top[-1] / top[0];
+            if (!std::isfinite(temp)) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            top[-1] = temp;
+            break;
+        }
+        case OpCode::Negate :
+            top[-1] = -top[-1];
+            break;
+        case OpCode::Aggregate : {
+            const auto& aggregate = program_.aggregates[instruction.operand];
+            top -= aggregate.scalar_count;
+            values.assign(top, top + aggregate.scalar_count);
+            for (std::uint32_t i = 0; i < aggregate.range_count; ++i) {
+                const auto& range = program_.ranges[aggregate.first_range + i];
+                if (const auto error = cell_lookup(range.from, range.to, values)) {
+                    return *error;
+                }
+            }
+            const auto result = ASTImpl::ApplyFunction(aggregate.function, values);
+            if (const auto* error = std::get_if<FormulaError>(&result)) {
+                return *error;
+            }
+            *top++ = std::get<double>(result);
+            break;
+        }
+    }
+}
+assert(top == stack + 1);
+return stack[0];
+}
+
+FormulaValue FormulaAST::ExecuteTree(const CellLookup& cell_lookup) const {
+assert(root_expr_);
 return root_expr_->Evaluate(cell_lookup);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::vector<CellRange> ranges)
     : root_expr_(std::move(root_expr))
     , cells_(std::move(cells))
+    , ranges_(std::move(ranges))
     {
         cells_.sort();  // to avoid sorting in GetReferencedCells
+        cells_.unique();
+        std::sort(ranges_.begin(), ranges_.end());
+        ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
+
+        ASTImpl::ProgramBuilder builder;
+        root_expr_->Compile(builder);
+        program_ = builder.Build();
+    }
+
+FormulaAST::FormulaAST(ASTImpl::Program program)
+    : program_(std::move(program))
+    , cells_(program_.cells.begin(), program_.cells.end())
+    , ranges_(program_.ranges)
+    {
+        using ASTImpl::OpCode;
+
+        // replay the stack effect of every instruction, as Execute would
+        std::size_t depth = 0;
+        std::size_t max_depth = 0;
+        for (const auto& instruction : program_.code) {
+            std::size_t pops = 0;
+            std::size_t pushes = 1;
+            switch (instruction.op) {
+            case OpCode::PushNumber:
+                if (instruction.operand >= program_.numbers.size()) {
+                    throw ParsingError("Invalid program: number out of range");
+                }
+                break;
+            case OpCode::PushCell:
+                if (instruction.operand >= program_.cells.size()) {
+                    throw ParsingError("Invalid program: cell out of range");
+                }
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide:
+                pops = 2;
+                break;
+            case OpCode::Negate:
+                pops = 1;
+                break;
+            case OpCode::Aggregate: {
+                if (instruction.operand >= program_.aggregates.size()) {
+                    throw ParsingError("Invalid program: aggregate out of range");
+                }
+                const auto& aggregate = program_.aggregates[instruction.operand];
+                if (aggregate.first_range > program_.ranges.size()
+                        || aggregate.range_count > program_.ranges.size() - aggregate.first_range
+                        || static_cast<std::size_t>(aggregate.function)
+                               >= std::size(ASTImpl::FUNCTION_NAMES)) {
+                    throw ParsingError("Invalid program: bad aggregate");
+                }
+                pops = aggregate.scalar_count;
+                break;
+            }
+            default:
+                throw ParsingError("Invalid program: unknown instruction");
+            }
+            if (depth < pops) {
+                throw ParsingError("Invalid program: stack underflow");
+            }
+            depth = depth - pops + pushes;
+            max_depth = std::max(max_depth, depth);
+        }
+        if (depth != 1 || max_depth > program_.stack_depth) {
+            throw ParsingError("Invalid program: bad stack depth");
+        }
+
+        cells_.sort();
+        cells_.unique();
+        std::sort(ranges_.begin(), ranges_.end());
+        ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
     }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -3,15 +3,135 @@
   #include "FormulaLexer.h"
   #include "common.h"
 
+  #include <cstdint>
   #include <forward_list>
   #include <functional>
+  #include <optional>
   #include <stdexcept>
+#include <string_view>
+  #include <type_traits>
+  #include <variant>
+  #include <vector>
 
-  using CellLookup = std::function<double(Position)>;
+  // Result of evaluating a formula or looking up an operand. Errors travel
+  // as ordinary values instead of exceptions.
+  using FormulaValue = std::variant<double, FormulaError>;
+
+  // Non-owning reference to a cell lookup callable. Unlike std::function it
+  // never allocates and costs one indirect call per lookup. The callable
+  // must outlive the reference (binding a temporary lambda to an argument
+  // of Execute is fine).
+  //
+  // Aggregate functions read whole ranges through a second callable that
+  // appends the values of the non-empty cells of from:to to a buffer in
+  // row-major order and returns the first error met, if any. Without it
+  // every cell of a range is looked up one by one and counts as a value.
+  class CellLookup {
+  public:
+      template <typename F,
+                typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, CellLookup>>>
+      CellLookup(const F& func)
+          : func_(&func)
+          , call_(&CallCell<F>)
+          , range_func_(nullptr)
+          , range_call_(&LookupEachCell) {
+      }
+
+      template <typename F, typename G>
+      CellLookup(const F& func, const G& range_func)
+          : func_(&func)
+          , call_(&CallCell<F>)
+          , range_func_(&range_func)
+          , range_call_([](const CellLookup& self, Position from, Position to,
+                           std::vector<double>& values) -> std::optional<FormulaError> {
+              return (*static_cast<const G*>(self.range_func_))(from, to, values);
+          }) {
+      }
+
+      FormulaValue operator()(Position pos) const {
+          return call_(func_, pos);
+      }
+
+      std::optional<FormulaError> operator()(Position from, Position to,
+                                             std::vector<double>& values) const {
+          return range_call_(*this, from, to, values);
+      }
+
+  private:
+      using RangeCall = std::optional<FormulaError> (*)(const CellLookup&, Position, Position,
+                                                        std::vector<double>&);
+
+      const void* func_;
+      FormulaValue (*call_)(const void*, Position);
+      const void* range_func_;
+      RangeCall range_call_;
+
+      template <typename F>
+      static FormulaValue CallCell(const void* func, Position pos) {
+          return (*static_cast<const F*>(func))(pos);
+      }
+
+      static std::optional<FormulaError> LookupEachCell(const CellLookup& self, Position from,
+                                                        Position to, std::vector<double>& values) {
+          for (int row = from.row; row <= to.row; ++row) {
+              for (int col = from.col; col <= to.col; ++col) {
+                  const auto value = self({row, col});
+                  if (const auto* error = std::get_if<FormulaError>(&value)) {
+                      return *error;
+                  }
+                  values.push_back(std::get<double>(value));
+              }
+          }
+          return std::nullopt;
+      }
+  };
 
   namespace ASTImpl {
   class Expr;
-  }
+
+  enum class Function : std::uint8_t {
+      Sum,
+      Average,
+      Min,
+      Max,
+      Count,
+  };
+
+  // Formulas are compiled into a flat postfix program for a stack machine.
+  enum class OpCode : std::uint8_t {
+      PushNumber,  // operand: index in the number table
+      PushCell,    // operand: index in the cell reference table
+      Add,
+      Subtract,
+      Multiply,
+      Divide,
+      Negate,
+      Aggregate,   // operand: index in the aggregate table
+  };
+
+  // A function call. Its scalar arguments are the top `scalar_count` stack
+  // values, its ranges are ranges[first_range, first_range + range_count).
+  struct Aggregate {
+      Function function;
+      std::uint32_t scalar_count = 0;
+      std::uint32_t first_range = 0;
+      std::uint32_t range_count = 0;
+  };
+
+  struct Instruction {
+      OpCode op;
+      std::uint32_t operand = 0;
+  };
+
+  struct Program {
+      std::vector<Instruction> code;
+      std::vector<double> numbers;
+      std::vector<Position> cells;
+      std::vector<Aggregate> aggregates;
+      std::vector<CellRange> ranges;
+      std::size_t stack_depth = 0;
+  };
+  }  // namespace ASTImpl
 
   class ParsingError : public std::runtime_error {
       using std::runtime_error::runtime_error;
@@ -20,12 +140,23 @@
   class FormulaAST {
   public:
       explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                          std::forward_list<Position> cells);
-      FormulaAST(FormulaAST&&) = default;
-      FormulaAST& operator=(FormulaAST&&) = default;
+                          std::forward_list<Position> cells,
+                          std::vector<CellRange> ranges);
+      // Restores a formula from its compiled program alone, e.g. from a
+      // snapshot; the referenced cells and ranges are taken from the
+      // program tables. Such a formula has no tree: Print, PrintFormula and
+      // ExecuteTree must not be called. Throws ParsingError if the program
+      // is inconsistent (an operand out of its table or a wrong stack use).
+      explicit FormulaAST(ASTImpl::Program program);
+      FormulaAST(FormulaAST&&);
+      FormulaAST& operator=(FormulaAST&&);
       ~FormulaAST();
 
-      double Execute(const CellLookup& cell_lookup) const;
+      // Runs the compiled program.
+      FormulaValue Execute(const CellLookup& cell_lookup) const;
+      // Evaluates by walking the tree; kept as a reference implementation
+      // for differential testing and benchmarks.
+      FormulaValue ExecuteTree(const CellLookup& cell_lookup) const;
       void PrintCells(std::ostream& out) const;
       void Print(std::ostream& out) const;
       void PrintFormula(std::ostream& out) const;
@@ -38,15 +169,33 @@
           return cells_;
       }
 
+      const ASTImpl::Program& GetProgram() const {
+          return program_;
+      }
+
+      // Ranges of the aggregate functions, sorted and without duplicates.
+      // Their cells are not listed in GetCells().
+      const std::vector<CellRange>& GetRanges() const {
+          return ranges_;
+      }
+
   private:
       std::unique_ptr<ASTImpl::Expr> root_expr_;
+      ASTImpl::Program program_;
 
       // physically stores cells so that they can be
       // efficiently traversed without going through
       // the whole AST
       std::forward_list<Position> cells_;
+      std::vector<CellRange> ranges_;
   };
 
+  // Parses with the hand-written recursive-descent parser.
+  FormulaAST ParseFormulaAST(std::string_view expression);
   FormulaAST ParseFormulaAST(std::istream& in);
-  FormulaAST ParseFormulaAST(const std::string& in_str);
+
+  // Parses with the ANTLR-generated parser; the reference implementation
+  // of the grammar for differential testing and benchmarks.
+  FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
+  FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str);
   
\ No newline at end of file
@@ -0,0 +1,47 @@
+  #pragma once
+
+  #include <chrono>
+  #include <cstddef>
+  #include <functional>
+  #include <iomanip>
+  #include <iostream>
+  #include <string>
+
+  // Замер производительности: функция бенчмарка возвращает количество
+  // выполненных операций, раннер печатает время на операцию и, если задан
+  // счётчик, число выделений памяти на операцию.
+  class BenchRunner {
+  public:
+      using Counter = std::function<std::size_t()>;
+
+      BenchRunner() = default;
+      explicit BenchRunner(Counter allocation_counter)
+          : allocation_counter_(std::move(allocation_counter)) {
+      }
+
+      template <class BenchFunc>
+      void RunBench(BenchFunc func, const std::string& bench_name) {
+          const auto allocations_before = allocation_counter_ ? allocation_counter_() : 0;
+          const auto start = std::chrono::steady_clock::now();
+          const std::size_t ops = func();
+          const auto finish = std::chrono::steady_clock::now();
+          const auto allocations = (allocation_counter_ ? allocation_counter_() : 0) - allocations_before;
+
+          const double ns = std::chrono::duration<double, std::nano>(finish - start).count();
+          const double per_op = ops ? ns / ops : 0.;
+          std::cerr << std::left << std::setw(36) << bench_name << std::right
+                    << std::setw(12) << ops << " ops"
+                    << std::setw(12) << std::fixed << std::setprecision(1) << per_op << " ns/op"
+                    << std::setw(14) << (per_op > 0. ? 1e9 / per_op : 0.) << " ops/s";
+          if (allocation_counter_) {
+              std::cerr << std::setw(10) << std::setprecision(2)
+                        << (ops ? static_cast<double>(allocations) / ops : 0.) << " allocs/op";
+          }
+          std::cerr << std::defaultfloat << std::endl;
+      }
+
+  private:
+      Counter allocation_counter_;
+  };
+
+  #define RUN_BENCH(br, func) br.RunBench(func, #func)
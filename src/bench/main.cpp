@@ -0,0 +1,591 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+  #include "../common.h"
+  #include "../durable_sheet.h"
+  #include "../FormulaAST.h"
+  #include "../output.h"
+  #include "../sheet.h"
+  #include "bench_runner_p.h"
+
+  namespace {
+  std::atomic<std::size_t> allocation_count{0};
+  constexpr int TEXT_OPERAND_ROWS = 2000;
+  constexpr int TEXT_OPERAND_ROUNDS = 100;
+
+  // Формулы читают числа из текстовых ячеек; меняется только общий
+  // множитель C1, поэтому каждый пересчёт заново читает тот же текст.
+  std::size_t BenchTextOperands() {
+      Sheet sheet;
+      for (int i = 0; i < TEXT_OPERAND_ROWS; ++i) {
+          const auto row = std::to_string(i + 1);
+          sheet.SetCell({i, 0}, std::to_string(i) + ".25");
+          sheet.SetCell({i, 1}, "=A" + row + "*C1+A" + row + "/4-A" + row);
+      }
+      for (int round = 0; round < TEXT_OPERAND_ROUNDS; ++round) {
+          sheet.SetCell({0, 2}, std::to_string(round));
+          sheet.Recalculate();
+      }
+      return static_cast<std::size_t>(TEXT_OPERAND_ROWS) * TEXT_OPERAND_ROUNDS;
+  }
+
+  constexpr int PRINT_ROWS = 1000;
+  constexpr int PRINT_COLS = 20;
+  constexpr int PRINT_ROUNDS = 20;
+
+  // Лист из длинных текстов и формул печатается значениями и текстами.
+  std::size_t BenchPrintSheet() {
+      Sheet sheet;
+      for (int i = 0; i < PRINT_ROWS; ++i) {
+          for (int j = 0; j < PRINT_COLS; ++j) {
+              if (j % 2) {
+                  sheet.SetCell({i, j}, "=" + Position{i, j - 1}.ToString() + "*2+SUM(X1:Y2)");
+              } else {
+                  sheet.SetCell({i, j}, "'text value in row " + std::to_string(i));
+              }
+          }
+      }
+      std::ostringstream out;
+      for (int round = 0; round < PRINT_ROUNDS; ++round) {
+          out.str({});
+          sheet.PrintValues(out);
+          sheet.PrintTexts(out);
+      }
+      return static_cast<std::size_t>(PRINT_ROWS) * PRINT_COLS * PRINT_ROUNDS;
+  }
+
+  constexpr int EXPORT_COLS = 10;
+  constexpr int EXPORT_ROUNDS = 5;
+
+  // Выгрузка значений листа на всю высоту: числа, тексты и пустые столбцы.
+  std::size_t BenchExportValues() {
+      Sheet sheet;
+      for (int i = 0; i < Position::MAX_ROWS; ++i) {
+          for (int j = 0; j < EXPORT_COLS; j += 2) {
+              sheet.SetCell({i, j}, j % 4 ? "row " + std::to_string(i) : std::to_string(i * 0.37));
+          }
+          sheet.SetCell({i, EXPORT_COLS - 1}, "=" + Position{i, 0}.ToString() + "/7");
+      }
+      const int fd = ::open("/dev/null", O_WRONLY);
+      FileDescriptorSink sink(fd);
+      for (int round = 0; round < EXPORT_ROUNDS; ++round) {
+          sheet.ExportValues(sink);
+      }
+      ::close(fd);
+      return static_cast<std::size_t>(Position::MAX_ROWS) * EXPORT_COLS * EXPORT_ROUNDS;
+  }
+
+  constexpr int IMPORT_COLS = 10;
+
+  // TSV на всю высоту листа: числа, тексты и протянутые по столбцам формулы.
+  const std::string& ImportData() {
+      static const std::string data = [] {
+          Sheet sheet;
+          for (int i = 0; i < Position::MAX_ROWS; ++i) {
+              const auto row = std::to_string(i + 1);
+              for (int j = 0; j < IMPORT_COLS; ++j) {
+                  if (j < 4) {
+                      sheet.SetCell({i, j}, std::to_string(i * 0.37 + j));
+                  } else if (j < 6) {
+                      sheet.SetCell({i, j}, "item " + row);
+                  } else {
+                      sheet.SetCell({i, j}, "=A" + row + "*B" + row + "+C" + row + "-" + std::to_string(j));
+                  }
+              }
+          }
+          std::ostringstream out;
+          sheet.PrintTexts(out);
+          return out.str();
+      }();
+      return data;
+  }
+
+  std::size_t BenchImportTsv() {
+      const auto& data = ImportData();
+      Sheet sheet;
+      std::istringstream input(data);
+      sheet.Import(input);
+      sheet.Recalculate();
+      return static_cast<std::size_t>(Position::MAX_ROWS) * IMPORT_COLS;
+  }
+
+  // Снимок той же таблицы с вычисленными значениями.
+  const std::string& SnapshotData() {
+      static const std::string snapshot = [] {
+          Sheet sheet;
+          std::istringstream input(ImportData());
+          sheet.Import(input);
+          sheet.Recalculate();
+          std::ostringstream out;
+          StreamSink sink(out);
+          sheet.SaveSnapshot(sink);
+          return out.str();
+      }();
+      return snapshot;
+  }
+
+  std::size_t BenchLoadSnapshot() {
+      Sheet sheet;
+      sheet.LoadSnapshot(SnapshotData());
+      sheet.Recalculate();
+      return static_cast<std::size_t>(Position::MAX_ROWS) * IMPORT_COLS;
+  }
+
+  constexpr int PUBLISH_ROUNDS = 2000;
+
+  // Публикация после одной правки: заново строится только её блок, но
+  // версия копирует каталог строк блоков.
+  std::size_t BenchPublishAfterEdit() {
+      Sheet sheet;
+      std::istringstream input(ImportData());
+      sheet.Import(input);
+      sheet.Publish();
+      for (int round = 0; round < PUBLISH_ROUNDS; ++round) {
+          sheet.SetCell({round % Position::MAX_ROWS, 0}, std::to_string(round));
+          sheet.Publish();
+      }
+      return PUBLISH_ROUNDS;
+  }
+
+  // Чтение опубликованной версии: вход читателя и значение ячейки.
+  std::size_t BenchVersionReads() {
+      Sheet sheet;
+      std::istringstream input(ImportData());
+      sheet.Import(input);
+      sheet.Publish();
+      double sum = 0.;
+      for (int i = 0; i < Position::MAX_ROWS; ++i) {
+          for (int j = 6; j < IMPORT_COLS; ++j) {
+              const auto version = sheet.GetVersions().Read();
+              sum += std::get<double>(version->GetValue({i, j}));
+          }
+      }
+      if (sum == 0.) {
+          std::abort();
+      }
+      return static_cast<std::size_t>(Position::MAX_ROWS) * (IMPORT_COLS - 6);
+  }
+
+  // Тот же файл, загруженный вызовами SetCell.
+  std::size_t BenchSetCellTsv() {
+      const auto& data = ImportData();
+      Sheet sheet;
+      Position pos{0, 0};
+      std::size_t begin = 0;
+      for (std::size_t i = 0; i < data.size(); ++i) {
+          if (data[i] == '\t' || data[i] == '\n') {
+              if (i != begin) {
+                  sheet.SetCell(pos, data.substr(begin, i - begin));
+              }
+              pos = data[i] == '\t' ? Position{pos.row, pos.col + 1} : Position{pos.row + 1, 0};
+              begin = i + 1;
+          }
+      }
+      sheet.Recalculate();
+      return static_cast<std::size_t>(Position::MAX_ROWS) * IMPORT_COLS;
+  }
+
+  // Тот же файл одной пакетной правкой.
+  std::size_t BenchBatchSetCellTsv() {
+      const auto& data = ImportData();
+      Sheet sheet;
+      sheet.BeginBatch();
+      Position pos{0, 0};
+      std::size_t begin = 0;
+      for (std::size_t i = 0; i < data.size(); ++i) {
+          if (data[i] == '\t' || data[i] == '\n') {
+              if (i != begin) {
+                  sheet.SetCell(pos, data.substr(begin, i - begin));
+              }
+              pos = data[i] == '\t' ? Position{pos.row, pos.col + 1} : Position{pos.row + 1, 0};
+              begin = i + 1;
+          }
+      }
+      sheet.CommitBatch();
+      sheet.Recalculate();
+      return static_cast<std::size_t>(Position::MAX_ROWS) * IMPORT_COLS;
+  }
+
+  constexpr int FILL_DOWN_ROWS = 16000;
+
+  // Протянутая по столбцу формула: у всех ячеек одна относительная запись.
+  std::size_t BenchFillDownFormula() {
+      Sheet sheet;
+      for (int i = 0; i < FILL_DOWN_ROWS; ++i) {
+          const auto row = std::to_string(i + 1);
+          sheet.SetCell({i, 2}, "=(A" + row + "*B" + row + "+A" + row + "/2)*(B" + row + "-1)");
+      }
+      return FILL_DOWN_ROWS;
+  }
+
+  }  // namespace
+
+  void* operator new(std::size_t size) {
+      allocation_count.fetch_add(1, std::memory_order_relaxed);
+      if (void* p = std::malloc(size ? size : 1)) {
+          return p;
+      }
+      throw std::bad_alloc();
+  }
+  void operator delete(void* p) noexcept {
+      std::free(p);
+  }
+  void operator delete(void* p, std::size_t) noexcept {
+      std::free(p);
+  }
+
+  namespace {
+
+  constexpr int BENCH_ROWS = 1000;
+  constexpr int BENCH_COLS = 200;
+
+  // Заполнение плотного блока короткими текстами: ячейки, их состояния и
+  // узлы рёбер берутся из арены таблицы.
+  std::size_t BenchSetTextCells() {
+      auto sheet = CreateSheet();
+      for (int i = 0; i < BENCH_ROWS; ++i) {
+          for (int j = 0; j < BENCH_COLS; ++j) {
+              sheet->SetCell({i, j}, "text");
+          }
+      }
+      return static_cast<std::size_t>(BENCH_ROWS) * BENCH_COLS;
+  }
+
+  constexpr int JOURNAL_GROUP_SIZE = 64;
+
+  // Те же правки через журнал: группа правок фиксируется одним fdatasync.
+  std::size_t BenchJournaledTextCells() {
+      char directory[] = "/tmp/bench_journalXXXXXX";
+      if (!mkdtemp(directory)) {
+          std::abort();
+      }
+      {
+          DurableSheet sheet(directory, {SyncPolicy::Always, {}, 0});
+          int edits = 0;
+          for (int i = 0; i < BENCH_ROWS; ++i) {
+              for (int j = 0; j < BENCH_COLS; ++j) {
+                  sheet.SetCell({i, j}, "text");
+                  if (++edits % JOURNAL_GROUP_SIZE == 0) {
+                      sheet.Commit();
+                  }
+              }
+          }
+          sheet.Commit();
+      }
+      unlink((std::string(directory) + "/journal").c_str());
+      rmdir(directory);
+      return static_cast<std::size_t>(BENCH_ROWS) * BENCH_COLS;
+  }
+
+  // Повторное заполнение после очистки: блоки переиспользуются из пулов.
+  std::size_t BenchRefillClearedCells() {
+      auto sheet = CreateSheet();
+      for (int round = 0; round < 2; ++round) {
+          for (int i = 0; i < BENCH_ROWS; ++i) {
+              sheet->SetCell({i, 0}, "text");
+          }
+          for (int i = BENCH_ROWS - 1; i >= 0; --i) {
+              sheet->ClearCell({i, 0});
+          }
+      }
+      return 2 * static_cast<std::size_t>(BENCH_ROWS);
+  }
+
+  // Столбец формул, каждая из которых ссылается на ячейку слева.
+  std::size_t BenchSetFormulaCells() {
+      auto sheet = CreateSheet();
+      for (int i = 0; i < BENCH_ROWS; ++i) {
+          sheet->SetCell({i, 0}, "1");
+          sheet->SetCell({i, 1}, "=" + Position{i, 0}.ToString() + "+1");
+      }
+      return 2 * static_cast<std::size_t>(BENCH_ROWS);
+  }
+
+  // Длинная цепочка арифметики по ячейкам: A1*1.5+B2-C3/2+D4*1.5+...
+  std::string MakeArithmeticChain(int terms) {
+      std::string formula;
+      const char ops[] = {'+', '-', '*', '/'};
+      for (int i = 0; i < terms; ++i) {
+          if (i) {
+              formula += ops[i % 4];
+          }
+          formula += (i % 2) ? Position{i % 100, i % 26}.ToString() : std::to_string(i % 7 + 2);
+      }
+      return formula;
+  }
+
+  constexpr int CHAIN_TERMS = 500;
+  constexpr int CHAIN_EVALUATIONS = 20000;
+
+  const auto chain_lookup = [](Position pos) -> FormulaValue {
+      return pos.row * 0.5 + pos.col + 1.;
+  };
+
+  volatile double chain_sink;
+
+  std::size_t BenchEvaluateChainTree() {
+      const auto ast = ParseFormulaAST(MakeArithmeticChain(CHAIN_TERMS));
+      for (int i = 0; i < CHAIN_EVALUATIONS; ++i) {
+          chain_sink = std::get<double>(ast.ExecuteTree(chain_lookup));
+      }
+      return CHAIN_EVALUATIONS;
+  }
+
+  std::size_t BenchEvaluateChainBytecode() {
+      const auto ast = ParseFormulaAST(MakeArithmeticChain(CHAIN_TERMS));
+      for (int i = 0; i < CHAIN_EVALUATIONS; ++i) {
+          chain_sink = std::get<double>(ast.Execute(chain_lookup));
+      }
+      return CHAIN_EVALUATIONS;
+  }
+
+  volatile int position_sink;
+
+  // Адрес каждой ячейки листа переводится в строку и обратно.
+  std::size_t BenchPositionRoundTrip() {
+      int checksum = 0;
+      char buffer[Position::MAX_STRING_LENGTH];
+      for (int row = 0; row < Position::MAX_ROWS; ++row) {
+          for (int col = 0; col < Position::MAX_COLS; ++col) {
+              const Position pos{row, col};
+              const auto str = std::string_view(buffer, pos.ToChars(buffer) - buffer);
+              const auto parsed = Position::FromString(str);
+              checksum += parsed.row ^ parsed.col;
+          }
+      }
+      position_sink = checksum;
+      return static_cast<std::size_t>(Position::MAX_ROWS) * Position::MAX_COLS;
+  }
+
+  constexpr int PARSE_ROUNDS = 20000;
+
+  // Формулы, типичные для импорта: арифметика по соседним ячейкам и агрегаты.
+  const std::string PARSE_FORMULAS[] = {
+      "A1+B1*2",
+      "(C12-D12)/E12*100",
+      "SUM(A1:A100)/COUNT(A1:A100)",
+      "-B7*1.5E-3+MAX(C1:F9,0)",
+  };
+
+  template <typename Parse>
+  std::size_t ParseFormulas(Parse parse) {
+      std::size_t cells = 0;
+      for (int i = 0; i < PARSE_ROUNDS; ++i) {
+          for (const auto& formula : PARSE_FORMULAS) {
+              const auto ast = parse(formula);
+              cells += std::distance(ast.GetCells().begin(), ast.GetCells().end());
+          }
+      }
+      return cells ? PARSE_ROUNDS * std::size(PARSE_FORMULAS) : 0;
+  }
+
+  std::size_t BenchParseFormulaDescent() {
+      return ParseFormulas([](const std::string& formula) {
+          return ParseFormulaAST(formula);
+      });
+  }
+
+  std::size_t BenchParseFormulaAntlr() {
+      return ParseFormulas([](const std::string& formula) {
+          return ParseFormulaASTWithAntlr(formula);
+      });
+  }
+
+  constexpr int RECALC_CHAIN_LENGTH = 1000;
+  constexpr int RECALC_ROUNDS = 200;
+
+  // Цепочка A2=A1+1, A3=A2+1, ...; корень попеременно получает одну из
+  // двух формул, после чего запрашивается значение конца цепочки.
+  std::size_t RecalculateChain(const std::string& root_a, const std::string& root_b) {
+      auto sheet = CreateSheet();
+      sheet->SetCell({0, 0}, root_a);
+      for (int i = 1; i < RECALC_CHAIN_LENGTH; ++i) {
+          sheet->SetCell({i, 0}, "=" + Position{i - 1, 0}.ToString() + "+1");
+      }
+      const Position last{RECALC_CHAIN_LENGTH - 1, 0};
+      for (int round = 0; round < RECALC_ROUNDS; ++round) {
+          sheet->SetCell({0, 0}, round % 2 ? root_a : root_b);
+          sheet->GetCell(last)->GetValue();
+      }
+      return static_cast<std::size_t>(RECALC_ROUNDS) * RECALC_CHAIN_LENGTH;
+  }
+
+  std::size_t BenchRecalcChainValues() {
+      return RecalculateChain("=1", "=2");
+  }
+
+  std::size_t BenchRecalcChainErrors() {
+      return RecalculateChain("=1/0", "=2/0");
+  }
+
+  constexpr int SUM_COLUMN_CELLS = 10000;
+  constexpr int SUM_EVALUATIONS = 2000;
+
+  // Сумма столбца из 10000 чисел: диапазон против цепочки A1+A2+...
+  std::size_t EvaluateColumnSum(const std::string& expression) {
+      Sheet sheet;
+      for (int i = 0; i < SUM_COLUMN_CELLS; ++i) {
+          sheet.SetCell({i, 0}, std::to_string(i % 97));
+      }
+      const auto formula = ParseFormula(expression);
+      for (int i = 0; i < SUM_EVALUATIONS; ++i) {
+          chain_sink = std::get<double>(formula->Evaluate(sheet));
+      }
+      return static_cast<std::size_t>(SUM_EVALUATIONS) * SUM_COLUMN_CELLS;
+  }
+
+  std::size_t BenchSumColumnRange() {
+      return EvaluateColumnSum("SUM(A1:A" + std::to_string(SUM_COLUMN_CELLS) + ")");
+  }
+
+  std::size_t BenchSumColumnChain() {
+      std::string expression = "A1";
+      for (int i = 1; i < SUM_COLUMN_CELLS; ++i) {
+          expression += "+" + Position{i, 0}.ToString();
+      }
+      return EvaluateColumnSum(expression);
+  }
+
+  constexpr int COLUMN_SUM_FORMULAS = 1000;
+  constexpr int COLUMN_SUM_EDITS = 1000;
+
+  // Формулы над целым столбцом: ни ячеек-заглушек, ни ребра на каждую
+  // ячейку диапазона; правка в столбце находит формулы через индекс.
+  std::size_t BenchWholeColumnSums() {
+      Sheet sheet;
+      for (int i = 0; i < COLUMN_SUM_FORMULAS; ++i) {
+          sheet.SetCell({i, 1}, "=SUM(A1:A16384)+" + std::to_string(i));
+      }
+      for (int edit = 0; edit < COLUMN_SUM_EDITS; ++edit) {
+          sheet.SetCell({edit * 16, 0}, std::to_string(edit));
+          sheet.GetCell({edit % COLUMN_SUM_FORMULAS, 1})->GetValue();
+      }
+      return COLUMN_SUM_FORMULAS + COLUMN_SUM_EDITS;
+  }
+
+  constexpr int SIZED_SHEET_FORMULAS = 20000;
+
+  // Запись формул в таблицу, печатная область которой растянута ячейкой в
+  // правом нижнем углу: стоимость записи не должна зависеть от размера области.
+  std::size_t SetFormulasInSheetOfSize(Size size) {
+      Sheet sheet;
+      sheet.SetCell({size.rows - 1, size.cols - 1}, "corner");
+      for (int i = 0; i < SIZED_SHEET_FORMULAS; ++i) {
+          const Position pos{i / 100, i % 100};
+          sheet.SetCell(pos, "=" + Position{pos.row, pos.col + 100}.ToString() + "+1");
+      }
+      return SIZED_SHEET_FORMULAS;
+  }
+
+  std::size_t BenchSetFormulaSheet200x200() {
+      return SetFormulasInSheetOfSize({200, 200});
+  }
+
+  std::size_t BenchSetFormulaSheet2000x1000() {
+      return SetFormulasInSheetOfSize({2000, 1000});
+  }
+
+  std::size_t BenchSetFormulaSheet16384x1000() {
+      return SetFormulasInSheetOfSize({16384, 1000});
+  }
+
+  constexpr int FAN_OUT_DEPENDENTS = 50000;
+  constexpr int FAN_OUT_EDITS = 10000;
+
+  // 50k формул зависят от A1; корень правится много раз без чтения значений,
+  // поэтому после первой правки все зависимые уже устарели.
+  std::size_t BenchRepeatedRootEdits() {
+      Sheet sheet;
+      sheet.SetCell({0, 0}, "0");
+      for (int i = 1; i <= FAN_OUT_DEPENDENTS; ++i) {
+          sheet.SetCell({1 + i / 10000, i % 10000}, "=A1+1");
+      }
+      sheet.Recalculate();
+      for (int edit = 0; edit < FAN_OUT_EDITS; ++edit) {
+          sheet.SetCell({0, 0}, std::to_string(edit % 2 + 1));
+      }
+      return FAN_OUT_EDITS;
+  }
+
+  constexpr int RECALC_WIDE_ROWS = 16;
+  constexpr int RECALC_WIDE_COLS = 1000;
+  constexpr int RECALC_WIDE_ROUNDS = 20;
+
+  // Строка 1 зависит от корня A1, каждая следующая - от двух соседних ячеек
+  // предыдущей: уровни пересчёта широкие, и их можно считать параллельно.
+  std::size_t RecalculateWide(std::size_t threads) {
+      Sheet sheet;
+      sheet.SetRecalculationThreads(threads);
+      sheet.SetCell({0, 0}, "1");
+      for (int j = 0; j < RECALC_WIDE_COLS; ++j) {
+          sheet.SetCell({1, j}, "=A1+" + std::to_string(j));
+      }
+      for (int i = 2; i < RECALC_WIDE_ROWS; ++i) {
+          for (int j = 0; j < RECALC_WIDE_COLS; ++j) {
+              const auto x = Position{i - 1, j}.ToString();
+              const auto y = Position{i - 1, (j + 1) % RECALC_WIDE_COLS}.ToString();
+              sheet.SetCell({i, j}, "=(" + x + "/3+" + y + "*0.7)*(" + x + "-" + y + ")/(1+" + x + "*"
+                      + x + ")+(" + y + "-" + x + ")/(2+" + y + "*" + y + ")");
+          }
+      }
+      for (int round = 0; round < RECALC_WIDE_ROUNDS; ++round) {
+          sheet.SetCell({0, 0}, std::to_string(round));
+          sheet.Recalculate();
+      }
+      return static_cast<std::size_t>(RECALC_WIDE_ROUNDS) * RECALC_WIDE_ROWS * RECALC_WIDE_COLS;
+  }
+
+  std::size_t BenchRecalcWideSequential() {
+      return RecalculateWide(1);
+  }
+
+  std::size_t BenchRecalcWideParallel4() {
+      return RecalculateWide(4);
+  }
+
+  }  // namespace
+
+  int main() {
+      BenchRunner br([] {
+          return allocation_count.load(std::memory_order_relaxed);
+      });
+      RUN_BENCH(br, BenchSetTextCells);
+      RUN_BENCH(br, BenchJournaledTextCells);
+      RUN_BENCH(br, BenchRefillClearedCells);
+      RUN_BENCH(br, BenchSetFormulaCells);
+      RUN_BENCH(br, BenchEvaluateChainTree);
+      RUN_BENCH(br, BenchEvaluateChainBytecode);
+      RUN_BENCH(br, BenchPositionRoundTrip);
+      RUN_BENCH(br, BenchParseFormulaDescent);
+      RUN_BENCH(br, BenchParseFormulaAntlr);
+      RUN_BENCH(br, BenchRecalcChainValues);
+      RUN_BENCH(br, BenchRecalcChainErrors);
+      RUN_BENCH(br, BenchSumColumnRange);
+      RUN_BENCH(br, BenchSumColumnChain);
+      RUN_BENCH(br, BenchWholeColumnSums);
+      RUN_BENCH(br, BenchSetFormulaSheet200x200);
+      RUN_BENCH(br, BenchSetFormulaSheet2000x1000);
+      RUN_BENCH(br, BenchSetFormulaSheet16384x1000);
+      RUN_BENCH(br, BenchRepeatedRootEdits);
+      RUN_BENCH(br, BenchRecalcWideSequential);
+      RUN_BENCH(br, BenchRecalcWideParallel4);
+      RUN_BENCH(br, BenchFillDownFormula);
+      RUN_BENCH(br, BenchTextOperands);
+      RUN_BENCH(br, BenchPrintSheet);
+      RUN_BENCH(br, BenchExportValues);
+      RUN_BENCH(br, BenchSetCellTsv);
+      RUN_BENCH(br, BenchBatchSetCellTsv);
+      RUN_BENCH(br, BenchImportTsv);
+      // снимок сохраняется вне замера
+      SnapshotData();
+      RUN_BENCH(br, BenchLoadSnapshot);
+      RUN_BENCH(br, BenchPublishAfterEdit);
+      RUN_BENCH(br, BenchVersionReads);
+      return 0;
+  }
@@ -1,235 +1,353 @@
 #include <cassert>
 //#include <iostream>
-#include <stack>
 #include <string>
-#include <optional>
-#include <unordered_set>
+#include <type_traits>
+#include <utility>
 
 #include "cell.h"
+#include "sheet.h"
 
 
 
+// ------------ CellTables --------------
+CellTables::CellTables(BlockArena& arena)
+    : arena_(arena)
+    {}
+
+std::uint32_t CellTables::AddFormula(std::string_view expression, Position pos) {
+    auto key = MakeRelativeKey(expression, pos);
+    if (const auto it = formula_ids_.find(key); it != formula_ids_.end()) {
+        ++formulas_[it->second].uses;
+        return it->second;
+    }
+
+    const auto parse_begin = std::chrono::steady_clock::now();
+    auto formula = std::make_unique<RelativeFormula>(std::string(expression), pos);
+    parse_time_ += std::chrono::steady_clock::now() - parse_begin;
+    ++parse_count_;
+    const auto id = formulas_.Emplace(SharedFormula{std::move(formula), nullptr, 1});
+    const auto it = formula_ids_.emplace(std::move(key), id).first;
+    formulas_[id].key = &it->first;
+    return id;
+}
+const RelativeFormula& CellTables::GetFormula(std::uint32_t id) const {
+    return *formulas_[id].formula;
+}
+std::uint32_t CellTables::AdoptFormula(std::unique_ptr<RelativeFormula> formula) {
+    const auto anchor = formula->GetAnchor();
+    auto key = MakeRelativeKey(formula->GetExpression(anchor), anchor);
+    if (const auto it = formula_ids_.find(key); it != formula_ids_.end()) {
+        return it->second;
+    }
+
+    const auto id = formulas_.Emplace(SharedFormula{std::move(formula), nullptr, 0});
+    const auto it = formula_ids_.emplace(std::move(key), id).first;
+    formulas_[id].key = &it->first;
+    return id;
+}
+void CellTables::AcquireFormula(std::uint32_t id) {
+    ++formulas_[id].uses;
+}
+void CellTables::RemoveFormula(std::uint32_t id) {
+    auto& shared = formulas_[id];
+    if (--shared.uses == 0) {
+        formula_ids_.erase(*shared.key);
+        formulas_.Remove(id);
+    }
+}
+
+std::uint64_t CellTables::GetParseCount() const {
+    return parse_count_;
+}
+std::chrono::nanoseconds CellTables::GetParseTime() const {
+    return parse_time_;
+}
+
+std::uint32_t CellTables::AddInfluences() {
+    return influences_.Emplace(ArenaAllocator<Cell*>(&arena_));
+}
+CellTables::Influences& CellTables::GetInfluences(std::uint32_t id) {
+    return influences_[id];
+}
+const CellTables::Influences& CellTables::GetInfluences(std::uint32_t id) const {
+    return influences_[id];
+}
+void CellTables::RemoveInfluences(std::uint32_t id) {
+    influences_.Remove(id);
+}
+
 // ------------ Cell --------------
-Cell::Cell(SheetInterface* sheet)
-    : impl_(std::make_unique<EmptyImpl>())
-    , sheet_(sheet)
+Cell::Cell(Sheet* sheet, CellTables& tables, Position pos)
+    : sheet_(sheet)
+    , tables_(tables)
+    , pos_(pos)
     {}
 
-Cell::~Cell() {}
+Cell::~Cell() {
+    if (formula_ != CellTables::NONE) {
+        tables_.RemoveFormula(formula_);
+    }
+    if (influences_ != CellTables::NONE) {
+        tables_.RemoveInfluences(influences_);
+    }
+}
 
 void Cell::Set(std::string text) {
-    std::unique_ptr<Impl> temp_impl;
+    Kind kind = Kind::Text;
+    std::uint32_t formula = CellTables::NONE;
 
     if (text.empty()) {
-        // create EmptyImpl
-        temp_impl = std::make_unique<EmptyImpl>();
-    } else if ((text.size() == 1u && text[0] == FORMULA_SIGN)
-                                  || text[0] != FORMULA_SIGN) {
-        // create TextImpl
-        temp_impl = std::make_unique<TextImpl>(std::move(text));
-    } else if (text[0] == FORMULA_SIGN) {
-        // create FormulaImpl
+        kind = Kind::Empty;
+    } else if (text.size() > 1u && text[0] == FORMULA_SIGN) {
+        kind = Kind::Formula;
         try {
-            temp_impl = std::make_unique<FormulaImpl>(std::move(text));
+            formula = tables_.AddFormula(std::string_view(text).substr(1u), pos_);
         } catch (...) {
             throw FormulaException("Syntax err");
         }
-        CheckOnCircleDependency(dynamic_cast<FormulaImpl*>(temp_impl.get())->GetReferencedCells());
+        try {
+            const auto& parsed = tables_.GetFormula(formula);
+            CheckOnCircleDependency(parsed.GetReferencedCells(pos_), parsed.GetReferencedRanges(pos_));
+        } catch (...) {
+            tables_.RemoveFormula(formula);
+            throw;
+        }
+        text.clear();
     }
     CasheCleaner();
-    GraphRefresh(std::move(temp_impl));
+    GraphRefresh(kind, std::move(text), std::move(formula));
+    if (kind_ == Kind::Formula) {
+        sheet_->MarkDirty(this);
+    } else if (kind_ == Kind::Text) {
+        // текст читается формулами как число, поэтому разбирается один раз
+        StoreCashe(TextToNumber(text_));
+    }
 }
 
 void Cell::Clear() {
-    impl_ = nullptr;
+    Set(std::string{});
 }
 
 Cell::Value Cell::GetValue() const {
-    if (!cashe_.has_value()) {
-        const auto& value = impl_->GetValue(*sheet_);
-        if (std::holds_alternative<std::string>(value)) {
+    return std::visit([](auto value) -> Value {
+        if constexpr (std::is_same_v<decltype(value), std::string_view>) {
+            return std::string(value);
+        } else {
             return value;
         }
-        cashe_.emplace(value);
+    }, GetValueView());
+}
+Cell::ValueView Cell::GetValueView() const {
+    switch (kind_) {
+        case Kind::Empty :
+            return std::string_view{};
+        case Kind::Text :
+            if (text_[0] == ESCAPE_SIGN) {
+                return std::string_view(text_).substr(1u);
+            }
+            return std::string_view(text_);
+        case Kind::Formula :
+            break;
     }
 
-    return *cashe_;
+    UpdateCashe();
+
+    if (cashe_state_ == CasheState::Value) {
+        return cashe_value_;
+    }
+    return FormulaError(cashe_error_);
 }
+FormulaInterface::Value Cell::GetNumericValue() const {
+    switch (kind_) {
+        case Kind::Empty :
+            return 0.;
+        case Kind::Text :
+            break;
+        case Kind::Formula :
+            UpdateCashe();
+            break;
+    }
+
+    if (cashe_state_ == CasheState::Value) {
+        return cashe_value_;
+    }
+    return FormulaError(cashe_error_);
+}
+
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    return std::string(GetTextView());
+}
+std::string_view Cell::GetTextView() const {
+    if (kind_ == Kind::Formula && text_.empty()) {
+        // как и значение, текст формулы строится при первом чтении
+        text_.assign(1u, FORMULA_SIGN);
+        text_ += GetFormula().GetExpression(pos_);
+    }
+    return text_;
+}
+
+bool Cell::IsEmpty() const {
+    return kind_ == Kind::Empty;
 }
 
 bool Cell::IsReferenced() const {
-    return impl_->IsReferenced();
+    return kind_ == Kind::Formula && (!GetFormula().GetReferencedCells(pos_).empty()
+                                      || !GetFormula().GetReferencedRanges(pos_).empty());
 }
 std::vector<Position> Cell::GetReferencedCells() const {
-    if (!IsReferenced()) {
+    if (kind_ != Kind::Formula) {
         return {};
-    } else {
-        return dynamic_cast<FormulaImpl*>(impl_.get())->GetReferencedCells();
     }
-
+    return GetFormula().GetReferencedCells(pos_);
+}
+std::vector<CellRange> Cell::GetReferencedRanges() const {
+    if (kind_ != Kind::Formula) {
+        return {};
+    }
+    return GetFormula().GetReferencedRanges(pos_);
 }
 
 bool Cell::HasInfluences() const {
-    return !influences_.empty();
+    return influences_ != CellTables::NONE;
 }
 
-void Cell::CheckOnCircleDependency(
-        const std::vector<Position>& new_dependences) const {
-    using namespace std::literals;
+bool Cell::IsDirty() const {
+    return kind_ == Kind::Formula && cashe_state_ == CasheState::Empty;
+}
 
-    const auto& size = sheet_->GetPrintableSize();
-    Matrix visited(size.rows, std::vector<char>(size.cols, 0));
+const RelativeFormula& Cell::GetFormula() const {
+    return tables_.GetFormula(formula_);
+}
 
-    std::stack<Position> stck;
-    for (const auto pos : new_dependences) {
-        stck.push(pos);
+void Cell::UpdateCashe() const {
+    auto& counters = EvaluationScope::Current(sheet_->GetEvaluationCounters());
+    if (cashe_state_ == CasheState::Empty) {
+        ++counters.evaluations;
+        StoreCashe(GetFormula().Evaluate(*sheet_, pos_));
+    } else {
+        ++counters.cache_hits;
     }
+}
 
-    Position temp_pos;
-    Cell* temp_cell;
-
-    while (!stck.empty()) {
-        temp_pos = stck.top();
-        stck.pop();
-
-        if (auto& is_visited = visited.at(temp_pos.row).at(temp_pos.col)) {
-            continue;
-        } else {
-            is_visited = 1;
-        }
-
-        if (!sheet_->GetCell(temp_pos)) {
-            continue;
-        }
-
-        temp_cell = dynamic_cast<Cell*>(sheet_->GetCell(temp_pos));
-        if (temp_cell == this) {
-            throw CircularDependencyException("Circular Dependency in cell ["s
-                    + temp_pos.ToString() + "]"s);
-        }
-
-        if (temp_cell->IsReferenced()) {
-            for (const auto pos : temp_cell->GetReferencedCells()) {
-                if (!visited.at(temp_pos.row).at(temp_pos.col)) {
-                    stck.push(pos);
-                }
-            }
-        }
+void Cell::StoreCashe(const FormulaInterface::Value& value) const {
+    if (std::holds_alternative<double>(value)) {
+        cashe_value_ = std::get<double>(value);
+        cashe_state_ = CasheState::Value;
+    } else {
+        cashe_error_ = std::get<FormulaError>(value).GetCategory();
+        cashe_state_ = CasheState::Error;
     }
 }
 
-void Cell::GraphRefresh(std::unique_ptr<Impl> temp) {
+void Cell::CheckOnCircleDependency(const std::vector<Position>& new_dependences,
+                                   const std::vector<CellRange>& new_ranges) const {
     using namespace std::literals;
-    Cell* cell_ptr;
-    for (const auto pos : GetReferencedCells()) {
-        cell_ptr = dynamic_cast<Cell*>(sheet_->GetCell(pos));
-        cell_ptr->influences_.erase(this);
-    }
-    impl_.reset();
-    impl_ = std::move(temp);
-    for (const auto pos : GetReferencedCells()) {
-        if (!sheet_->GetCell(pos)) {
-            sheet_->SetCell(pos, ""s);
-        }
-        cell_ptr = dynamic_cast<Cell*>(sheet_->GetCell(pos));
-        cell_ptr->influences_.insert(this);
+
+    // цикл замкнётся, если одна из новых ссылок указывает на саму ячейку
+    // или на формулу, которая от неё зависит
+    if (const auto pos = sheet_->FindDependentAmong(this, new_dependences, new_ranges)) {
+        throw CircularDependencyException("Circular Dependency in cell ["s
+                + pos->ToString() + "]"s);
     }
 }
 
-void Cell::CasheCleaner() {
-    cashe_.reset();
-    std::unordered_set<Cell*> visited;
-    std::stack<Cell*> stck;
-    for (const auto cell_ptr : influences_) {
-        stck.push(cell_ptr);
+void Cell::GraphRefresh(Kind kind, std::string text, std::uint32_t formula) {
+    UnlinkReferences();
+    if (formula_ != CellTables::NONE) {
+        tables_.RemoveFormula(formula_);
+        formula_ = CellTables::NONE;
     }
-    Cell* temp_cell;
 
-    while (!stck.empty()) {
-        temp_cell = stck.top();
-        stck.pop();
+    kind_ = kind;
+    text_ = std::move(text);
+    formula_ = formula;
 
-        if (visited.count(temp_cell)) {
-            continue;
-        } else {
-            visited.insert(temp_cell);
-        }
+    LinkReferences();
+}
 
-        temp_cell->cashe_.reset();
-        for (const auto cell_ptr : temp_cell->influences_) {
-            stck.push(cell_ptr);
+void Cell::Load(std::string text) {
+    assert(kind_ == Kind::Empty && !text.empty());
+    if (text.size() > 1u && text[0] == FORMULA_SIGN) {
+        try {
+            formula_ = tables_.AddFormula(std::string_view(text).substr(1u), pos_);
+        } catch (...) {
+            throw FormulaException("Syntax err");
         }
+        kind_ = Kind::Formula;
+        cashe_state_ = CasheState::Empty;
+    } else {
+        kind_ = Kind::Text;
+        text_ = std::move(text);
+        StoreCashe(TextToNumber(text_));
     }
 }
 
-// ------------ Cell::Impl --------------
-
-Cell::Impl::Impl(std::string text) 
-    : data_(std::move(text))
-    {}
-
-// ------------ Cell::EmptyImpl --------------
-
-Cell::EmptyImpl::EmptyImpl()
-    : Cell::Impl("")
-    {}
-Cell::Value Cell::EmptyImpl::GetValue(const SheetInterface&) const {
-    return data_;
-}
-std::string Cell::EmptyImpl::GetText() const {
-    return data_;
+void Cell::LoadFormula(std::uint32_t formula) {
+    assert(kind_ == Kind::Empty);
+    tables_.AcquireFormula(formula);
+    formula_ = formula;
+    kind_ = Kind::Formula;
+    cashe_state_ = CasheState::Empty;
 }
 
-bool Cell::EmptyImpl::IsReferenced() const {
-    return false;
+void Cell::Unload() {
+    if (formula_ != CellTables::NONE) {
+        tables_.RemoveFormula(formula_);
+        formula_ = CellTables::NONE;
+    }
+    kind_ = Kind::Empty;
+    text_.clear();
+    cashe_state_ = CasheState::Empty;
 }
 
-// ------------ Cell::TextImpl --------------
-
-Cell::TextImpl::TextImpl(std::string text)
-    : Cell::Impl(std::move(text))
-    {}
-Cell::Value Cell::TextImpl::GetValue(const SheetInterface&) const {
-    if (data_[0] == ESCAPE_SIGN) {
-        return data_.substr(1u);
+Cell::Content Cell::Exchange(Content content) {
+    std::swap(kind_, content.kind);
+    text_.swap(content.text);
+    std::swap(formula_, content.formula);
+    if (kind_ == Kind::Text) {
+        StoreCashe(TextToNumber(text_));
+    } else {
+        cashe_state_ = CasheState::Empty;
     }
-    return data_;
-}
-std::string Cell::TextImpl::GetText() const {
-    return data_;
+    return content;
 }
 
-bool Cell::TextImpl::IsReferenced() const {
-    return false;
+void Cell::LinkReferences() {
+    for (const auto pos : GetReferencedCells()) {
+        sheet_->GetOrCreateCell(pos)->AddInfluence(this);
+    }
+    // на ячейки диапазонов ссылка не заводится: они могут не существовать
+    for (const auto& range : GetReferencedRanges()) {
+        sheet_->AddRangeInfluence(range, this);
+    }
 }
 
-// ------------ Cell::FormulaImpl --------------
-
-Cell::FormulaImpl::FormulaImpl(std::string text)
-    : Cell::Impl(std::move(text))
-    , formula_(ParseFormula(data_.substr(1u)))
-    {}
-Cell::Value Cell::FormulaImpl::GetValue(const SheetInterface& sheet) const {
-    using namespace std::literals;
-    const auto& value = formula_->Evaluate(sheet);
-    if (std::holds_alternative<double>(value)) {
-        return std::get<double>(value);
+void Cell::UnlinkReferences() {
+    for (const auto pos : GetReferencedCells()) {
+        sheet_->FindCell(pos)->RemoveInfluence(this);
     }
-    if (std::holds_alternative<FormulaError>(value)) {
-        return std::get<FormulaError>(value);
+    for (const auto& range : GetReferencedRanges()) {
+        sheet_->RemoveRangeInfluence(range, this);
     }
-    return ""s;
 }
-std::string Cell::FormulaImpl::GetText() const {
-    using namespace std::literals;
-    return "="s + formula_->GetExpression();
+
+void Cell::AddInfluence(Cell* cell) {
+    if (influences_ == CellTables::NONE) {
+        influences_ = tables_.AddInfluences();
+    }
+    tables_.GetInfluences(influences_).insert(cell);
 }
 
-bool Cell::FormulaImpl::IsReferenced() const {
-    return !formula_->GetReferencedCells().empty();
+void Cell::RemoveInfluence(Cell* cell) {
+    auto& influences = tables_.GetInfluences(influences_);
+    influences.erase(cell);
+    if (influences.empty()) {
+        tables_.RemoveInfluences(influences_);
+        influences_ = CellTables::NONE;
+    }
 }
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+
+void Cell::CasheCleaner() {
+    cashe_state_ = CasheState::Empty;
+    sheet_->InvalidateDependents(this);
 }
@@ -1,18 +1,82 @@
 #pragma once
 
-#include <vector>
-#include <optional>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "common.h"
 #include "formula.h"
-#include "sheet.h"
+#include "pool.h"
+
+
+
+class Cell;
+class Sheet;
 
+// Общие для всех ячеек таблицы хранилища. Разобранные формулы и множества
+// зависимых ячеек вынесены из ячейки и адресуются индексом, поэтому пустые и
+// текстовые ячейки не платят за них памятью. Формулы с одинаковой
+// относительной записью (протянутые по столбцу и т.п.) разбираются один раз
+// и хранятся в одном экземпляре со счётчиком использований.
+class CellTables {
+public:
+    using Influences = std::unordered_set<Cell*, std::hash<Cell*>, std::equal_to<Cell*>,
+                                          ArenaAllocator<Cell*>>;
+    static constexpr std::uint32_t NONE = SlotTable<Influences>::NONE;
+
+    explicit CellTables(BlockArena& arena);
+
+    // Возвращает номер формулы expression, заданной в ячейке pos, разбирая
+    // её только если такой относительной записи ещё нет. Бросает то же, что
+    // и разбор формулы.
+    std::uint32_t AddFormula(std::string_view expression, Position pos);
+    const RelativeFormula& GetFormula(std::uint32_t id) const;
+    // Добавляет готовую формулу (из снимка таблицы) без использований и
+    // возвращает её номер; если такая относительная запись уже есть,
+    // возвращает номер имеющейся.
+    std::uint32_t AdoptFormula(std::unique_ptr<RelativeFormula> formula);
+    // Добавляет одно использование формулы.
+    void AcquireFormula(std::uint32_t id);
+    // Отпускает одно использование формулы.
+    void RemoveFormula(std::uint32_t id);
+
+    std::uint32_t AddInfluences();
+    Influences& GetInfluences(std::uint32_t id);
+    const Influences& GetInfluences(std::uint32_t id) const;
+    void RemoveInfluences(std::uint32_t id);
+
+    // Число разобранных формул и суммарное время разбора.
+    std::uint64_t GetParseCount() const;
+    std::chrono::nanoseconds GetParseTime() const;
 
+private:
+    struct SharedFormula {
+        std::unique_ptr<RelativeFormula> formula;
+        // ключ в formula_ids_; узлы unordered_map не переезжают
+        const std::string* key;
+        std::size_t uses;
+    };
+
+    BlockArena& arena_;
+    SlotTable<SharedFormula> formulas_;
+    std::unordered_map<std::string, std::uint32_t> formula_ids_;
+    SlotTable<Influences> influences_;
+    std::uint64_t parse_count_ = 0;
+    std::chrono::nanoseconds parse_time_{0};
+};
 
+// Ячейка хранит вид содержимого прямо в себе: текст лежит в std::string
+// (короткие строки - без выделения памяти), у формулы - индекс в таблице
+// формул, её текст и закешированный результат вычисления. У текста в том же
+// кеше лежит его значение как аргумента формулы.
 class Cell : public CellInterface {
 public:
-    Cell(SheetInterface* sheet);
+    Cell(Sheet* sheet, CellTables& tables, Position pos);
     ~Cell();
 
     void Set(std::string text);
@@ -20,69 +84,93 @@ public:
 
     Value GetValue() const override;
     std::string GetText() const override;
+    ValueView GetValueView() const override;
+    std::string_view GetTextView() const override;
+    // Значение ячейки как аргумента формулы.
+    FormulaInterface::Value GetNumericValue() const;
+
+    bool IsEmpty() const;
 
     bool IsReferenced() const;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<CellRange> GetReferencedRanges() const;
 
+    // Есть ли формулы, ссылающиеся на ячейку по отдельности (ссылки через
+    // диапазоны хранит таблица).
     bool HasInfluences() const;
+    // Формула, значение которой ещё не вычислено.
+    bool IsDirty() const;
 
 private:
-    class Impl {
-    public:
-        explicit Impl(std::string text);
-        virtual ~Impl() = default;
-
-        virtual Value GetValue(const SheetInterface&) const = 0;
-        virtual std::string GetText() const = 0;
-
-        virtual bool IsReferenced() const = 0;
+    // таблица ведёт очередь пересчёта и обходит граф зависимостей
+    friend class Sheet;
 
-    protected:
-        std::string data_;
-    };
-    
-    class EmptyImpl : public Impl {
-    public:
-        explicit EmptyImpl();
-        Value GetValue(const SheetInterface&) const override;
-        std::string GetText() const override;
-
-        bool IsReferenced() const override;
-    };
-    
-    class TextImpl : public Impl {
-    public:
-        explicit TextImpl(std::string text);
-        Value GetValue(const SheetInterface&) const override;
-        std::string GetText() const override;
-
-        bool IsReferenced() const override;
+    enum class Kind : std::uint8_t {
+        Empty,
+        Text,
+        Formula,
     };
-    
-    class FormulaImpl : public Impl {
-    public:
-        explicit FormulaImpl(std::string text);
 
-        Value GetValue(const SheetInterface& sheet) const override;
-        std::string GetText() const override;
-
-        bool IsReferenced() const override;
-        std::vector<Position> GetReferencedCells() const;
+    enum class CasheState : std::uint8_t {
+        Empty,
+        Value,
+        Error,
+    };
 
-    private:
-        std::unique_ptr<FormulaInterface> formula_;
+    // Содержимое ячейки без рёбер графа и кеша (пакетная правка,
+    // Sheet::CommitBatch).
+    struct Content {
+        Kind kind = Kind::Empty;
+        std::string text;
+        std::uint32_t formula = CellTables::NONE;
     };
-    
-private:
-    std::unique_ptr<Impl> impl_;
-    mutable SheetInterface* sheet_;
-    std::unordered_set<Cell*> influences_;
-    mutable std::optional<Value> cashe_;
 
-private:
-    using Matrix = std::vector<std::vector<char>>;
+    Sheet* sheet_;
+    CellTables& tables_;
+    Position pos_;
+    // текст ячейки; у формулы - её выражение со знаком "=", которое
+    // строится при первом чтении
+    mutable std::string text_;
+    mutable double cashe_value_ = 0.;
+    std::uint32_t formula_ = CellTables::NONE;
+    std::uint32_t influences_ = CellTables::NONE;
+    // место в очереди пересчёта таблицы
+    std::uint32_t dirty_slot_ = CellTables::NONE;
+    // отметка последнего обхода графа, в котором участвовала ячейка
+    std::uint32_t visit_mark_ = 0;
+    Kind kind_ = Kind::Empty;
+    mutable CasheState cashe_state_ = CasheState::Empty;
+    mutable FormulaError::Category cashe_error_ = FormulaError::Category::Value;
+    // число невычисленных аргументов при раскладке формул по уровням
+    // (Sheet::ForEachLevel); занимает выравнивание в конце объекта
+    std::uint32_t waiting_args_ = 0;
 
-    void CheckOnCircleDependency(const std::vector<Position>& new_dependences) const;
-    void GraphRefresh(std::unique_ptr<Impl> temp);
+private:
+    const RelativeFormula& GetFormula() const;
+    // Вычисляет формулу, если её кеш сброшен, и учитывает попадание или
+    // промах в счётчиках таблицы.
+    void UpdateCashe() const;
+    void StoreCashe(const FormulaInterface::Value& value) const;
+
+    void CheckOnCircleDependency(const std::vector<Position>& new_dependences,
+                                 const std::vector<CellRange>& new_ranges) const;
+    void GraphRefresh(Kind kind, std::string text, std::uint32_t formula);
+    // Заполняет пустую ячейку, не заводя рёбер графа и не проверяя циклы;
+    // этим занимается загрузка таблицы (Sheet::Import).
+    void Load(std::string text);
+    // То же для формулы с номером formula в таблице формул.
+    void LoadFormula(std::uint32_t formula);
+    // Возвращает загруженную ячейку в пустое состояние; рёбра к этому
+    // моменту должны быть сняты.
+    void Unload();
+    // Подменяет содержимое content и возвращает прежнее вместе с его
+    // формулой. Рёбра к этому моменту должны быть сняты; кеш формулы
+    // сбрасывается, значение текста вычисляется заново.
+    Content Exchange(Content content);
+    // Рёбра от ячеек, на которые ссылается формула, к ней самой.
+    void LinkReferences();
+    void UnlinkReferences();
+    void AddInfluence(Cell* cell);
+    void RemoveInfluence(Cell* cell);
     void CasheCleaner();
 };
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -18,14 +21,32 @@ struct Position {
 
     bool IsValid() const;
     std::string ToString() const;
+    // Пишет адрес ячейки в буфер длиной не меньше MAX_STRING_LENGTH без
+    // завершающего нуля и возвращает указатель за последним символом.
+    // Для некорректной позиции ничего не пишет.
+    char* ToChars(char* buffer) const;
 
     static Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    // "XFD16384"
+    static constexpr std::size_t MAX_STRING_LENGTH = 8;
     static const Position NONE;
 };
 
+// Прямоугольный диапазон ячеек: from - левый верхний угол, to - правый нижний.
+struct CellRange {
+    Position from;
+    Position to;
+
+    bool operator==(CellRange rhs) const;
+    bool operator<(CellRange rhs) const;
+
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -36,7 +57,7 @@ struct Size {
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
-    enum class Category {
+    enum class Category : std::uint8_t {
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,  // в результате вычисления возникло деление на ноль
@@ -52,7 +73,6 @@ public:
 
 private:
     Category category_;
-    std::string description_;
 };
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe);
@@ -101,6 +121,14 @@ public:
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
 
+    // То же значение, что и у GetValue(), но текст не копируется.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
+    // Варианты GetValue() и GetText() для чтения без копирования. Строки
+    // остаются действительными, пока ячейка не изменена или не удалена.
+    virtual ValueView GetValueView() const = 0;
+    virtual std::string_view GetTextView() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
@@ -151,6 +179,17 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает значение ячейки как аргумента формулы: число, ноль для
+    // пустой или отсутствующей ячейки либо ошибку.
+    virtual std::variant<double, FormulaError> GetNumericValue(Position pos) const = 0;
+
+    // Дописывает в values числовые значения непустых ячеек прямоугольника с
+    // углами from (левый верхний) и to (правый нижний) построчно. Ячейки
+    // трактуются так же, как аргументы формулы. Возвращает первую встреченную
+    // ошибку, если она есть.
+    virtual std::optional<FormulaError> GetRangeValues(Position from, Position to,
+                                                       std::vector<double>& values) const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
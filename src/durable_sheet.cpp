@@ -0,0 +1,241 @@
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "durable_sheet.h"
+#include "snapshot.h"
+
+
+
+using namespace std::literals;
+
+namespace {
+constexpr const char* CHECKPOINT_NAME = "checkpoint";
+constexpr const char* JOURNAL_NAME = "journal";
+constexpr const char* TEMPORARY_SUFFIX = ".tmp";
+
+// номер поколения перед снимком; 8 байтов сохраняют выравнивание снимка
+constexpr std::size_t CHECKPOINT_HEADER_SIZE = sizeof(std::uint64_t);
+
+// errno читается до того, как сборка сообщения успеет его испортить
+[[noreturn]] void ThrowSystemError(const char* call, const std::string& path) {
+    const int error = errno;
+    throw std::system_error(error, std::generic_category(), call + " "s + path);
+}
+
+bool FileExists(const std::string& path) {
+    struct stat info;
+    if (::stat(path.c_str(), &info) == 0) {
+        return true;
+    }
+    if (errno != ENOENT) {
+        ThrowSystemError("stat", path);
+    }
+    return false;
+}
+
+int OpenFile(const std::string& path, int flags) {
+    const int fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ThrowSystemError("open", path);
+    }
+    return fd;
+}
+
+void SyncFile(int fd, const std::string& path) {
+    if (::fsync(fd) != 0) {
+        ThrowSystemError("fsync", path);
+    }
+}
+
+// Записывает файл path целиком: сначала во временный файл, который затем
+// атомарно подменяет path. После сбоя на диске остаётся либо прежний, либо
+// новый файл. write(OutputSink&) пишет содержимое.
+template <typename F>
+void ReplaceFile(const std::string& directory, const std::string& path, F write) {
+    const auto temporary = path + TEMPORARY_SUFFIX;
+    const int fd = OpenFile(temporary, O_WRONLY | O_CREAT | O_TRUNC);
+    try {
+        FileDescriptorSink sink(fd);
+        write(sink);
+        SyncFile(fd, temporary);
+    } catch (...) {
+        ::close(fd);
+        ::unlink(temporary.c_str());
+        throw;
+    }
+    ::close(fd);
+    if (::rename(temporary.c_str(), path.c_str()) != 0) {
+        ThrowSystemError("rename", temporary);
+    }
+    // переименование долговечно только после сброса каталога
+    const int directory_fd = OpenFile(directory, O_RDONLY | O_DIRECTORY);
+    const int result = ::fsync(directory_fd);
+    const int error = errno;
+    ::close(directory_fd);
+    if (result != 0) {
+        throw std::system_error(error, std::generic_category(), "fsync " + directory);
+    }
+}
+}  // namespace
+
+DurableSheet::DurableSheet(std::string directory)
+    : DurableSheet(std::move(directory), Options{})
+    {}
+
+DurableSheet::DurableSheet(std::string directory, Options options)
+    : directory_(std::move(directory))
+    , options_(options)
+    {
+        try {
+            LoadCheckpoint();
+            OpenJournal();
+        } catch (...) {
+            CloseJournal();
+            throw;
+        }
+    }
+
+DurableSheet::~DurableSheet() {
+    try {
+        if (journal_) {
+            journal_->Sync();
+        }
+    } catch (...) {
+    }
+    CloseJournal();
+}
+
+void DurableSheet::SetCell(Position pos, std::string text) {
+    sheet_.SetCell(pos, text);
+    journal_->AppendSet(pos, text);
+}
+
+void DurableSheet::ClearCell(Position pos) {
+    sheet_.ClearCell(pos);
+    journal_->AppendClear(pos);
+}
+
+void DurableSheet::Commit() {
+    journal_->Commit();
+    if (options_.checkpoint_bytes && journal_->GetSize() >= options_.checkpoint_bytes) {
+        Checkpoint();
+    }
+}
+
+void DurableSheet::Sync() {
+    journal_->Sync();
+}
+
+void DurableSheet::Checkpoint() {
+    // если запись контрольной точки сорвётся, правки останутся в журнале
+    journal_->Sync();
+
+    // пока журнал не сменён, он старше контрольной точки и при
+    // восстановлении отбрасывается: её правки уже в снимке
+    const auto generation = generation_ + 1;
+    ReplaceFile(directory_, GetPath(CHECKPOINT_NAME), [this, generation](OutputSink& sink) {
+        sink.Write(reinterpret_cast<const char*>(&generation), sizeof(generation));
+        sheet_.SaveSnapshot(sink);
+    });
+    generation_ = generation;
+    ResetJournal();
+}
+
+const Sheet& DurableSheet::GetSheet() const {
+    return sheet_;
+}
+
+void DurableSheet::Recalculate() {
+    sheet_.Recalculate();
+}
+
+std::string DurableSheet::GetPath(const char* name) const {
+    return directory_ + '/' + name;
+}
+
+void DurableSheet::LoadCheckpoint() {
+    const auto path = GetPath(CHECKPOINT_NAME);
+    if (!FileExists(path)) {
+        return;
+    }
+    const MappedFile file(path);
+    const auto data = file.GetData();
+    if (data.size() < CHECKPOINT_HEADER_SIZE) {
+        throw SnapshotException("Checkpoint: file is too short"s);
+    }
+    std::memcpy(&generation_, data.data(), sizeof(generation_));
+    sheet_.LoadSnapshot(data.substr(CHECKPOINT_HEADER_SIZE));
+}
+
+void DurableSheet::OpenJournal() {
+    const auto path = GetPath(JOURNAL_NAME);
+    if (!FileExists(path)) {
+        ResetJournal();
+        return;
+    }
+
+    std::size_t valid = 0;
+    std::size_t size = 0;
+    {
+        const MappedFile file(path);
+        const auto data = file.GetData();
+        const auto generation = ReadJournalHeader(data);
+        if (generation < generation_) {
+            // сбой между записью контрольной точки и сменой журнала
+            ResetJournal();
+            return;
+        }
+        if (generation > generation_) {
+            throw JournalException("Journal: newer than the checkpoint"s);
+        }
+        size = data.size();
+        valid = JOURNAL_HEADER_SIZE + ForEachJournalRecord(data.substr(JOURNAL_HEADER_SIZE),
+            [this](const JournalRecord& record) {
+                if (record.kind == JournalRecord::Kind::Set) {
+                    sheet_.SetCell(record.pos, std::string(record.text));
+                } else {
+                    sheet_.ClearCell(record.pos);
+                }
+            });
+    }
+
+    journal_fd_ = OpenFile(path, O_WRONLY | O_APPEND);
+    if (valid != size) {
+        // запись, оборванную сбоем, затёрли бы новые
+        if (::ftruncate(journal_fd_, static_cast<off_t>(valid)) != 0) {
+            ThrowSystemError("ftruncate", path);
+        }
+        SyncFile(journal_fd_, path);
+    }
+    StartJournal(valid);
+}
+
+void DurableSheet::ResetJournal() {
+    const auto path = GetPath(JOURNAL_NAME);
+    ReplaceFile(directory_, path, [this](OutputSink& sink) {
+        const auto header = MakeJournalHeader(generation_);
+        sink.Write(header.data(), header.size());
+    });
+    // прежний журнал остаётся открытым, пока новый не подменил его
+    CloseJournal();
+    journal_fd_ = OpenFile(path, O_WRONLY | O_APPEND);
+    StartJournal(JOURNAL_HEADER_SIZE);
+}
+
+void DurableSheet::StartJournal(std::uint64_t size) {
+    journal_ = std::make_unique<JournalWriter>(journal_fd_, size, options_.sync,
+                                               options_.sync_interval);
+}
+
+void DurableSheet::CloseJournal() {
+    journal_.reset();
+    if (journal_fd_ >= 0) {
+        ::close(journal_fd_);
+        journal_fd_ = -1;
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "journal.h"
+#include "sheet.h"
+
+// Таблица, правки которой переживают перезапуск. В каталоге хранятся
+// контрольная точка (снимок таблицы, см. snapshot.h, с номером поколения)
+// и журнал правок того же поколения, сделанных после неё. Каждая правка
+// стоит одной короткой дозаписи в журнал; когда журнал разрастается,
+// таблица сохраняется в новую контрольную точку, а журнал начинается
+// заново, поэтому восстановление проигрывает не больше checkpoint_bytes
+// журнала.
+class DurableSheet {
+public:
+    struct Options {
+        SyncPolicy sync = SyncPolicy::Always;
+        // для SyncPolicy::Interval: фиксация сбрасывает журнал на диск, если
+        // с прошлого сброса прошло не меньше интервала. Правки,
+        // зафиксированные после последнего сброса, при сбое питания могут
+        // потеряться, пока их не сбросит следующая фиксация, Sync,
+        // Checkpoint или закрытие таблицы; таймера, сбрасывающего их по
+        // истечении интервала, нет
+        std::chrono::milliseconds sync_interval{100};
+        // размер журнала, после которого Commit делает контрольную точку;
+        // 0 - только по вызову Checkpoint
+        std::uint64_t checkpoint_bytes = 64 << 20;
+    };
+
+    // Открывает хранилище в существующем каталоге directory: загружает
+    // контрольную точку, проигрывает журнал и отрезает запись, оборванную
+    // сбоем. Бросает SnapshotException и JournalException для повреждённых
+    // файлов и std::system_error при ошибках ввода-вывода.
+    explicit DurableSheet(std::string directory);
+    DurableSheet(std::string directory, Options options);
+    DurableSheet(const DurableSheet&) = delete;
+    DurableSheet& operator=(const DurableSheet&) = delete;
+    // Фиксирует оставшиеся правки и сбрасывает журнал на диск (см. Sync);
+    // ошибки ввода-вывода при этом теряются.
+    ~DurableSheet();
+
+    // Правки применяются к таблице сразу, а в журнал попадают, только если
+    // таблица их приняла; исключения - те же, что у Sheet.
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+
+    // Фиксирует правки, сделанные после прошлой фиксации: отдаёт их в
+    // журнал одной записью в файл и сбрасывает на диск согласно политике.
+    // Правки между фиксациями составляют группу и платят за сброс вместе.
+    void Commit();
+    // То же, что Commit, но журнал сбрасывается на диск без учёта интервала
+    // (если политика не SyncPolicy::Never), например перед простоем.
+    void Sync();
+    // Сохраняет таблицу в новую контрольную точку и начинает пустой журнал.
+    void Checkpoint();
+
+    const Sheet& GetSheet() const;
+    void Recalculate();
+
+private:
+    std::string directory_;
+    Options options_;
+    Sheet sheet_;
+    std::uint64_t generation_ = 0;
+    int journal_fd_ = -1;
+    std::unique_ptr<JournalWriter> journal_;
+
+private:
+    std::string GetPath(const char* name) const;
+    void LoadCheckpoint();
+    void OpenJournal();
+    // Заменяет журнал пустым журналом текущего поколения.
+    void ResetJournal();
+    void StartJournal(std::uint64_t size);
+    void CloseJournal();
+};
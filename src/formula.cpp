@@ -1,6 +1,6 @@
 #include <algorithm>
 #include <cassert>
-#include <cctype>
+#include <charconv>
 #include <sstream>
 
 #include "formula.h"
@@ -15,19 +15,7 @@ using namespace std::literals;
 // ------------ FormulaError ----------------------------
 FormulaError::FormulaError(Category category)
     : category_(category)
-    {
-        switch (category_) {
-            case Category::Ref :
-                description_ = "#REF!"s;
-                break;
-            case Category::Value :
-                description_ = "#VALUE!"s;
-                break;
-            case Category::Div0 :
-                description_ = "#DIV/0!"s;
-                break;
-        }
-    }
+    {}
 
 FormulaError::Category FormulaError::GetCategory() const {
     return category_;
@@ -38,7 +26,15 @@ bool FormulaError::operator==(FormulaError rhs) const {
 }
 
 std::string_view FormulaError::ToString() const {
-    return description_;
+    switch (category_) {
+        case Category::Ref :
+            return "#REF!"sv;
+        case Category::Value :
+            return "#VALUE!"sv;
+        case Category::Div0 :
+            return "#DIV/0!"sv;
+    }
+    return {};
 }
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
@@ -47,71 +43,209 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 
 
 namespace {
+Position Shift(Position pos, Position from, Position to) {
+    return {pos.row + to.row - from.row, pos.col + to.col - from.col};
+}
+
+// Переписывает ссылки на ячейки: rewrite(Position, std::string&) дописывает
+// замену ссылки, copy(char, std::string&) - символ остального текста.
+// Ссылки выделяются так же, как лексемой CELL грамматики, а экспонента числа
+// (1E5) ссылкой не считается.
+template <typename Rewrite, typename Copy>
+std::string RewriteReferences(std::string_view text, Rewrite rewrite, Copy copy) {
+    const auto is_digit = [](char c) {
+        return c >= '0' && c <= '9';
+    };
+    const auto is_upper = [](char c) {
+        return c >= 'A' && c <= 'Z';
+    };
+
+    std::string out;
+    out.reserve(text.size());
+    std::size_t i = 0;
+    while (i < text.size()) {
+        const std::size_t begin = i;
+        if (is_digit(text[i]) || text[i] == '.') {
+            while (i < text.size() && (is_digit(text[i]) || text[i] == '.')) {
+                ++i;
+            }
+            if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+                std::size_t exponent = i + 1;
+                if (exponent < text.size() && (text[exponent] == '+' || text[exponent] == '-')) {
+                    ++exponent;
+                }
+                if (exponent < text.size() && is_digit(text[exponent])) {
+                    i = exponent;
+                    while (i < text.size() && is_digit(text[i])) {
+                        ++i;
+                    }
+                }
+            }
+        } else if (is_upper(text[i])) {
+            while (i < text.size() && is_upper(text[i])) {
+                ++i;
+            }
+            const std::size_t letters_end = i;
+            while (i < text.size() && is_digit(text[i])) {
+                ++i;
+            }
+            if (i != letters_end) {
+                rewrite(Position::FromString(text.substr(begin, i - begin)), out);
+                continue;
+            }
+        } else {
+            ++i;
+        }
+        for (auto j = begin; j < i; ++j) {
+            copy(text[j], out);
+        }
+    }
+    return out;
+}
+
 class Formula : public FormulaInterface {
 public:
     explicit Formula(std::string expression)
-        : ast_(ParseFormulaAST(expression))
+        : formula_(std::move(expression), ANCHOR)
         {}
 
     Value Evaluate(const SheetInterface& sheet) const override {
-        using namespace std::literals;
-        try {
-            return ast_.Execute([&sheet](const Position pos) {
-                const CellInterface* cell_ptr;
-                try {
-                    cell_ptr = sheet.GetCell(pos);
-                } catch (const InvalidPositionException&) {
-                    throw FormulaError(FormulaError::Category::Ref);
-                }
-                if (!cell_ptr) {
-                    return 0.;
-                }
-
-                const auto& value = cell_ptr->GetValue();
-                if (std::holds_alternative<double>(value)) {
-                    return std::get<double>(value);
-                }
-                if (std::holds_alternative<std::string>(value)) {
-                    const auto& str = cell_ptr->GetText();
-                    if (str.empty()) { // for EmptyImpl case
-                        return 0.;
-                    }
-                    if (str[0] == ESCAPE_SIGN) {
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
-                    try {
-                        return std::stod(str);
-                    } catch (...) {
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
-                }
-                if (std::holds_alternative<FormulaError>(value)) {
-                    throw std::get<FormulaError>(value);
-                }
-
-                throw std::runtime_error("Reached the end of lambda while Evaluate formula in cell ["s +
-                        pos.ToString() + "]"s);
-            });
-        } catch (const FormulaError& e) {
-            return e;
-        }
+        return formula_.Evaluate(sheet, ANCHOR);
     }
     std::string GetExpression() const override {
-        std::ostringstream out;
-        ast_.PrintFormula(out);
-        return out.str();
+        return formula_.GetExpression(ANCHOR);
     }
-
-    std::vector<Position> GetReferencedCells() const {
-        const auto& cells = ast_.GetCells();
-        return std::vector<Position>(cells.begin(), cells.end());
+    std::vector<Position> GetReferencedCells() const override {
+        return formula_.GetReferencedCells(ANCHOR);
+    }
+    std::vector<CellRange> GetReferencedRanges() const override {
+        return formula_.GetReferencedRanges(ANCHOR);
     }
 
 private:
-    FormulaAST ast_;
+    // отдельная формула не сдвигается
+    static constexpr Position ANCHOR{0, 0};
+
+    RelativeFormula formula_;
 };
 }  // namespace
 
+// ------------ RelativeFormula ----------------------------
+RelativeFormula::RelativeFormula(std::string expression, Position anchor)
+    : ast_(ParseFormulaAST(expression))
+    , anchor_(anchor)
+    {
+        std::ostringstream out;
+        ast_.PrintFormula(out);
+        expression_ = out.str();
+    }
+
+RelativeFormula::RelativeFormula(FormulaAST ast, Position anchor, std::string expression)
+    : ast_(std::move(ast))
+    , anchor_(anchor)
+    , expression_(std::move(expression))
+    {}
+
+RelativeFormula::Value RelativeFormula::Evaluate(const SheetInterface& sheet, Position pos) const {
+    const auto range_lookup = [&](Position from, Position to, std::vector<double>& values) {
+        return sheet.GetRangeValues(Shift(from, anchor_, pos), Shift(to, anchor_, pos), values);
+    };
+    const auto cell_lookup = [&](Position ref) -> FormulaValue {
+        ref = Shift(ref, anchor_, pos);
+        if (!ref.IsValid()) {
+            return FormulaError(FormulaError::Category::Ref);
+        }
+        return sheet.GetNumericValue(ref);
+    };
+    return ast_.Execute({cell_lookup, range_lookup});
+}
+
+std::string RelativeFormula::GetExpression(Position pos) const {
+    if (pos == anchor_) {
+        return expression_;
+    }
+    return RewriteReferences(expression_,
+        [this, pos](Position ref, std::string& out) {
+            char buffer[Position::MAX_STRING_LENGTH];
+            out.append(buffer, Shift(ref, anchor_, pos).ToChars(buffer));
+        },
+        [](char c, std::string& out) {
+            out += c;
+        });
+}
+
+std::vector<Position> RelativeFormula::GetReferencedCells(Position pos) const {
+    std::vector<Position> cells;
+    for (const auto ref : ast_.GetCells()) {
+        cells.push_back(Shift(ref, anchor_, pos));
+    }
+    return cells;
+}
+
+std::vector<CellRange> RelativeFormula::GetReferencedRanges(Position pos) const {
+    std::vector<CellRange> ranges = ast_.GetRanges();
+    for (auto& range : ranges) {
+        range = {Shift(range.from, anchor_, pos), Shift(range.to, anchor_, pos)};
+    }
+    return ranges;
+}
+
+const FormulaAST& RelativeFormula::GetAST() const {
+    return ast_;
+}
+
+Position RelativeFormula::GetAnchor() const {
+    return anchor_;
+}
+
+std::string MakeRelativeKey(std::string_view expression, Position anchor) {
+    // ссылка записывается как $строка,столбец; - смещение от anchor,
+    // а символ $ самого выражения удваивается, чтобы записи не совпадали
+    return RewriteReferences(expression,
+        [anchor](Position ref, std::string& out) {
+            if (!ref.IsValid()) {
+                throw FormulaException("Invalid position in formula");
+            }
+            out += '$';
+            out += std::to_string(ref.row - anchor.row);
+            out += ',';
+            out += std::to_string(ref.col - anchor.col);
+            out += ';';
+        },
+        [](char c, std::string& out) {
+            out += c;
+            if (c == '$') {
+                out += c;
+            }
+        });
+}
+
+std::vector<Position> ListReferences(std::string_view expression) {
+    std::vector<Position> refs;
+    RewriteReferences(expression,
+        [&refs](Position ref, std::string&) {
+            if (!ref.IsValid()) {
+                throw FormulaException("Invalid position in formula");
+            }
+            refs.push_back(ref);
+        },
+        [](char, std::string&) {});
+    return refs;
+}
+
+FormulaInterface::Value TextToNumber(std::string_view text) {
+    if (text.empty()) { // for empty cell case
+        return 0.;
+    }
+    // число должно занимать весь текст; from_chars не зависит от локали
+    double number;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (error != std::errc{} || end != text.data() + text.size()) {
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return number;
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
 }
@@ -5,12 +5,16 @@
 #include "FormulaAST.h"
 
 #include <memory>
+#include <string>
+#include <string_view>
 #include <variant>
 
   // Формула, позволяющая вычислять и обновлять арифметическое выражение.
   // Поддерживаемые возможности:
   // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
   // * Значения ячеек в качестве переменных: A1+B2*C3
+  // * Агрегатные функции SUM, AVERAGE, MIN, MAX, COUNT от чисел, выражений и
+  //   диапазонов ячеек: SUM(A1:B10,C1*2). Пустые ячейки диапазона пропускаются.
   // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
   // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
   // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,10 +38,56 @@ public:
 
       // Возвращает список ячеек, которые непосредственно задействованы в вычислении
       // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-      // ячеек.
+      // ячеек. Ячейки диапазонов сюда не входят.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+      // Возвращает диапазоны аргументов агрегатных функций, отсортированные и
+      // без повторов.
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
 };
 
+// Формула, разобранная для ячейки anchor. Ячейка в позиции pos с той же
+// относительной записью формулы (см. MakeRelativeKey) использует этот же
+// экземпляр: все ссылки сдвигаются на pos - anchor.
+class RelativeFormula {
+public:
+    using Value = FormulaInterface::Value;
+
+    // Бросает то же, что и ParseFormulaAST.
+    RelativeFormula(std::string expression, Position anchor);
+    // Собирает формулу из уже разобранного выражения (например, из снимка
+    // таблицы); expression - его печатная запись для ячейки anchor.
+    RelativeFormula(FormulaAST ast, Position anchor, std::string expression);
+
+    Value Evaluate(const SheetInterface& sheet, Position pos) const;
+    std::string GetExpression(Position pos) const;
+    std::vector<Position> GetReferencedCells(Position pos) const;
+    std::vector<CellRange> GetReferencedRanges(Position pos) const;
+
+    const FormulaAST& GetAST() const;
+    Position GetAnchor() const;
+
+private:
+    FormulaAST ast_;
+    Position anchor_;
+    // выражение для ячейки anchor
+    std::string expression_;
+};
+
+// Относительная запись выражения для ячейки anchor: каждая ссылка заменена
+// смещением от anchor, так что у формул, совпадающих после сдвига, записи
+// равны. Бросает FormulaException, если ссылка указывает за пределы таблицы.
+std::string MakeRelativeKey(std::string_view expression, Position anchor);
+
+// Ссылки выражения (концы диапазонов - по отдельности) в порядке записи.
+// Бросает FormulaException, если ссылка указывает за пределы таблицы.
+std::vector<Position> ListReferences(std::string_view expression);
+
+// Значение текста ячейки как аргумента формулы: пустой текст - ноль,
+// текст, целиком записывающий число, - это число, остальное (в том числе
+// экранированный текст) - ошибка #VALUE!.
+FormulaInterface::Value TextToNumber(std::string_view text);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
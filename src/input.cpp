@@ -0,0 +1,36 @@
+#include <cerrno>
+#include <istream>
+#include <system_error>
+
+#include <unistd.h>
+
+#include "input.h"
+
+
+
+// ------------ StreamSource --------------
+StreamSource::StreamSource(std::istream& input)
+    : input_(input)
+    {}
+
+std::size_t StreamSource::Read(char* data, std::size_t size) {
+    input_.read(data, static_cast<std::streamsize>(size));
+    return static_cast<std::size_t>(input_.gcount());
+}
+
+// ------------ FileDescriptorSource --------------
+FileDescriptorSource::FileDescriptorSource(int fd)
+    : fd_(fd)
+    {}
+
+std::size_t FileDescriptorSource::Read(char* data, std::size_t size) {
+    while (true) {
+        const auto read = ::read(fd_, data, size);
+        if (read >= 0) {
+            return static_cast<std::size_t>(read);
+        }
+        if (errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+
+// Источник байтов, из которого загружается таблица.
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+
+    // Читает не больше size байтов; 0 означает конец данных.
+    virtual std::size_t Read(char* data, std::size_t size) = 0;
+};
+
+// Читает из потока до его конца или ошибки.
+class StreamSource : public InputSource {
+public:
+    explicit StreamSource(std::istream& input);
+
+    std::size_t Read(char* data, std::size_t size) override;
+
+private:
+    std::istream& input_;
+};
+
+// Читает прямо из файлового дескриптора, минуя буферы потоков. Дескриптор
+// не закрывается. При ошибке чтения бросает std::system_error.
+class FileDescriptorSource : public InputSource {
+public:
+    explicit FileDescriptorSource(int fd);
+
+    std::size_t Read(char* data, std::size_t size) override;
+
+private:
+    int fd_;
+};
+
+// Разбирает TSV в формате Sheet::PrintTexts: строки разделены '\n',
+// столбцы - '\t'. Для каждого непустого поля вызывает
+// field(Position, std::string_view); строка действительна только на время
+// вызова. Поля читаются блоками, и копируется только поле, разрезанное
+// границей блока.
+template <typename F>
+void ForEachTsvField(InputSource& source, F field) {
+    constexpr std::size_t BLOCK_SIZE = 1 << 16;
+    std::vector<char> block(BLOCK_SIZE);
+    // начало поля из предыдущего блока
+    std::string carry;
+    Position pos{0, 0};
+
+    while (const auto size = source.Read(block.data(), block.size())) {
+        const char* begin = block.data();
+        const char* const end = begin + size;
+        for (const char* it = begin; it != end; ++it) {
+            if (*it != '\t' && *it != '\n') {
+                continue;
+            }
+            std::string_view text(begin, static_cast<std::size_t>(it - begin));
+            if (!carry.empty()) {
+                carry.append(text);
+                text = carry;
+            }
+            if (!text.empty()) {
+                field(pos, text);
+            }
+            carry.clear();
+            if (*it == '\t') {
+                ++pos.col;
+            } else {
+                ++pos.row;
+                pos.col = 0;
+            }
+            begin = it + 1;
+        }
+        carry.append(begin, end);
+    }
+    // последняя строка может быть без перевода строки
+    if (!carry.empty()) {
+        field(pos, std::string_view(carry));
+    }
+}
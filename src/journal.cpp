@@ -0,0 +1,163 @@
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <unistd.h>
+
+#include "journal.h"
+
+
+
+using namespace std::literals;
+
+namespace {
+constexpr char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'J', 'N', 'L'};
+constexpr std::uint32_t VERSION = 1;
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// 1 МиБ: запись одной правки не упирается в буфер, а память ограничена
+constexpr std::size_t BUFFER_CAPACITY = 1 << 20;
+
+template <typename T>
+void Put(char*& out, T value) {
+    std::memcpy(out, &value, sizeof(T));
+    out += sizeof(T);
+}
+
+template <typename T>
+T Get(const char*& in) {
+    T value;
+    std::memcpy(&value, in, sizeof(T));
+    in += sizeof(T);
+    return value;
+}
+}  // namespace
+
+// ------------ format --------------
+std::string MakeJournalHeader(std::uint64_t generation) {
+    std::string header(JOURNAL_HEADER_SIZE, '\0');
+    char* out = header.data();
+    std::memcpy(out, MAGIC, sizeof(MAGIC));
+    out += sizeof(MAGIC);
+    Put(out, VERSION);
+    Put(out, BYTE_ORDER_MARK);
+    Put(out, generation);
+    return header;
+}
+
+std::uint64_t ReadJournalHeader(std::string_view data) {
+    if (data.size() < JOURNAL_HEADER_SIZE || std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+        throw JournalException("Journal: bad header"s);
+    }
+    const char* in = data.data() + sizeof(MAGIC);
+    if (Get<std::uint32_t>(in) != VERSION) {
+        throw JournalException("Journal: unsupported version"s);
+    }
+    if (Get<std::uint32_t>(in) != BYTE_ORDER_MARK) {
+        throw JournalException("Journal: foreign byte order"s);
+    }
+    return Get<std::uint64_t>(in);
+}
+
+std::optional<JournalRecord> journal_detail::ParseRecord(std::string_view records, std::size_t& size) {
+    if (records.size() < RECORD_HEADER_SIZE) {
+        return std::nullopt;
+    }
+    const char* in = records.data();
+    const auto length = Get<std::uint32_t>(in);
+    const auto crc = Get<std::uint32_t>(in);
+    if (length < RECORD_FIXED_SIZE || length > records.size() - RECORD_HEADER_SIZE) {
+        return std::nullopt;
+    }
+    const std::string_view payload(in, length);
+    if (Crc32(payload) != crc) {
+        return std::nullopt;
+    }
+
+    JournalRecord record;
+    record.kind = Get<JournalRecord::Kind>(in);
+    record.pos.row = Get<std::int32_t>(in);
+    record.pos.col = Get<std::int32_t>(in);
+    record.text = payload.substr(RECORD_FIXED_SIZE);
+    // контрольная сумма сошлась, так что неверная правка - не обрыв, а
+    // чужие данные
+    if ((record.kind != JournalRecord::Kind::Set && record.kind != JournalRecord::Kind::Clear)
+            || !record.pos.IsValid()) {
+        throw JournalException("Journal: bad record"s);
+    }
+    size = RECORD_HEADER_SIZE + length;
+    return record;
+}
+
+// ------------ JournalWriter --------------
+JournalWriter::JournalWriter(int fd, std::uint64_t size, SyncPolicy policy,
+                             std::chrono::milliseconds sync_interval)
+    : fd_(fd)
+    , sink_(fd)
+    , out_(sink_, BUFFER_CAPACITY)
+    , size_(size)
+    , policy_(policy)
+    , sync_interval_(sync_interval)
+    , last_sync_(std::chrono::steady_clock::now())
+    {}
+
+void JournalWriter::AppendSet(Position pos, std::string_view text) {
+    Append(JournalRecord::Kind::Set, pos, text);
+}
+
+void JournalWriter::AppendClear(Position pos) {
+    Append(JournalRecord::Kind::Clear, pos, {});
+}
+
+void JournalWriter::Append(JournalRecord::Kind kind, Position pos, std::string_view text) {
+    using namespace journal_detail;
+
+    char fixed[RECORD_FIXED_SIZE];
+    char* out = fixed;
+    Put(out, kind);
+    Put(out, static_cast<std::int32_t>(pos.row));
+    Put(out, static_cast<std::int32_t>(pos.col));
+    const std::string_view fixed_view(fixed, sizeof(fixed));
+
+    char header[RECORD_HEADER_SIZE];
+    out = header;
+    Put(out, static_cast<std::uint32_t>(RECORD_FIXED_SIZE + text.size()));
+    Put(out, Crc32(text, Crc32(fixed_view)));
+
+    out_.Write({header, sizeof(header)});
+    out_.Write(fixed_view);
+    out_.Write(text);
+    size_ += RECORD_HEADER_SIZE + RECORD_FIXED_SIZE + text.size();
+    unsynced_ = true;
+}
+
+void JournalWriter::Commit() {
+    out_.Flush();
+    if (!unsynced_ || policy_ == SyncPolicy::Never) {
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (policy_ == SyncPolicy::Interval && now - last_sync_ < sync_interval_) {
+        return;
+    }
+    SyncData(now);
+}
+
+void JournalWriter::Sync() {
+    out_.Flush();
+    if (unsynced_ && policy_ != SyncPolicy::Never) {
+        SyncData(std::chrono::steady_clock::now());
+    }
+}
+
+void JournalWriter::SyncData(std::chrono::steady_clock::time_point now) {
+    if (::fdatasync(fd_) != 0) {
+        throw std::system_error(errno, std::generic_category(), "fdatasync");
+    }
+    last_sync_ = now;
+    unsynced_ = false;
+}
+
+std::uint64_t JournalWriter::GetSize() const {
+    return size_;
+}
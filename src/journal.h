@@ -0,0 +1,122 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "common.h"
+#include "output.h"
+
+// Журнал правок - файл, в который дописываются правки таблицы:
+//   заголовок (сигнатура, версия, метка порядка байтов, поколение)
+//   записи: длина и CRC-32 содержимого, затем содержимое - вид правки,
+//   строка, столбец и текст ячейки
+// Поколение связывает журнал с контрольной точкой, поверх которой он
+// проигрывается (см. DurableSheet). Запись, оборванная сбоем посреди
+// дозаписи, распознаётся по длине или контрольной сумме.
+
+// Исключение, выбрасываемое при открытии повреждённого или чужого журнала
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Когда журнал сбрасывает записи на диск (fdatasync).
+enum class SyncPolicy : std::uint8_t {
+    // при каждой фиксации: зафиксированные правки переживают сбой питания
+    Always,
+    // при фиксации, если с последнего сброса прошло не меньше интервала
+    Interval,
+    // никогда: записи переживают падение процесса, но не сбой системы
+    Never,
+};
+
+struct JournalRecord {
+    enum class Kind : std::uint8_t {
+        Set = 1,
+        Clear = 2,
+    };
+
+    Kind kind;
+    Position pos;
+    // текст правки Set; действителен, пока жив буфер журнала
+    std::string_view text;
+};
+
+inline constexpr std::size_t JOURNAL_HEADER_SIZE = 24;
+
+// Заголовок журнала поколения generation.
+std::string MakeJournalHeader(std::uint64_t generation);
+// Поколение журнала data; бросает JournalException, если заголовок неверен.
+std::uint64_t ReadJournalHeader(std::string_view data);
+
+// Вызывает f(const JournalRecord&) для каждой записи records (журнала без
+// заголовка) и возвращает длину целой части: всё, что дальше, оборвано или
+// повреждено. Бросает JournalException на записи с верной контрольной
+// суммой, но неверным содержимым.
+template <typename F>
+std::size_t ForEachJournalRecord(std::string_view records, F f);
+
+// Дописывает записи в конец файлового дескриптора. Записи копятся в буфере
+// и уходят в файл крупными блоками: при заполнении буфера и при Commit,
+// который к тому же сбрасывает их на диск согласно политике. Дескриптор
+// не закрывается. При ошибке записи бросает std::system_error.
+class JournalWriter {
+public:
+    JournalWriter(int fd, std::uint64_t size, SyncPolicy policy,
+                  std::chrono::milliseconds sync_interval);
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+
+    void AppendSet(Position pos, std::string_view text);
+    void AppendClear(Position pos);
+    void Commit();
+    // То же, что Commit, но при политике Interval записи сбрасываются на
+    // диск сразу, не дожидаясь интервала. Вызывается при закрытии журнала.
+    void Sync();
+
+    // Размер журнала вместе с ещё не записанными записями.
+    std::uint64_t GetSize() const;
+
+private:
+    int fd_;
+    FileDescriptorSink sink_;
+    BufferedWriter out_;
+    std::uint64_t size_;
+    SyncPolicy policy_;
+    std::chrono::milliseconds sync_interval_;
+    std::chrono::steady_clock::time_point last_sync_;
+    // есть записи, ещё не сброшенные на диск
+    bool unsynced_ = false;
+
+private:
+    void Append(JournalRecord::Kind kind, Position pos, std::string_view text);
+    void SyncData(std::chrono::steady_clock::time_point now);
+};
+
+// ------------ implementation --------------
+namespace journal_detail {
+// длина и CRC-32 содержимого записи
+inline constexpr std::size_t RECORD_HEADER_SIZE = 8;
+// вид правки, строка и столбец
+inline constexpr std::size_t RECORD_FIXED_SIZE = 9;
+
+// Разбирает запись в начале records; пустой результат - запись оборвана
+// или повреждена. size получает полную длину записи.
+std::optional<JournalRecord> ParseRecord(std::string_view records, std::size_t& size);
+}  // namespace journal_detail
+
+template <typename F>
+std::size_t ForEachJournalRecord(std::string_view records, F f) {
+    std::size_t valid = 0;
+    std::size_t size = 0;
+    while (const auto record = journal_detail::ParseRecord(records.substr(valid), size)) {
+        f(*record);
+        valid += size;
+    }
+    return valid;
+}
@@ -2,8 +2,21 @@
 #include <iostream>
 
   #include "common.h"
+  #include "durable_sheet.h"
+  #include "FormulaAST.h"
+  #include "sheet.h"
   #include "test_runner_p.h"
 
+  #include <algorithm>
+  #include <atomic>
+  #include <cstdio>
+  #include <cstring>
+  #include <fstream>
+  #include <sstream>
+  #include <thread>
+
+  #include <unistd.h>
+
   inline std::ostream& operator<<(std::ostream& output, Position pos) {
       return output << "(" << pos.row << ", " << pos.col << ")";
   }
@@ -32,6 +45,34 @@
       ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
   }
 
+  void TestPositionConversion() {
+      ASSERT_EQUAL(Position::FromString("A1"), (Position{0, 0}));
+      ASSERT_EQUAL(Position::FromString("AB15"), (Position{14, 27}));
+      ASSERT_EQUAL(Position::FromString("A01"), (Position{0, 0}));
+      ASSERT_EQUAL(Position::FromString("XFD16384"), (Position{16383, 16383}));
+      ASSERT(!Position::FromString("XFE1").IsValid());
+      ASSERT(!Position::FromString("A16385").IsValid());
+      ASSERT(!Position::FromString("A0").IsValid());
+      for (const auto str : {"", "A", "1", "a1", "A1B", "AAAA1", "A+1", "A 1", "A99999999999"}) {
+          ASSERT_EQUAL(Position::FromString(str), Position::NONE);
+      }
+
+      ASSERT_EQUAL((Position{16383, 16383}).ToString(), "XFD16384");
+      ASSERT_EQUAL((Position{0, 25}).ToString(), "Z1");
+      ASSERT_EQUAL((Position{0, 26}).ToString(), "AA1");
+      ASSERT_EQUAL(Position::NONE.ToString(), "");
+      ASSERT_EQUAL((Position{0, Position::MAX_COLS}).ToString(), "");
+      char buffer[Position::MAX_STRING_LENGTH];
+      ASSERT_EQUAL(std::string(buffer, (Position{9, 702}).ToChars(buffer)), "AAA10");
+
+      for (int i = 0; i < Position::MAX_COLS; ++i) {
+          for (const Position pos : {Position{i, i}, Position{0, i}, Position{i, 0},
+                                     Position{Position::MAX_ROWS - 1 - i, i}}) {
+              ASSERT_EQUAL(Position::FromString(pos.ToString()), pos);
+          }
+      }
+  }
+
   void TestInvalidPosition() {
       auto sheet = CreateSheet();
       try {
@@ -140,18 +181,1230 @@
       }
   }
 
+  void TestFarCell() {
+      auto sheet = CreateSheet();
+      const Position far{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+      sheet->SetCell(far, "far away");
+      sheet->SetCell("B2"_pos, "near");
+
+      ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+      ASSERT_EQUAL(sheet->GetCell(far)->GetText(), "far away");
+      ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+      ASSERT(sheet->GetCell(Position{Position::MAX_ROWS - 2, Position::MAX_COLS - 1}) == nullptr);
+
+      sheet->ClearCell(far);
+      ASSERT(sheet->GetCell(far) == nullptr);
+      ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+  }
+
+  void TestClearReferencedCell() {
+      auto sheet = CreateSheet();
+      sheet->SetCell("A1"_pos, "2");
+      sheet->SetCell("B1"_pos, "=A1*3");
+      sheet->SetCell("C1"_pos, "=B1+1");
+      ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 7.);
+
+      sheet->ClearCell("A1"_pos);
+      ASSERT(sheet->GetCell("A1"_pos) == nullptr || sheet->GetCell("A1"_pos)->GetText().empty());
+      ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 1.);
+
+      sheet->ClearCell("B1"_pos);
+      sheet->SetCell("A1"_pos, "5");
+      ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 1.);
+      sheet->SetCell("B1"_pos, "=A1");
+      ASSERT_EQUAL(std::get<double>(sheet->GetCell("C1"_pos)->GetValue()), 6.);
+  }
+
+  void TestCircularDependency() {
+      auto sheet = CreateSheet();
+      sheet->SetCell("A1"_pos, "=B1");
+      sheet->SetCell("B1"_pos, "=C1+Z100");
+      bool caught = false;
+      try {
+          sheet->SetCell("C1"_pos, "=A1");
+      } catch (const CircularDependencyException&) {
+          caught = true;
+      }
+      ASSERT(caught);
+      ASSERT(sheet->GetCell("C1"_pos)->GetText().empty());
+
+      caught = false;
+      try {
+          sheet->SetCell("D4"_pos, "=D4");
+      } catch (const CircularDependencyException&) {
+          caught = true;
+      }
+      ASSERT(caught);
+
+      sheet->SetCell("C1"_pos, "=ZZ999+1");
+      ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 1.);
+  }
+
+  void TestCircularDependencyDeepGraph() {
+      // ромбы: каждая строка зависит от двух ячеек предыдущей
+      constexpr int depth = 200;
+      Sheet sheet;
+      sheet.SetCell("A1"_pos, "1");
+      sheet.SetCell("B1"_pos, "1");
+      for (int i = 1; i < depth; ++i) {
+          const auto a = Position{i - 1, 0}.ToString();
+          const auto b = Position{i - 1, 1}.ToString();
+          sheet.SetCell(Position{i, 0}, "=" + a + "+" + b);
+          sheet.SetCell(Position{i, 1}, "=" + a + "-" + b);
+      }
+
+      for (const std::string formula : {"=B200", "=A100*2", "=C1+A2", "=B2/B3"}) {
+          bool caught = false;
+          try {
+              sheet.SetCell("B1"_pos, formula);
+          } catch (const CircularDependencyException&) {
+              caught = true;
+          }
+          ASSERT(caught);
+          ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "1");
+      }
+
+      // ссылка на независимую ячейку цикла не образует
+      sheet.SetCell("B1"_pos, "=C1+1");
+      sheet.SetCell("C1"_pos, "=A1");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()), 3.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), -1.);
+  }
+
+  void TestAggregateFunctions() {
+      Sheet sheet;
+      for (int i = 0; i < 40; ++i) {
+          sheet.SetCell(Position{i, 0}, std::to_string(i + 1));
+      }
+      sheet.SetCell("B1"_pos, "=SUM(A1:A40)");
+      sheet.SetCell("B2"_pos, "=AVERAGE(A1:A4,10)");
+      sheet.SetCell("B3"_pos, "=MIN(A40:A3)");
+      sheet.SetCell("B4"_pos, "=MAX(A1:A40,-1)*2");
+      sheet.SetCell("B5"_pos, "=COUNT(A1:A10,C1:C10)");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 820.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 4.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 3.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 80.);
+      // пустые C1:C10 пропускаются
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B5"_pos)->GetValue()), 10.);
+      ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=MIN(A3:A40)");
+      ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=MAX(A1:A40,-1)*2");
+      ASSERT(sheet.GetCell("B2"_pos)->GetReferencedCells().empty());
+      ASSERT_EQUAL(sheet.FindCell("B2"_pos)->GetReferencedRanges().size(), 1u);
+
+      // правка внутри диапазона сбрасывает кеш
+      sheet.SetCell("A40"_pos, "0");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 780.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 78.);
+
+      sheet.SetCell("D1"_pos, "=AVERAGE(E1:E5)");
+      sheet.SetCell("D2"_pos, "=MAX(E1:E5)+COUNT(E1:E5)");
+      ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("D1"_pos)->GetValue()),
+                   FormulaError(FormulaError::Category::Div0));
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("D2"_pos)->GetValue()), 0.);
+
+      sheet.SetCell("E3"_pos, "text");
+      ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("D2"_pos)->GetValue()),
+                   FormulaError(FormulaError::Category::Value));
+      sheet.SetCell("E3"_pos, "=1/0");
+      ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("D1"_pos)->GetValue()),
+                   FormulaError(FormulaError::Category::Div0));
+
+      bool caught = false;
+      try {
+          sheet.SetCell("E1"_pos, "=SUM(D1:D2)");
+      } catch (const CircularDependencyException&) {
+          caught = true;
+      }
+      ASSERT(caught);
+
+      // повторяющиеся ссылки - одна зависимость
+      sheet.SetCell("F1"_pos, "=SUM(A1:A2,A2:A3,A1:A2)+A1+A1");
+      ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetReferencedCells().size(), 1u);
+      ASSERT_EQUAL(sheet.FindCell("F1"_pos)->GetReferencedRanges().size(), 2u);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("F1"_pos)->GetValue()), 13.);
+      sheet.SetCell("F1"_pos, "1");
+
+      // дерево и байткод считают агрегаты одинаково
+      const auto lookup = [](Position pos) -> FormulaValue {
+          return pos.row * 0.1 + pos.col;
+      };
+      const auto ast = ParseFormulaAST("SUM(A1:C7,1/3,B2)*MIN(B1:B3)-MAX(A1,C9:A2)/COUNT(A1:A9)");
+      ASSERT_EQUAL(std::get<double>(ast.Execute(lookup)), std::get<double>(ast.ExecuteTree(lookup)));
+  }
+
+  void TestRangeDependencies() {
+      Sheet sheet;
+      sheet.SetCell("B1"_pos, "=SUM(A1:A16384)");
+      // ячейки диапазона не создаются
+      ASSERT(sheet.GetCell("A100"_pos) == nullptr);
+      ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 0.);
+
+      sheet.SetCell("C1"_pos, "=SUM(B1:B3)*2");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 0.);
+      sheet.SetCell("A500"_pos, "5");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 10.);
+      sheet.ClearCell("A500"_pos);
+      ASSERT(sheet.GetCell("A500"_pos) == nullptr);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 0.);
+
+      bool caught = false;
+      try {
+          sheet.SetCell("A7000"_pos, "=C1");
+      } catch (const CircularDependencyException&) {
+          caught = true;
+      }
+      ASSERT(caught);
+      ASSERT(sheet.GetCell("A7000"_pos) == nullptr || sheet.GetCell("A7000"_pos)->GetText().empty());
+
+      // каждая следующая ячейка - сумма всех предыдущих
+      constexpr int count = 30;
+      sheet.SetRecalculationThreads(4);
+      sheet.SetCell("D1"_pos, "1");
+      for (int i = 1; i < count; ++i) {
+          sheet.SetCell(Position{i, 3}, "=SUM(D1:" + Position{i - 1, 3}.ToString() + ")+MAX(D1:D1)*0");
+      }
+      sheet.Recalculate();
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{count - 1, 3})->GetValue()), double(1 << (count - 2)));
+      sheet.SetCell("D1"_pos, "2");
+      ASSERT(sheet.FindCell(Position{count - 1, 3})->IsDirty());
+      sheet.Recalculate();
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{count - 1, 3})->GetValue()), double(1 << (count - 1)));
+  }
+
+  void TestFormulaInterning() {
+      ASSERT_EQUAL(MakeRelativeKey("A1*B1", "C1"_pos), MakeRelativeKey("A2*B2", "C2"_pos));
+      ASSERT(MakeRelativeKey("A1*B1", "C1"_pos) != MakeRelativeKey("A1*B2", "C2"_pos));
+      ASSERT_EQUAL(MakeRelativeKey("1E5+E5", "A1"_pos), MakeRelativeKey("1E5+E6", "A2"_pos));
+      ASSERT_EQUAL(MakeRelativeKey("SUM(A1:A3)", "B3"_pos), MakeRelativeKey("SUM(A2:A4)", "B4"_pos));
+      bool caught = false;
+      try {
+          MakeRelativeKey("A1+ZZZZ1", "A1"_pos);
+      } catch (const FormulaException&) {
+          caught = true;
+      }
+      ASSERT(caught);
+
+      constexpr int rows = 1000;
+      Sheet sheet;
+      for (int i = 0; i < rows; ++i) {
+          const auto row = std::to_string(i + 1);
+          sheet.SetCell(Position{i, 0}, row);
+          sheet.SetCell(Position{i, 1}, "2");
+          sheet.SetCell(Position{i, 2}, "=A" + row + "*B" + row);
+          sheet.SetCell(Position{i, 3}, "=SUM(C1:C" + row + ")");
+      }
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C500"_pos)->GetValue()), 1000.);
+      ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetText(), "=A500*B500");
+      ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetText(), "=SUM(C1:C7)");
+      ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetReferencedCells(),
+                   (std::vector<Position>{"A500"_pos, "B500"_pos}));
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("D4"_pos)->GetValue()), 20.);
+
+      sheet.SetCell("A2"_pos, "10");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C2"_pos)->GetValue()), 20.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C3"_pos)->GetValue()), 6.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("D4"_pos)->GetValue()), 36.);
+
+      // правка одной ячейки не задевает остальные, использующие ту же формулу
+      sheet.SetCell("C3"_pos, "=A3-B3");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C3"_pos)->GetValue()), 1.);
+      ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=A4*B4");
+      for (int i = 0; i < rows; ++i) {
+          sheet.ClearCell(Position{i, 2});
+      }
+      sheet.SetCell("C1"_pos, "=A1*B1");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1000"_pos)->GetValue()), 2.);
+  }
+
+  void TestPrintableSizeTracking() {
+      auto sheet = CreateSheet();
+      for (int i = 0; i < 50; ++i) {
+          for (int j = 0; j < 70; ++j) {
+              sheet->SetCell(Position{i, j}, "x");
+          }
+      }
+      ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{50, 70}));
+
+      for (int i = 0; i < 50; ++i) {
+          sheet->ClearCell(Position{i, 69});
+      }
+      ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{50, 69}));
+
+      sheet->SetCell("A100"_pos, "=C300");
+      ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{100, 69}));
+      sheet->SetCell("A100"_pos, "");
+      ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{50, 69}));
+
+      try {
+          sheet->SetCell("CZ200"_pos, "=CZ200");
+      } catch (const CircularDependencyException&) {
+      }
+      ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{50, 69}));
+
+      for (int i = 0; i < 50; ++i) {
+          for (int j = 0; j < 69; ++j) {
+              sheet->ClearCell(Position{i, j});
+          }
+      }
+      ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+  }
+
+  void TestBytecodeMatchesTree() {
+      const auto lookup = [](Position pos) -> FormulaValue {
+          if (pos.col == 25) {
+              return FormulaError(FormulaError::Category::Value);
+          }
+          return (pos.row + 1) * 0.37 - pos.col * 1.9;
+      };
+      for (const std::string formula : {"1+2*3", "-(A1+B2)/C3*+D4", "1/3+1/7-1/11",
+                                        "((A1-B1)*(C1+D1))/(E1-F1*G1)", "2.5*(2+3.5/7)",
+                                        "-A1--B2*-C3/+D4-1e-3", "1e308*10-A1"}) {
+          const auto ast = ParseFormulaAST(formula);
+          const double vm = std::get<double>(ast.Execute(lookup));
+          const double tree = std::get<double>(ast.ExecuteTree(lookup));
+          ASSERT(std::memcmp(&vm, &tree, sizeof(double)) == 0);
+      }
+
+      for (const std::string formula : {"A1/(B1-B1)", "1+Z1*2", "-(Z5)"}) {
+          const auto ast = ParseFormulaAST(formula);
+          const auto vm = ast.Execute(lookup);
+          ASSERT(std::holds_alternative<FormulaError>(vm));
+          ASSERT_EQUAL(std::get<FormulaError>(vm), std::get<FormulaError>(ast.ExecuteTree(lookup)));
+      }
+      ASSERT_EQUAL(std::get<FormulaError>(ParseFormulaAST("A1/0").Execute(lookup)),
+                   FormulaError(FormulaError::Category::Div0));
+  }
+
+  // Собственный парсер разбирает формулы так же, как эталонный парсер ANTLR.
+  void TestParserMatchesAntlr() {
+      const auto lookup = [](Position pos) -> FormulaValue {
+          return (pos.row + 1) * 0.37 - pos.col * 1.9;
+      };
+      const auto describe = [&lookup](auto parse, const std::string& formula) -> std::string {
+          try {
+              const auto ast = parse(formula);
+              std::ostringstream out;
+              ast.Print(out);
+              out << '|';
+              ast.PrintFormula(out);
+              out << '|';
+              ast.PrintCells(out);
+              for (const auto& range : ast.GetRanges()) {
+                  out << '|' << range.ToString();
+              }
+              const auto value = ast.Execute(lookup);
+              if (std::holds_alternative<double>(value)) {
+                  out << '|' << std::hexfloat << std::get<double>(value);
+              } else {
+                  out << '|' << std::get<FormulaError>(value);
+              }
+              return out.str();
+          } catch (const std::exception&) {
+              return "error";
+          }
+      };
+
+      for (const std::string formula : {
+               "1", " 1 + 2 * 3 ", "(1+2)*3", "1-2-3", "8/4/2", "-A1*B2", "--A1*-B1/+C3",
+               "+-+1", "((A1))", ".5+1.25", "1e5", "2E-3*A1", "1E+2", "1E-400", "3.E1", "1.5.3",
+               "A1-(B1-C1)", "\tA1\n+\rB2", "SUM(A1:C3)", "SUM(C3:A1, 2, B2)", "MAX(A1 : B2)",
+               "AVERAGE(1,2,3)/COUNT(A1:A9)", "MIN(-A1,(B1+1)*2,C1:C2)", "SUM(SUM(A1:B2),A1)",
+               "SUMA1+1", "ZZZ1", "",
+               " ", "1+", "(1", "1)", "()", "A1:B2", "SUM()", "SUM(1,)", "SUM(,1)", "SUM(A1:)",
+               "SUM(A1:B2+1)", "SUM((A1:B2))", "SUM A1", "SUMX(1)", "sum(1)", "1.", "1E", "1E+",
+               "1 2", "A1 B1", "0x10", "1..2", "A0", "ZZZZZ1", "A1+$B1", "1E999", "A1:B2:C3",
+               "SUM(1)(2)", "SUM(1)2"}) {
+          const auto expected = describe([](const std::string& text) {
+              return ParseFormulaASTWithAntlr(text);
+          }, formula);
+          const auto actual = describe([](const std::string& text) {
+              return ParseFormulaAST(text);
+          }, formula);
+          ASSERT_EQUAL(actual, expected);
+      }
+  }
+
+  void TestTextOperands() {
+      Sheet sheet;
+      sheet.SetCell("B1"_pos, "=A1*2");
+      const auto value_of = [&sheet](std::string text) {
+          sheet.SetCell("A1"_pos, std::move(text));
+          return sheet.GetCell("B1"_pos)->GetValue();
+      };
+      ASSERT_EQUAL(value_of("12.5"), CellInterface::Value(25.));
+      ASSERT_EQUAL(value_of("-3"), CellInterface::Value(-6.));
+      ASSERT_EQUAL(value_of("1e3"), CellInterface::Value(2000.));
+      ASSERT_EQUAL(value_of(".25"), CellInterface::Value(.5));
+      ASSERT_EQUAL(value_of(""), CellInterface::Value(0.));
+      for (const auto text : {"abc", "12abc", " 5", "5 ", "'5", "1e999", "="}) {
+          ASSERT_EQUAL(value_of(text), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+      }
+
+      sheet.SetCell("A1"_pos, "4");
+      sheet.SetCell("A2"_pos, "x");
+      sheet.SetCell("C1"_pos, "=SUM(A1:A1)+MAX(A1:A1)");
+      sheet.SetCell("C2"_pos, "=SUM(A1:A2)");
+      ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(8.));
+      ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(),
+                   CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+      sheet.SetCell("A2"_pos, "6");
+      ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(10.));
+      ASSERT_EQUAL(std::get<double>(sheet.GetNumericValue("A2"_pos)), 6.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetNumericValue("Z9"_pos)), 0.);
+  }
+
+  void TestValueViews() {
+      Sheet sheet;
+      sheet.SetCell("A1"_pos, "'=escaped");
+      sheet.SetCell("A2"_pos, "some text that does not fit into a short string");
+      sheet.SetCell("B1"_pos, "=(A3 + 1) * 2");
+      sheet.SetCell("B2"_pos, "=1/0");
+      sheet.SetCell("C1"_pos, "");
+
+      using View = CellInterface::ValueView;
+      const auto* a1 = sheet.GetCell("A1"_pos);
+      ASSERT(a1->GetValueView() == View(std::string_view("=escaped")));
+      ASSERT_EQUAL(a1->GetTextView(), "'=escaped");
+      const auto* a2 = sheet.GetCell("A2"_pos);
+      ASSERT(std::get<std::string_view>(a2->GetValueView()).data() == a2->GetTextView().data());
+      const auto* b1 = sheet.GetCell("B1"_pos);
+      ASSERT_EQUAL(b1->GetTextView(), "=(A3+1)*2");
+      ASSERT(b1->GetValueView() == View(2.));
+      ASSERT(sheet.GetCell("B2"_pos)->GetValueView() == View(FormulaError(FormulaError::Category::Div0)));
+      const auto* c1 = sheet.GetCell("C1"_pos);
+      ASSERT(!c1 || c1->GetValueView() == View(std::string_view()));
+
+      for (const auto pos : {"A1"_pos, "A2"_pos, "B1"_pos, "B2"_pos}) {
+          const auto* cell = sheet.GetCell(pos);
+          ASSERT_EQUAL(cell->GetText(), cell->GetTextView());
+      }
+
+      // текст формулы в ячейке, сдвинутой относительно общей записи
+      sheet.SetCell("B3"_pos, "=(A4 + 1) * 2");
+      ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetTextView(), "=(A4+1)*2");
+      sheet.SetCell("A3"_pos, "4");
+      ASSERT(b1->GetValueView() == View(10.));
+  }
+
+  // Выгрузка совпадает побайтно с печатью ячеек через operator<< потока.
+  void TestExportMatchesStreamPrinting() {
+      Sheet sheet;
+      const std::string numbers[] = {"0.1", "1e20", "123456789", "1e-5", "100000", "1000000",
+                                     "-0", "2.5e-310", "0.000123456789", "42"};
+      for (int i = 0; i < 10; ++i) {
+          sheet.SetCell(Position{i * 3, i % 4}, "=" + numbers[i] + "*1");
+          sheet.SetCell(Position{i * 3 + 1, 5 - i % 3}, "'text " + std::to_string(i));
+      }
+      sheet.SetCell("H2"_pos, "=1/3");
+      sheet.SetCell("H3"_pos, "=1/0");
+      sheet.SetCell("H4"_pos, "=0.1+0.2");
+      sheet.SetCell("H6"_pos, "abc");
+      sheet.SetCell("H5"_pos, "=H6+1");
+      sheet.SetCell("J40"_pos, std::string(100000, 'x'));
+      sheet.SetCell("J41"_pos, "temp");
+      sheet.ClearCell("J41"_pos);
+      sheet.SetCell("C50"_pos, "=H2*7");
+
+      const auto size = sheet.GetPrintableSize();
+      std::ostringstream expected_values;
+      std::ostringstream expected_texts;
+      for (int i = 0; i < size.rows; ++i) {
+          for (int j = 0; j < size.cols; ++j) {
+              if (const auto* cell = sheet.GetCell(Position{i, j})) {
+                  expected_values << cell->GetValue();
+                  expected_texts << cell->GetText();
+              }
+              if (j != size.cols - 1) {
+                  expected_values << '\t';
+                  expected_texts << '\t';
+              }
+          }
+          expected_values << '\n';
+          expected_texts << '\n';
+      }
+
+      std::ostringstream values;
+      std::ostringstream texts;
+      sheet.PrintValues(values);
+      sheet.PrintTexts(texts);
+      ASSERT(values.str() == expected_values.str());
+      ASSERT(texts.str() == expected_texts.str());
+
+      FILE* file = std::tmpfile();
+      ASSERT(file);
+      FileDescriptorSink sink(fileno(file));
+      sheet.ExportValues(sink);
+      std::rewind(file);
+      std::string exported;
+      char buffer[4096];
+      while (const auto read = std::fread(buffer, 1, sizeof(buffer), file)) {
+          exported.append(buffer, read);
+      }
+      std::fclose(file);
+      ASSERT(exported == expected_values.str());
+
+      std::ostringstream empty;
+      Sheet().PrintValues(empty);
+      ASSERT(empty.str().empty());
+  }
+
+  void TestImport() {
+      Sheet source;
+      source.SetCell("A1"_pos, "2");
+      source.SetCell("B1"_pos, "=A1*C3+SUM(A2:A4)");
+      source.SetCell("A3"_pos, "'=not a formula");
+      source.SetCell("C3"_pos, "=D5-1");
+      source.SetCell("D5"_pos, "10");
+      source.SetCell("E2"_pos, std::string(100000, 'y'));
+      for (int i = 0; i < 50; ++i) {
+          source.SetCell(Position{10 + i, 0}, std::to_string(i));
+          source.SetCell(Position{10 + i, 1}, "=A" + std::to_string(11 + i) + "*2+B1");
+      }
+      std::ostringstream texts;
+      source.PrintTexts(texts);
+      std::ostringstream values;
+      source.PrintValues(values);
+
+      Sheet loaded;
+      std::istringstream input(texts.str());
+      loaded.Import(input);
+      std::ostringstream loaded_texts;
+      loaded.PrintTexts(loaded_texts);
+      std::ostringstream loaded_values;
+      loaded.PrintValues(loaded_values);
+      ASSERT(loaded_texts.str() == texts.str());
+      ASSERT(loaded_values.str() == values.str());
+      ASSERT_EQUAL(loaded.GetPrintableSize(), source.GetPrintableSize());
+
+      // последняя строка без перевода строки, чтение из дескриптора
+      FILE* file = std::tmpfile();
+      ASSERT(file);
+      const std::string tsv = "1\t\t=A1+C3\n\n\t=A1*10\t7";
+      std::fwrite(tsv.data(), 1, tsv.size(), file);
+      std::fflush(file);
+      std::rewind(file);
+      Sheet from_fd;
+      FileDescriptorSource fd_source(fileno(file));
+      from_fd.Import(fd_source);
+      std::fclose(file);
+      ASSERT_EQUAL(from_fd.GetPrintableSize(), (Size{3, 3}));
+      ASSERT_EQUAL(std::get<double>(from_fd.GetCell("C1"_pos)->GetValue()), 8.);
+      ASSERT_EQUAL(std::get<double>(from_fd.GetCell("B3"_pos)->GetValue()), 10.);
+
+      // загрузка в ячейку, на которую уже ссылается формула
+      Sheet sheet;
+      sheet.SetCell("C1"_pos, "=A1+1");
+      sheet.SetCell("D1"_pos, "=B2");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 1.);
+      std::istringstream placeholder("5");
+      sheet.Import(placeholder);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 6.);
+
+      const auto expect_unchanged = [&sheet](const std::string& tsv, auto exception) {
+          std::ostringstream before;
+          sheet.PrintTexts(before);
+          const auto size = sheet.GetPrintableSize();
+          bool caught = false;
+          try {
+              std::istringstream bad(tsv);
+              sheet.Import(bad);
+          } catch (const decltype(exception)&) {
+              caught = true;
+          }
+          ASSERT(caught);
+          std::ostringstream after;
+          sheet.PrintTexts(after);
+          ASSERT(after.str() == before.str());
+          ASSERT_EQUAL(sheet.GetPrintableSize(), size);
+      };
+      expect_unchanged("\n\t=A3\t7\n=B2", CircularDependencyException(""));
+      // цикл через формулу D1, которая уже была в таблице
+      expect_unchanged("\n\t=D1+1", CircularDependencyException(""));
+      expect_unchanged("\n\t=A1\n\t=1+", FormulaException(""));
+      // C1 уже занята
+      expect_unchanged("\t7\t3", InvalidPositionException(""));
+
+      // X1 вычислена, хотя её аргумент Y1 устарел: вычисление остановилось
+      // на ошибке E1; цикл A1 -> X1 -> Y1 -> A1 ищется по рёбрам графа
+      Sheet stale;
+      stale.SetCell("E1"_pos, "=1/0");
+      stale.SetCell("Y1"_pos, "=A1");
+      stale.SetCell("X1"_pos, "=E1+Y1");
+      ASSERT(std::holds_alternative<FormulaError>(stale.GetCell("X1"_pos)->GetValue()));
+      for (const auto* tsv : {"=X1", "=SUM(W1:X1)"}) {
+          bool caught = false;
+          try {
+              std::istringstream input(tsv);
+              stale.Import(input);
+          } catch (const CircularDependencyException&) {
+              caught = true;
+          }
+          ASSERT(caught);
+          ASSERT(stale.GetCell("A1"_pos) == nullptr || stale.GetCell("A1"_pos)->GetText().empty());
+      }
+
+      // пустая ячейка, созданная для ссылки отвергнутой формулы, удаляется
+      {
+          bool caught = false;
+          try {
+              std::istringstream input("=Y50+A1");
+              stale.Import(input);
+          } catch (const CircularDependencyException&) {
+              caught = true;
+          }
+          ASSERT(caught);
+          ASSERT(stale.GetCell("Y50"_pos) == nullptr);
+      }
+      stale.SetCell("E1"_pos, "1");
+      ASSERT_EQUAL(std::get<double>(stale.GetCell("X1"_pos)->GetValue()), 1.);
+  }
+
+  void TestSnapshot() {
+      Sheet source;
+      source.SetCell("A1"_pos, "2");
+      source.SetCell("B1"_pos, "=A1*C3+SUM(A2:A4)");
+      source.SetCell("A3"_pos, "'=not a formula");
+      source.SetCell("A4"_pos, "=1/0");
+      source.SetCell("C3"_pos, "=D5-1");
+      source.SetCell("D5"_pos, "10");
+      source.SetCell("E2"_pos, std::string(1000, 'y'));
+      for (int i = 0; i < 50; ++i) {
+          source.SetCell(Position{10 + i, 0}, std::to_string(i));
+          source.SetCell(Position{10 + i, 1}, "=A" + std::to_string(11 + i) + "*2+C3");
+      }
+      source.Recalculate();
+      // формула без вычисленного значения
+      source.SetCell("F1"_pos, "=B11+1");
+
+      std::ostringstream snapshot_out;
+      StreamSink sink(snapshot_out);
+      source.SaveSnapshot(sink);
+      const std::string snapshot = snapshot_out.str();
+
+      std::ostringstream texts;
+      source.PrintTexts(texts);
+      std::ostringstream values;
+      source.PrintValues(values);
+
+      Sheet loaded;
+      loaded.LoadSnapshot(snapshot);
+      ASSERT_EQUAL(loaded.GetPrintableSize(), source.GetPrintableSize());
+      // вычисленные значения восстановлены, остальные ждут пересчёта
+      ASSERT(!loaded.FindCell("B1"_pos)->IsDirty());
+      ASSERT(!loaded.FindCell("B60"_pos)->IsDirty());
+      ASSERT(loaded.FindCell("F1"_pos)->IsDirty());
+      std::ostringstream loaded_texts;
+      loaded.PrintTexts(loaded_texts);
+      ASSERT(loaded_texts.str() == texts.str());
+      std::ostringstream loaded_values;
+      loaded.PrintValues(loaded_values);
+      ASSERT(loaded_values.str() == values.str());
+      ASSERT(loaded.GetCell("B1"_pos)->GetReferencedCells() == source.GetCell("B1"_pos)->GetReferencedCells());
+
+      // рёбра графа построены заново: изменения доходят до зависимых
+      loaded.SetCell("D5"_pos, "3");
+      ASSERT_EQUAL(std::get<double>(loaded.GetCell("B11"_pos)->GetValue()), 2.);
+      ASSERT_EQUAL(std::get<double>(loaded.GetCell("F1"_pos)->GetValue()), 3.);
+      loaded.SetCell("A3"_pos, "1");
+      ASSERT(std::get<FormulaError>(loaded.GetCell("B1"_pos)->GetValue())
+             == FormulaError(FormulaError::Category::Div0));
+      bool caught = false;
+      try {
+          loaded.SetCell("D5"_pos, "=B11");
+      } catch (const CircularDependencyException&) {
+          caught = true;
+      }
+      ASSERT(caught);
+
+      // загрузка из файла через отображение в память
+      char path[] = "/tmp/sheet_snapshotXXXXXX";
+      const int fd = mkstemp(path);
+      ASSERT(fd >= 0);
+      FileDescriptorSink fd_sink(fd);
+      source.SaveSnapshot(fd_sink);
+      close(fd);
+      Sheet from_file;
+      from_file.LoadSnapshotFile(path);
+      std::remove(path);
+      std::ostringstream file_values;
+      from_file.PrintValues(file_values);
+      ASSERT(file_values.str() == values.str());
+
+      const auto expect_rejected = [](Sheet& sheet, std::string_view data) {
+          const auto size = sheet.GetPrintableSize();
+          bool caught = false;
+          try {
+              sheet.LoadSnapshot(data);
+          } catch (const SnapshotException&) {
+              caught = true;
+          }
+          ASSERT(caught);
+          ASSERT_EQUAL(sheet.GetPrintableSize(), size);
+      };
+      Sheet empty;
+      expect_rejected(empty, "");
+      expect_rejected(empty, std::string_view(snapshot).substr(0, snapshot.size() - 1));
+      std::string bad_magic = snapshot;
+      bad_magic[0] = 'X';
+      expect_rejected(empty, bad_magic);
+      // умножение, заменённое делением, ссылок не меняет - его ловит
+      // только контрольная сумма
+      std::uint32_t formula_count = 0;
+      std::uint32_t cell_count = 0;
+      std::memcpy(&formula_count, snapshot.data() + 16, sizeof(formula_count));
+      std::memcpy(&cell_count, snapshot.data() + 20, sizeof(cell_count));
+      const std::size_t data_begin = 40 + 48 * formula_count + 32 * cell_count;
+      std::uint32_t code_size = 0;
+      std::uint32_t number_count = 0;
+      std::uint64_t data_offset = 0;
+      std::memcpy(&code_size, snapshot.data() + 40 + 12, sizeof(code_size));
+      std::memcpy(&number_count, snapshot.data() + 40 + 16, sizeof(number_count));
+      std::memcpy(&data_offset, snapshot.data() + 40 + 40, sizeof(data_offset));
+      const std::size_t code_begin = data_begin + data_offset + 8 * number_count;
+      std::string bad_opcode = snapshot;
+      bool flipped = false;
+      for (std::size_t i = 0; i < code_size && !flipped; ++i) {
+          auto& op = bad_opcode[code_begin + 8 * i];
+          if (op == static_cast<char>(ASTImpl::OpCode::Multiply)) {
+              op = static_cast<char>(ASTImpl::OpCode::Divide);
+              flipped = true;
+          }
+      }
+      ASSERT(flipped);
+      expect_rejected(empty, bad_opcode);
+      // остальные проверки - на снимках с пересчитанной контрольной суммой
+      const auto resign = [](std::string& data) {
+          std::memset(data.data() + 32, 0, sizeof(std::uint32_t));
+          const std::uint32_t checksum = Crc32(data);
+          std::memcpy(data.data() + 32, &checksum, sizeof(checksum));
+      };
+      // неизвестный вид последней ячейки: предыдущие уже загружены и
+      // должны быть убраны
+      std::string bad_cell = snapshot;
+      bad_cell[data_begin - 32 + 8] = 7;
+      resign(bad_cell);
+      expect_rejected(empty, bad_cell);
+      ASSERT(empty.FindCell("A1"_pos) == nullptr);
+      // таблица должна быть пуста
+      expect_rejected(loaded, snapshot);
+
+      // выражение, не совпадающее с программой по ссылкам
+      const auto expression = snapshot.find("A1*C3+SUM(A2:A4)");
+      ASSERT(expression != std::string::npos);
+      std::string bad_reference = snapshot;
+      bad_reference.replace(expression + 10, 5, "ZZZZ1");
+      resign(bad_reference);
+      expect_rejected(empty, bad_reference);
+      std::string other_reference = snapshot;
+      other_reference.replace(expression + 3, 2, "Z9");
+      resign(other_reference);
+      expect_rejected(empty, other_reference);
+      ASSERT(empty.FindCell("A1"_pos) == nullptr);
+  }
+
+  void TestDurableSheet() {
+      char directory[] = "/tmp/durable_sheetXXXXXX";
+      ASSERT(mkdtemp(directory));
+      const std::string journal_path = std::string(directory) + "/journal";
+      const auto read_file = [](const std::string& path) {
+          std::ifstream input(path, std::ios::binary);
+          return std::string(std::istreambuf_iterator<char>(input), {});
+      };
+      const auto write_file = [](const std::string& path, const std::string& data) {
+          std::ofstream output(path, std::ios::binary | std::ios::trunc);
+          output << data;
+      };
+      const auto texts = [](const DurableSheet& sheet) {
+          std::ostringstream out;
+          sheet.GetSheet().PrintTexts(out);
+          return out.str();
+      };
+
+      std::string expected;
+      {
+          DurableSheet sheet(directory);
+          sheet.SetCell("A1"_pos, "2");
+          sheet.SetCell("B1"_pos, "=A1*3");
+          sheet.SetCell("C1"_pos, "x");
+          sheet.ClearCell("C1"_pos);
+          bool caught = false;
+          try {
+              sheet.SetCell("A1"_pos, "=B1");
+          } catch (const CircularDependencyException&) {
+              caught = true;
+          }
+          ASSERT(caught);
+          sheet.Commit();
+          expected = texts(sheet);
+      }
+      {
+          // запись, оборванная сбоем, отрезается, и новые правки идут за ней
+          write_file(journal_path, read_file(journal_path) + std::string("\x20\0\0\0abc", 7));
+          DurableSheet sheet(directory);
+          ASSERT(texts(sheet) == expected);
+          ASSERT_EQUAL(std::get<double>(sheet.GetSheet().GetCell("B1"_pos)->GetValue()), 6.);
+          sheet.SetCell("A2"_pos, "=B1+1");
+          sheet.Commit();
+          expected = texts(sheet);
+      }
+      std::string stale_journal;
+      {
+          DurableSheet sheet(directory);
+          ASSERT(texts(sheet) == expected);
+          stale_journal = read_file(journal_path);
+          sheet.Checkpoint();
+          ASSERT_EQUAL(read_file(journal_path).size(), JOURNAL_HEADER_SIZE);
+          sheet.SetCell("A1"_pos, "5");
+          sheet.Commit();
+          expected = texts(sheet);
+      }
+      {
+          DurableSheet sheet(directory);
+          ASSERT(texts(sheet) == expected);
+          ASSERT_EQUAL(std::get<double>(sheet.GetSheet().GetCell("A2"_pos)->GetValue()), 16.);
+          sheet.Checkpoint();
+          expected = texts(sheet);
+      }
+      {
+          // сбой между контрольной точкой и сменой журнала: журнал прошлого
+          // поколения отбрасывается
+          write_file(journal_path, stale_journal);
+          DurableSheet sheet(directory);
+          ASSERT(texts(sheet) == expected);
+      }
+      {
+          // контрольная точка при каждой фиксации
+          DurableSheet sheet(directory, {SyncPolicy::Never, {}, 1});
+          sheet.SetCell("D4"_pos, "text");
+          sheet.Commit();
+          ASSERT_EQUAL(read_file(journal_path).size(), JOURNAL_HEADER_SIZE);
+          expected = texts(sheet);
+      }
+      {
+          DurableSheet sheet(directory);
+          ASSERT(texts(sheet) == expected);
+      }
+      {
+          // интервал не истечёт: хвост журнала сбрасывают Sync и закрытие
+          DurableSheet sheet(directory, {SyncPolicy::Interval, std::chrono::hours(1), 0});
+          sheet.SetCell("E5"_pos, "1");
+          sheet.Commit();
+          sheet.Sync();
+          sheet.SetCell("E6"_pos, "2");
+          expected = texts(sheet);
+      }
+      {
+          DurableSheet sheet(directory);
+          ASSERT(texts(sheet) == expected);
+          ASSERT_EQUAL(sheet.GetSheet().GetCell("E6"_pos)->GetText(), "2");
+      }
+
+      std::remove((std::string(directory) + "/checkpoint").c_str());
+      std::remove(journal_path.c_str());
+      ASSERT_EQUAL(rmdir(directory), 0);
+  }
+
+  void TestPublishedVersions() {
+      Sheet sheet;
+      {
+          const auto version = sheet.GetVersions().Read();
+          ASSERT_EQUAL(version->GetNumber(), 0u);
+          ASSERT_EQUAL(version->GetPrintableSize(), (Size{0, 0}));
+      }
+
+      sheet.SetCell("A1"_pos, "2");
+      sheet.SetCell("B1"_pos, "=A1*3");
+      sheet.SetCell("C1"_pos, "'=text");
+      sheet.SetCell("D1"_pos, "=1/0");
+      sheet.SetCell("Z100"_pos, "far");
+      sheet.Publish();
+      const auto first = sheet.GetVersions().Read();
+      ASSERT_EQUAL(first->GetNumber(), 1u);
+      ASSERT_EQUAL(first->GetPrintableSize(), (Size{100, 26}));
+      ASSERT(first->GetText("B1"_pos) == "=A1*3");
+      ASSERT(first->GetValue("B1"_pos) == CellInterface::ValueView(6.));
+      ASSERT(first->GetText("C1"_pos) == "'=text");
+      ASSERT(first->GetValue("C1"_pos) == CellInterface::ValueView(std::string_view("=text")));
+      ASSERT(first->GetValue("D1"_pos) == CellInterface::ValueView(FormulaError(FormulaError::Category::Div0)));
+      ASSERT(first->GetText("E1"_pos).empty());
+
+      // правки не видны в опубликованной версии, пока её читают
+      sheet.SetCell("A1"_pos, "5");
+      sheet.ClearCell("C1"_pos);
+      sheet.Publish();
+      const auto second = sheet.GetVersions().Read();
+      ASSERT_EQUAL(second->GetNumber(), 2u);
+      ASSERT(second->GetValue("B1"_pos) == CellInterface::ValueView(15.));
+      ASSERT(second->GetText("C1"_pos).empty());
+      ASSERT(second->GetText("Z100"_pos) == "far");
+      ASSERT(first->GetValue("B1"_pos) == CellInterface::ValueView(6.));
+      ASSERT(first->GetText("C1"_pos) == "'=text");
+
+      // читатели видят только целые версии
+      constexpr int cells = 40;
+      constexpr int rounds = 300;
+      Sheet shared;
+      shared.SetCell("C1"_pos, "=SUM(A1:A" + std::to_string(cells) + ")");
+      shared.Publish();
+      std::atomic<bool> done{false};
+      std::atomic<int> torn{0};
+      std::vector<std::thread> readers;
+      for (int i = 0; i < 4; ++i) {
+          readers.emplace_back([&shared, &done, &torn] {
+              std::uint64_t last = 0;
+              while (!done.load()) {
+                  const auto version = shared.GetVersions().Read();
+                  const auto value = version->GetText("A1"_pos);
+                  for (int row = 1; row < cells; ++row) {
+                      if (version->GetText({row, 0}) != value) {
+                          ++torn;
+                      }
+                  }
+                  const auto sum = std::get<double>(version->GetValue("C1"_pos));
+                  const double expected = value.empty() ? 0. : std::stod(std::string(value)) * cells;
+                  if (sum != expected || version->GetNumber() < last) {
+                      ++torn;
+                  }
+                  last = version->GetNumber();
+              }
+          });
+      }
+      for (int round = 1; round <= rounds; ++round) {
+          for (int row = 0; row < cells; ++row) {
+              shared.SetCell({row, 0}, std::to_string(round));
+          }
+          shared.Publish();
+      }
+      done = true;
+      for (auto& reader : readers) {
+          reader.join();
+      }
+      ASSERT_EQUAL(torn.load(), 0);
+      ASSERT_EQUAL(shared.GetVersions().Read()->GetNumber(), static_cast<std::uint64_t>(rounds + 1));
+  }
+
+  void TestBatch() {
+      Sheet sheet;
+      sheet.SetCell("A1"_pos, "=B1");
+      sheet.SetCell("B1"_pos, "1");
+      sheet.SetCell("C1"_pos, "=A1+B1");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2.);
+
+      // по одной эти правки замкнули бы цикл A1 -> B1 -> A1
+      sheet.BeginBatch();
+      sheet.SetCell("B1"_pos, "=A1*2");
+      sheet.SetCell("A1"_pos, "3");
+      sheet.SetCell("D5"_pos, "temp");
+      sheet.SetCell("A1"_pos, "5");
+      sheet.ClearCell("D5"_pos);
+      sheet.SetCell("E2"_pos, "text");
+      ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B1");
+      ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 3}));
+      sheet.CommitBatch();
+      ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 10.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 15.);
+      ASSERT(sheet.GetCell("D5"_pos) == nullptr);
+      ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 5}));
+
+      // пакет с циклом или ошибкой разбора не меняет таблицу
+      const auto check_unchanged = [&sheet] {
+          ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5");
+          ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*2");
+          ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 15.);
+          ASSERT(sheet.GetCell("F9"_pos) == nullptr);
+          ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "text");
+          ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 5}));
+      };
+      sheet.BeginBatch();
+      sheet.SetCell("F9"_pos, "=A1");
+      sheet.ClearCell("E2"_pos);
+      sheet.SetCell("A1"_pos, "=C1");
+      try {
+          sheet.CommitBatch();
+          ASSERT(false);
+      } catch (const CircularDependencyException&) {
+      }
+      check_unchanged();
+
+      // пустая ячейка, созданная для ссылки отменённой формулы, убирается
+      sheet.BeginBatch();
+      sheet.SetCell("A1"_pos, "=Z100");
+      sheet.SetCell("B1"_pos, "=B1");
+      try {
+          sheet.CommitBatch();
+          ASSERT(false);
+      } catch (const CircularDependencyException&) {
+      }
+      ASSERT(sheet.GetCell("Z100"_pos) == nullptr);
+      check_unchanged();
+
+      sheet.BeginBatch();
+      sheet.SetCell("F9"_pos, "1");
+      sheet.SetCell("A1"_pos, "=1+");
+      try {
+          sheet.CommitBatch();
+          ASSERT(false);
+      } catch (const FormulaException&) {
+      }
+      check_unchanged();
+
+      sheet.BeginBatch();
+      sheet.SetCell("A1"_pos, "7");
+      try {
+          sheet.SetCell(Position{-1, 0}, "1");
+          ASSERT(false);
+      } catch (const InvalidPositionException&) {
+      }
+      sheet.RollbackBatch();
+      check_unchanged();
+
+      // после отката граф прежний
+      sheet.SetCell("A1"_pos, "1");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 3.);
+      try {
+          sheet.SetCell("A1"_pos, "=B1");
+          ASSERT(false);
+      } catch (const CircularDependencyException&) {
+    
+      // X1 вычислена, хотя её аргумент Y1 устарел (вычисление остановилось
+      // на ошибке E1); цикл A1 -> X1 -> Y1 -> A1 всё равно находится
+      Sheet stale;
+      stale.SetCell("E1"_pos, "=1/0");
+      stale.SetCell("Y1"_pos, "=A1");
+      stale.SetCell("X1"_pos, "=E1+Y1");
+      ASSERT(std::holds_alternative<FormulaError>(stale.GetCell("X1"_pos)->GetValue()));
+      stale.BeginBatch();
+      stale.SetCell("A1"_pos, "=X1");
+      try {
+          stale.CommitBatch();
+          ASSERT(false);
+      } catch (const CircularDependencyException&) {
+      }
+      ASSERT(stale.GetCell("A1"_pos) == nullptr || stale.GetCell("A1"_pos)->GetText().empty());
+      stale.SetCell("E1"_pos, "1");
+      ASSERT_EQUAL(std::get<double>(stale.GetCell("X1"_pos)->GetValue()), 1.);
+  }
+  }
+
+  void TestStats() {
+      Sheet sheet;
+      sheet.SetCell("A1"_pos, "1");
+      sheet.SetCell("B1"_pos, "=A1*2");
+      sheet.SetCell("B2"_pos, "=A2*2");
+      sheet.SetCell("C1"_pos, "=B1+B2");
+      auto stats = sheet.GetStats();
+      // у B1 и B2 одна относительная запись
+      ASSERT_EQUAL(stats.formula_parses, 2u);
+      ASSERT(stats.parse_nanoseconds > 0);
+      ASSERT_EQUAL(stats.cycle_checks, 3u);
+      ASSERT_EQUAL(stats.storage_chunks, 1u);
+      ASSERT(stats.storage_resizes >= 1);
+
+      sheet.Recalculate();
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2.);
+      stats = sheet.GetStats();
+      ASSERT_EQUAL(stats.evaluations, 3u);
+      // C1 читает B1 и B2, затем C1 читается из кеша
+      ASSERT_EQUAL(stats.cache_hits, 3u);
+
+      // цикл находится через B2 и C1
+      try {
+          sheet.SetCell("A2"_pos, "=C1");
+          ASSERT(false);
+      } catch (const CircularDependencyException&) {
+      }
+      const auto before = sheet.GetStats();
+      ASSERT_EQUAL(before.cycle_checks, 4u);
+      ASSERT_EQUAL(before.cycle_check_visits, 2u);
+      sheet.SetCell("A1"_pos, "5");
+      const auto after = sheet.GetStats();
+      ASSERT_EQUAL(after.invalidations - before.invalidations, 1u);
+      ASSERT_EQUAL(after.invalidated_cells - before.invalidated_cells, 2u);
+
+      // задачи параллельного пересчёта считают в собственные счётчики
+      constexpr int rows = 1000;
+      Sheet parallel;
+      parallel.SetRecalculationThreads(4);
+      parallel.SetCell("A1"_pos, "1");
+      for (int i = 0; i < rows; ++i) {
+          parallel.SetCell({i, 1}, "=A1+" + std::to_string(i));
+      }
+      parallel.Recalculate();
+      ASSERT_EQUAL(parallel.GetStats().evaluations, static_cast<std::uint64_t>(rows));
+      ASSERT_EQUAL(parallel.GetStats().formula_parses, static_cast<std::uint64_t>(rows));
+
+      // интервалы пишутся только во включённый журнал
+      const auto trace = [&sheet] {
+          std::ostringstream out;
+          StreamSink sink(out);
+          sheet.WriteTrace(sink);
+          return out.str();
+      };
+      sheet.Recalculate();
+      ASSERT_EQUAL(trace(), "{\"traceEvents\":[\n]}\n");
+      sheet.EnableTracing(true);
+      sheet.SetCell("A1"_pos, "6");
+      sheet.Recalculate();
+      sheet.EnableTracing(false);
+      sheet.Recalculate();
+      const auto events = trace();
+      ASSERT(events.find("{\"name\":\"Recalculate\",\"cat\":\"sheet\",\"ph\":\"X\"") != std::string::npos);
+      ASSERT(events.find("\"name\":\"Recalculate level\"") != std::string::npos);
+      ASSERT(events.find("\"args\":{\"value\":2}") != std::string::npos);
+      ASSERT_EQUAL(std::count(events.begin(), events.end(), '\n'), 5);
+
+      // время - в микросекундах с точностью до наносекунды, значение -
+      // целым числом без округления
+      Tracer tracer;
+      tracer.Enable(true);
+      {
+          Tracer::Span span(tracer, "Test", 1234567890123u);
+      }
+      std::ostringstream out;
+      StreamSink sink(out);
+      tracer.Write(sink);
+      const auto json = out.str();
+      ASSERT(json.find("\"args\":{\"value\":1234567890123}") != std::string::npos);
+      for (const auto* field : {"\"ts\":", "\"dur\":"}) {
+          const auto begin = json.find(field) + std::strlen(field);
+          const auto end = json.find(',', begin);
+          const auto number = json.substr(begin, end - begin);
+          const auto point = number.find('.');
+          ASSERT(point != std::string::npos && point > 0);
+          ASSERT_EQUAL(number.size() - point, 4u);
+          ASSERT(std::all_of(number.begin(), number.end(), [](char c) {
+              return c == '.' || (c >= '0' && c <= '9');
+          }));
+      }
+  }
+
+  void TestRecalculate() {
+      constexpr int chain = 3000;
+      Sheet sheet;
+      sheet.SetCell("B1"_pos, "1");
+      for (int i = 1; i < chain; ++i) {
+          sheet.SetCell(Position{i, 1}, "=" + Position{i - 1, 1}.ToString() + "*1+1");
+          sheet.SetCell(Position{i, 0}, "=" + Position{i, 1}.ToString() + "-1");
+      }
+      sheet.Recalculate();
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{chain - 1, 1})->GetValue()), double(chain));
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{chain - 1, 0})->GetValue()), chain - 1.);
+
+      sheet.SetCell("B1"_pos, "=1/0");
+      sheet.SetCell("C1"_pos, "=A100");
+      sheet.ClearCell(Position{chain - 1, 0});
+      sheet.Recalculate();
+      ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell(Position{chain - 1, 1})->GetValue()),
+                   FormulaError(FormulaError::Category::Div0));
+      ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("C1"_pos)->GetValue()),
+                   FormulaError(FormulaError::Category::Div0));
+
+      sheet.SetCell("B1"_pos, "5");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 103.);
+      sheet.Recalculate();
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{chain - 1, 1})->GetValue()), chain + 4.);
+  }
+
+  void TestParallelRecalculate() {
+      constexpr int rows = 20;
+      constexpr int cols = 300;
+      Sheet sequential;
+      Sheet parallel;
+      parallel.SetRecalculationThreads(4);
+      const auto fill = [&](Sheet& sheet) {
+          for (int j = 0; j < cols; ++j) {
+              sheet.SetCell(Position{0, j}, std::to_string(j % 7));
+          }
+          for (int i = 1; i < rows; ++i) {
+              for (int j = 0; j < cols; ++j) {
+                  const auto left = Position{i - 1, j}.ToString();
+                  const auto right = Position{i - 1, (j + 1) % cols}.ToString();
+                  sheet.SetCell(Position{i, j}, "=" + left + "/3+" + right + "*0.7-" + left + "/" + right);
+              }
+          }
+      };
+      fill(sequential);
+      fill(parallel);
+
+      for (int round = 0; round < 2; ++round) {
+          sequential.Recalculate();
+          parallel.Recalculate();
+          for (int i = 0; i < rows; ++i) {
+              for (int j = 0; j < cols; ++j) {
+                  const auto expected = sequential.GetCell(Position{i, j})->GetValue();
+                  const auto actual = parallel.GetCell(Position{i, j})->GetValue();
+                  ASSERT(expected == actual);
+              }
+          }
+          sequential.SetCell("A1"_pos, "100");
+          parallel.SetCell("A1"_pos, "100");
+      }
+  }
+
+  void TestRepeatedInvalidation() {
+      Sheet sheet;
+      sheet.SetCell("A1"_pos, "1");
+      sheet.SetCell("B1"_pos, "=A1+1");
+      sheet.SetCell("C1"_pos, "=B1+1");
+      sheet.SetCell("D1"_pos, "=B1+C1");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 5.);
+
+      // повторные правки без чтения: зависимые уже устарели
+      sheet.SetCell("A1"_pos, "5");
+      sheet.SetCell("A1"_pos, "6");
+      ASSERT(sheet.FindCell("D1"_pos)->IsDirty());
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 15.);
+
+      // часть цепочки вычислена, часть - нет
+      sheet.SetCell("A1"_pos, "10");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 11.);
+      sheet.SetCell("A1"_pos, "20");
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 22.);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 43.);
+
+      sheet.ClearCell("A1"_pos);
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 3.);
+  }
+
   }  // namespace
 
   int main() {
       TestRunner tr;
       RUN_TEST(tr, TestEmpty);
       RUN_TEST(tr, TestInvalidPosition);
+      RUN_TEST(tr, TestPositionConversion);
       RUN_TEST(tr, TestSetCellPlainText);
       RUN_TEST(tr, TestClearCell);
       RUN_TEST(tr, TestPrint);
 
       RUN_TEST(tr, TestExample);
       RUN_TEST(tr, TestCorrectFormula);
+      RUN_TEST(tr, TestFarCell);
+      RUN_TEST(tr, TestClearReferencedCell);
+      RUN_TEST(tr, TestCircularDependency);
+      RUN_TEST(tr, TestCircularDependencyDeepGraph);
+      RUN_TEST(tr, TestPrintableSizeTracking);
+      RUN_TEST(tr, TestBytecodeMatchesTree);
+      RUN_TEST(tr, TestParserMatchesAntlr);
+      RUN_TEST(tr, TestRecalculate);
+      RUN_TEST(tr, TestTextOperands);
+      RUN_TEST(tr, TestValueViews);
+      RUN_TEST(tr, TestExportMatchesStreamPrinting);
+      RUN_TEST(tr, TestImport);
+      RUN_TEST(tr, TestSnapshot);
+      RUN_TEST(tr, TestDurableSheet);
+      RUN_TEST(tr, TestPublishedVersions);
+      RUN_TEST(tr, TestBatch);
+      RUN_TEST(tr, TestStats);
+      RUN_TEST(tr, TestParallelRecalculate);
+      RUN_TEST(tr, TestRepeatedInvalidation);
+      RUN_TEST(tr, TestAggregateFunctions);
+      RUN_TEST(tr, TestRangeDependencies);
+      RUN_TEST(tr, TestFormulaInterning);
       return 0;
   }
   
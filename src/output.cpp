@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <ostream>
+#include <system_error>
+
+#include <unistd.h>
+
+#include "output.h"
+
+
+
+namespace {
+constexpr auto CRC_TABLE = [] {
+    std::array<std::uint32_t, 256> table{};
+    for (std::uint32_t i = 0; i < table.size(); ++i) {
+        std::uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0u);
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+}  // namespace
+
+std::uint32_t Crc32(std::string_view data, std::uint32_t crc) {
+    crc = ~crc;
+    for (const char c : data) {
+        crc = CRC_TABLE[(crc ^ static_cast<unsigned char>(c)) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// ------------ StreamSink --------------
+StreamSink::StreamSink(std::ostream& output)
+    : output_(output)
+    {}
+
+void StreamSink::Write(const char* data, std::size_t size) {
+    output_.write(data, static_cast<std::streamsize>(size));
+}
+
+// ------------ FileDescriptorSink --------------
+FileDescriptorSink::FileDescriptorSink(int fd)
+    : fd_(fd)
+    {}
+
+void FileDescriptorSink::Write(const char* data, std::size_t size) {
+    while (size) {
+        const auto written = ::write(fd_, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "write");
+        }
+        data += written;
+        size -= static_cast<std::size_t>(written);
+    }
+}
+
+// ------------ BufferedWriter --------------
+BufferedWriter::BufferedWriter(OutputSink& sink, std::size_t capacity)
+    : sink_(sink)
+    , buffer_(std::max<std::size_t>(capacity, 64))
+    {}
+
+void BufferedWriter::Fill(char c, std::size_t count) {
+    while (count) {
+        if (size_ == buffer_.size()) {
+            Flush();
+        }
+        const auto chunk = std::min(count, buffer_.size() - size_);
+        std::fill_n(buffer_.data() + size_, chunk, c);
+        size_ += chunk;
+        count -= chunk;
+    }
+}
+
+void BufferedWriter::Write(std::string_view text) {
+    if (text.size() > buffer_.size() - size_) {
+        Flush();
+        // длинный текст не дробится на куски размером с буфер
+        if (text.size() > buffer_.size()) {
+            sink_.Write(text.data(), text.size());
+            return;
+        }
+    }
+    std::copy(text.begin(), text.end(), buffer_.data() + size_);
+    size_ += text.size();
+}
+
+void BufferedWriter::WriteNumber(double value) {
+    // самая длинная запись %.6g: -1.23457e-308
+    constexpr std::size_t MAX_NUMBER_LENGTH = 16;
+    if (buffer_.size() - size_ < MAX_NUMBER_LENGTH) {
+        Flush();
+    }
+    char* begin = buffer_.data() + size_;
+    const auto result = std::to_chars(begin, buffer_.data() + buffer_.size(), value,
+                                      std::chars_format::general, 6);
+    size_ += static_cast<std::size_t>(result.ptr - begin);
+}
+
+void BufferedWriter::Flush() {
+    if (size_) {
+        sink_.Write(buffer_.data(), size_);
+        size_ = 0;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string_view>
+#include <vector>
+
+// CRC-32 (многочлен 0xEDB88320, как в zlib); crc - сумма предшествующих
+// данных, чтобы считать сумму по частям.
+std::uint32_t Crc32(std::string_view data, std::uint32_t crc = 0);
+
+// Приёмник байтов, в который выгружается таблица.
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+
+    virtual void Write(const char* data, std::size_t size) = 0;
+};
+
+// Пишет в поток; состояние ошибки потока проверяет вызывающий.
+class StreamSink : public OutputSink {
+public:
+    explicit StreamSink(std::ostream& output);
+
+    void Write(const char* data, std::size_t size) override;
+
+private:
+    std::ostream& output_;
+};
+
+// Пишет прямо в файловый дескриптор, минуя буферы потоков. Дескриптор не
+// закрывается. При ошибке записи бросает std::system_error.
+class FileDescriptorSink : public OutputSink {
+public:
+    explicit FileDescriptorSink(int fd);
+
+    void Write(const char* data, std::size_t size) override;
+
+private:
+    int fd_;
+};
+
+// Копит мелкие записи в буфере и отдаёт их приёмнику крупными блоками.
+// Накопленное уходит в приёмник только при Flush() или заполнении буфера.
+class BufferedWriter {
+public:
+    static constexpr std::size_t DEFAULT_CAPACITY = 1 << 16;
+
+    explicit BufferedWriter(OutputSink& sink, std::size_t capacity = DEFAULT_CAPACITY);
+
+    void Put(char c) {
+        if (size_ == buffer_.size()) {
+            Flush();
+        }
+        buffer_[size_++] = c;
+    }
+    // Пишет count одинаковых символов.
+    void Fill(char c, std::size_t count);
+    void Write(std::string_view text);
+    // Число в том же виде, что и operator<< потока с настройками по
+    // умолчанию (%g, шесть значащих цифр).
+    void WriteNumber(double value);
+
+    void Flush();
+
+private:
+    OutputSink& sink_;
+    std::vector<char> buffer_;
+    std::size_t size_ = 0;
+};
@@ -0,0 +1,67 @@
+#include "pool.h"
+
+#include <algorithm>
+#include <cassert>
+
+
+
+namespace {
+std::size_t AlignBlockSize(std::size_t size) {
+    constexpr std::size_t alignment = alignof(std::max_align_t);
+    size = std::max(size, sizeof(void*));
+    return (size + alignment - 1) / alignment * alignment;
+}
+}  // namespace
+
+// ------------ FixedBlockPool --------------
+
+FixedBlockPool::FixedBlockPool(std::size_t block_size, std::size_t blocks_per_slab)
+    : block_size_(AlignBlockSize(block_size))
+    , blocks_per_slab_(blocks_per_slab)
+    {}
+
+void* FixedBlockPool::Allocate() {
+    if (free_list_) {
+        auto* block = free_list_;
+        free_list_ = block->next;
+        return block;
+    }
+    if (unused_begin_ == unused_end_) {
+        const auto slab_size = block_size_ * blocks_per_slab_;
+        slabs_.push_back(std::make_unique<std::byte[]>(slab_size));
+        unused_begin_ = slabs_.back().get();
+        unused_end_ = unused_begin_ + slab_size;
+    }
+    void* block = unused_begin_;
+    unused_begin_ += block_size_;
+    return block;
+}
+
+void FixedBlockPool::Deallocate(void* block) {
+    assert(block);
+    auto* free_block = static_cast<FreeBlock*>(block);
+    free_block->next = free_list_;
+    free_list_ = free_block;
+}
+
+std::size_t FixedBlockPool::GetBlockSize() const {
+    return block_size_;
+}
+
+std::size_t FixedBlockPool::GetSlabCount() const {
+    return slabs_.size();
+}
+
+// ------------ BlockArena --------------
+
+FixedBlockPool& BlockArena::GetPool(std::size_t block_size) {
+    block_size = AlignBlockSize(block_size);
+    // разных размеров в арене единицы, линейный поиск дешевле хеширования
+    for (const auto& pool : pools_) {
+        if (pool->GetBlockSize() == block_size) {
+            return *pool;
+        }
+    }
+    pools_.push_back(std::make_unique<FixedBlockPool>(block_size));
+    return *pools_.back();
+}
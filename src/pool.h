@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+
+// Пул блоков одинакового размера. Память выделяется крупными плитами (slab),
+// освобождённые блоки складываются в интрузивный список и переиспользуются
+// за O(1). Сами плиты возвращаются системе только при разрушении пула.
+class FixedBlockPool {
+public:
+    explicit FixedBlockPool(std::size_t block_size, std::size_t blocks_per_slab = 256);
+
+    FixedBlockPool(const FixedBlockPool&) = delete;
+    FixedBlockPool& operator=(const FixedBlockPool&) = delete;
+
+    void* Allocate();
+    void Deallocate(void* block);
+
+    std::size_t GetBlockSize() const;
+    std::size_t GetSlabCount() const;
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    std::size_t block_size_;
+    std::size_t blocks_per_slab_;
+    std::vector<std::unique_ptr<std::byte[]>> slabs_;
+    // блоки последней плиты, ещё ни разу не выданные
+    std::byte* unused_begin_ = nullptr;
+    std::byte* unused_end_ = nullptr;
+    FreeBlock* free_list_ = nullptr;
+};
+
+// Набор пулов, разложенных по размерам блоков. Используется как арена одной
+// таблицы: ячейки, их состояния и узлы рёбер зависимостей берут память
+// отсюда, а не из общей кучи.
+class BlockArena {
+public:
+    BlockArena() = default;
+    BlockArena(const BlockArena&) = delete;
+    BlockArena& operator=(const BlockArena&) = delete;
+
+    FixedBlockPool& GetPool(std::size_t block_size);
+
+    template <typename T, typename... Args>
+    T* Create(Args&&... args) {
+        void* block = GetPool(sizeof(T)).Allocate();
+        try {
+            return new (block) T(std::forward<Args>(args)...);
+        } catch (...) {
+            GetPool(sizeof(T)).Deallocate(block);
+            throw;
+        }
+    }
+
+    template <typename T>
+    void Destroy(T* object) {
+        if (object) {
+            object->~T();
+            GetPool(sizeof(T)).Deallocate(object);
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<FixedBlockPool>> pools_;
+};
+
+// Аллокатор для узловых контейнеров (std::unordered_set и т.п.): одиночные
+// узлы берутся из арены, массивы (например, корзины хеш-таблицы) - из кучи.
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(BlockArena* arena) noexcept
+        : arena_(arena)
+        {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+        : arena_(other.GetArena())
+        {}
+
+    T* allocate(std::size_t n) {
+        if (n == 1) {
+            return static_cast<T*>(arena_->GetPool(sizeof(T)).Allocate());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* p, std::size_t n) noexcept {
+        if (n == 1) {
+            arena_->GetPool(sizeof(T)).Deallocate(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    BlockArena* GetArena() const noexcept {
+        return arena_;
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& rhs) const noexcept {
+        return arena_ == rhs.GetArena();
+    }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& rhs) const noexcept {
+        return arena_ != rhs.GetArena();
+    }
+
+private:
+    BlockArena* arena_;
+};
+
+// Таблица объектов, адресуемых 32-битным индексом. Индексы удалённых объектов
+// переиспользуются, поэтому владелец хранит компактный номер вместо указателя.
+template <typename T>
+class SlotTable {
+public:
+    static constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+
+    template <typename... Args>
+    std::uint32_t Emplace(Args&&... args) {
+        std::uint32_t id;
+        if (free_ids_.empty()) {
+            id = static_cast<std::uint32_t>(slots_.size());
+            slots_.emplace_back();
+        } else {
+            id = free_ids_.back();
+            free_ids_.pop_back();
+        }
+        slots_[id].emplace(std::forward<Args>(args)...);
+        return id;
+    }
+
+    void Remove(std::uint32_t id) {
+        assert(id < slots_.size() && slots_[id]);
+        slots_[id].reset();
+        free_ids_.push_back(id);
+    }
+
+    T& operator[](std::uint32_t id) {
+        assert(id < slots_.size() && slots_[id]);
+        return *slots_[id];
+    }
+    const T& operator[](std::uint32_t id) const {
+        assert(id < slots_.size() && slots_[id]);
+        return *slots_[id];
+    }
+
+    std::size_t GetSize() const {
+        return slots_.size() - free_ids_.size();
+    }
+
+private:
+    std::vector<std::optional<T>> slots_;
+    std::vector<std::uint32_t> free_ids_;
+};
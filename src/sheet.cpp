@@ -7,73 +7,101 @@
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <unordered_map>
 #include <iostream>
 #include <cassert>
 using namespace std::literals;
 
+namespace {
+constexpr int CHUNK_ROWS = SheetVersion::CHUNK_ROWS;
+constexpr int CHUNK_COLS = SheetVersion::CHUNK_COLS;
+
+// Номер блока версии, содержащего pos.
+std::size_t ChunkIndex(Position pos) {
+    return static_cast<std::size_t>(pos.row / CHUNK_ROWS) * (Position::MAX_COLS / CHUNK_COLS)
+        + pos.col / CHUNK_COLS;
+}
+}  // namespace
+
 // ----------- Sheet -------------------
 
-Sheet::~Sheet() {}
+Sheet::~Sheet() {
+    dirty_.clear();
+    // рёбра зависимостей ссылаются только на ячейки этой же таблицы,
+    // поэтому ячейки можно разрушать в любом порядке
+    cells_.ForEach([this](Position, Cell* cell) {
+        cell->dirty_slot_ = CellTables::NONE;
+        DestroyCell(cell);
+    });
+}
 
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException(""s);
     }
-    AdjustSize(pos);
-    if (!text.empty()) {
-        AdjustPrintableSize(pos);
+
+    if (batch_open_) {
+        batch_.emplace_back(pos, std::move(text));
+        return;
     }
 
-    Cell* cell;
-    if (cells_.at(pos.row).at(pos.col)) {
-        cell = dynamic_cast<Cell*>(cells_.at(pos.row).at(pos.col).get());
-        if (cell->GetText() == text) {
+    Cell* cell = FindCell(pos);
+    if (cell) {
+        if (cell->GetTextView() == text) {
             return;
         }
     } else {
-        cells_.at(pos.row).at(pos.col) = std::make_unique<Cell>(dynamic_cast<SheetInterface*>(this));
-        cell = dynamic_cast<Cell*>(cells_.at(pos.row).at(pos.col).get());
+        cell = CreateCell(pos);
+        cells_.Set(pos, cell);
     }
+    const bool was_empty = cell->IsEmpty();
     cell->Set(std::move(text));
-    RelaxPrintableSize();
+    NoteChanged(pos);
+    if (was_empty != cell->IsEmpty()) {
+        UpdatePrintableSize(pos, was_empty);
+    }
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     if (!pos.IsValid()) {
         throw InvalidPositionException(""s);
     }
-    if (size_.rows > pos.row && size_.cols > pos.col) {
-        return cells_.at(pos.row).at(pos.col).get();
-    }
-    return nullptr;
+    return FindCell(pos);
 }
 CellInterface* Sheet::GetCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException(""s);
     }
-    if ((size_.rows >= pos.row + 1) && (size_.cols >= pos.col + 1)) {
-        return cells_.at(pos.row).at(pos.col).get();
-    }
-    return nullptr;
+    return FindCell(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException(""s);
     }
-    if (pos.row >= size_.rows || pos.col >= size_.cols) {
+
+    if (batch_open_) {
+        batch_.emplace_back(pos, std::string{});
         return;
     }
 
-    // очистить ячейку
-    auto& cell = cells_.at(pos.row).at(pos.col);
-    if (!cell || cell->GetText().empty()) {
+    Cell* cell = FindCell(pos);
+    if (!cell || cell->IsEmpty()) {
         return;
     }
-    cell.reset();
+
+    // очистить ячейку: отвязать её от зависимостей и сбросить кеш зависимых
+    cell->Clear();
+    NoteChanged(pos);
+    // пустая ячейка, на которую ссылаются формулы, хранит рёбра графа;
+    // остальные сразу возвращаются в пул
+    if (!cell->HasInfluences()) {
+        cells_.Erase(pos);
+        DestroyCell(cell);
+    }
 
     // проверить размер на предмет уменьшения печатной области
-    RelaxPrintableSize();
+    UpdatePrintableSize(pos, false);
 }
 
 Size Sheet::GetPrintableSize() const {
@@ -81,95 +109,808 @@ Size Sheet::GetPrintableSize() const {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    for (int i = 0; i < printable_size_.rows; ++i) {
-        for (int j = 0; j < printable_size_.cols; ++j) {
-            const auto& cell = cells_.at(i).at(j);
-            if (cell) {
-                std::visit(ValueGetter{output}, cell->GetValue());
+    StreamSink sink(output);
+    ExportValues(sink);
+}
+void Sheet::PrintTexts(std::ostream& output) const {
+    StreamSink sink(output);
+    ExportTexts(sink);
+}
+
+void Sheet::ExportValues(OutputSink& sink) const {
+    Export(sink, [](const Cell* cell, BufferedWriter& out) {
+        std::visit(ValueWriter{out}, cell->GetValueView());
+    });
+}
+void Sheet::ExportTexts(OutputSink& sink) const {
+    Export(sink, [](const Cell* cell, BufferedWriter& out) {
+        out.Write(cell->GetTextView());
+    });
+}
+
+template <typename F>
+void Sheet::Export(OutputSink& sink, F write_cell) const {
+    const auto [rows, cols] = printable_size_;
+    if (!rows) {
+        return;
+    }
+
+    BufferedWriter out(sink);
+    // позиция, до которой дописаны разделители
+    int row = 0;
+    int col = 0;
+    const auto finish_row = [&] {
+        out.Fill('\t', static_cast<std::size_t>(cols - 1 - col));
+        out.Put('\n');
+        ++row;
+        col = 0;
+    };
+    cells_.ForEachInRange({0, 0}, {rows - 1, cols - 1}, [&](Position pos, const Cell* cell) {
+        if (cell->IsEmpty()) {
+            return;
+        }
+        while (row < pos.row) {
+            finish_row();
+        }
+        out.Fill('\t', static_cast<std::size_t>(pos.col - col));
+        col = pos.col;
+        write_cell(cell, out);
+    });
+    while (row < rows) {
+        finish_row();
+    }
+    out.Flush();
+}
+
+void Sheet::Import(InputSource& source) {
+    Tracer::Span span(tracer_, "Import");
+    std::vector<Cell*> imported;
+    std::size_t linked = 0;
+    try {
+        ForEachTsvField(source, [this, &imported](Position pos, std::string_view text) {
+            if (!pos.IsValid()) {
+                throw InvalidPositionException("Import: position out of the table"s);
             }
-            if (j != printable_size_.cols - 1) {
-                output << '\t';
+            Cell* cell = FindCell(pos);
+            if (!cell) {
+                cell = CreateCell(pos);
+                cells_.Set(pos, cell);
+            } else if (!cell->IsEmpty()) {
+                throw InvalidPositionException("Import: cell "s + pos.ToString() + " is not empty"s);
             }
+            imported.push_back(cell);
+            cell->Load(std::string(text));
+            UpdatePrintableSize(pos, true);
+            NoteChanged(pos);
+        });
+        span.SetValue(imported.size());
+        FinishImport(imported, linked);
+    } catch (...) {
+        RollbackImport(imported, linked);
+        throw;
+    }
+}
+
+void Sheet::Import(std::istream& input) {
+    StreamSource source(input);
+    Import(source);
+}
+
+void Sheet::FinishImport(const std::vector<Cell*>& imported, std::size_t& linked) {
+    for (Cell* cell : imported) {
+        if (cell->IsReferenced()) {
+            cell->LinkReferences();
+        }
+        ++linked;
+    }
+
+    // кеш зависимых сбрасывается от каждой загруженной ячейки: загруженные
+    // формулы уже устаревшие, и обход на них остановился бы
+    for (Cell* cell : imported) {
+        InvalidateDependents(cell);
+        if (cell->IsDirty()) {
+            MarkDirty(cell);
         }
-        output << '\n';
     }
+
+    CheckCycles(imported);
 }
-void Sheet::PrintTexts(std::ostream& output) const {
-    for (int i = 0; i < printable_size_.rows; ++i) {
-        for (int j = 0; j < printable_size_.cols; ++j) {
-            const auto& cell = cells_.at(i).at(j);
-            if (cell) {
-                output << cell->GetText();
+
+void Sheet::CheckCycles(const std::vector<Cell*>& changed) {
+    // до правки граф был без циклов, а новые рёбра ведут только в изменённые
+    // формулы, поэтому любой новый цикл проходит через одну из них. Поиск в
+    // глубину по рёбрам к зависимым: ячейка на текущем пути отмечена
+    // on_path, пройденная целиком - done; ребро в ячейку на пути замыкает
+    // цикл. Очередь устаревших для этого не годится (см. InvalidateDependents)
+    ++stats_.cycle_checks;
+    const auto on_path = NextVisitMark();
+    const auto done = NextVisitMark();
+    // ячейка и признак выхода из неё
+    std::vector<std::pair<Cell*, bool>> stack;
+    for (Cell* start : changed) {
+        if (!start->IsReferenced() || start->visit_mark_ == done) {
+            continue;
+        }
+        stack.emplace_back(start, false);
+        while (!stack.empty()) {
+            const auto [cell, leave] = stack.back();
+            stack.pop_back();
+            if (leave) {
+                cell->visit_mark_ = done;
+                continue;
+            }
+            if (cell->visit_mark_ == done) {
+                continue;
             }
-            if (j != printable_size_.cols - 1) {
-                output << '\t';
+            // на пути лежат ровно предки ячейки, положившей эту в стек
+            if (cell->visit_mark_ == on_path) {
+                throw CircularDependencyException("Circular Dependency in cell ["s
+                        + cell->pos_.ToString() + "]"s);
             }
+            cell->visit_mark_ = on_path;
+            ++stats_.cycle_check_visits;
+            stack.emplace_back(cell, true);
+            ForEachDependent(cell, [done, &stack](Cell* dependent) {
+                if (dependent->visit_mark_ != done) {
+                    stack.emplace_back(dependent, false);
+                }
+            });
         }
-        output << '\n';
     }
 }
 
-void Sheet::AdjustSize(Position pos) {
-    if (size_.rows < pos.row + 1) {
-        cells_.resize(pos.row + 1);
-        for (int i = size_.rows; i < pos.row + 1; ++i) {
-            cells_.at(i).resize(size_.cols);
+void Sheet::RollbackImport(const std::vector<Cell*>& imported, std::size_t linked) {
+    // связывание создало пустые ячейки для ссылок загруженных формул
+    std::vector<Position> referenced;
+    for (std::size_t i = 0; i < linked; ++i) {
+        if (imported[i]->IsReferenced()) {
+            const auto cells = imported[i]->GetReferencedCells();
+            referenced.insert(referenced.end(), cells.begin(), cells.end());
+            imported[i]->UnlinkReferences();
+        }
+    }
+    for (Cell* cell : imported) {
+        const auto pos = cell->pos_;
+        if (!cell->IsEmpty()) {
+            UpdatePrintableSize(pos, false);
+        }
+        cell->Unload();
+        if (!cell->HasInfluences()) {
+            cells_.Erase(pos);
+            DestroyCell(cell);
         }
-        size_.rows = pos.row + 1;
     }
-    if (size_.cols < pos.col + 1) {
-        size_.cols = pos.col + 1;
-        for (int i = 0; i < size_.rows; ++i) {
-            cells_.at(i).resize(size_.cols);
+    DestroyUnusedCells(referenced);
+}
+
+void Sheet::DestroyUnusedCells(const std::vector<Position>& positions) {
+    for (const auto pos : positions) {
+        Cell* cell = FindCell(pos);
+        if (cell && cell->IsEmpty() && !cell->HasInfluences()) {
+            cells_.Erase(pos);
+            DestroyCell(cell);
         }
     }
 }
 
-void Sheet::AdjustPrintableSize(Position pos) {
-    if (printable_size_.rows < pos.row + 1) {
-        printable_size_.rows = pos.row + 1;
+void Sheet::BeginBatch() {
+    assert(!batch_open_);
+    batch_open_ = true;
+}
+
+void Sheet::CommitBatch() {
+    assert(batch_open_);
+    auto edits = std::move(batch_);
+    batch_.clear();
+    batch_open_ = false;
+    Tracer::Span span(tracer_, "CommitBatch", edits.size());
+
+    struct Change {
+        Position pos;
+        // до применения - новое содержимое, после - прежнее
+        Cell::Content content;
+    };
+    std::vector<Change> changes;
+    changes.reserve(edits.size());
+    const auto release_formulas = [this, &changes] {
+        for (const auto& change : changes) {
+            if (change.content.formula != CellTables::NONE) {
+                tables_.RemoveFormula(change.content.formula);
+            }
+        }
+    };
+
+    // формулы разбираются до первого изменения таблицы; из правок одной
+    // ячейки действует последняя
+    std::stable_sort(edits.begin(), edits.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    try {
+        for (std::size_t i = 0; i < edits.size(); ++i) {
+            auto& [pos, text] = edits[i];
+            if (i + 1 < edits.size() && edits[i + 1].first == pos) {
+                continue;
+            }
+            const Cell* cell = FindCell(pos);
+            if (cell ? cell->GetTextView() == text : text.empty()) {
+                continue;
+            }
+            Cell::Content content;
+            if (text.size() > 1u && text[0] == FORMULA_SIGN) {
+                content.kind = Cell::Kind::Formula;
+                content.formula = tables_.AddFormula(std::string_view(text).substr(1u), pos);
+            } else if (!text.empty()) {
+                content.kind = Cell::Kind::Text;
+                content.text = std::move(text);
+            }
+            changes.push_back({pos, std::move(content)});
+        }
+    } catch (...) {
+        release_formulas();
+        throw FormulaException("Syntax err");
+    }
+
+    // сначала снимаются рёбра всех прежних формул, затем заводятся рёбра
+    // новых: так рёбра между изменёнными ячейками не зависят от порядка
+    std::vector<Cell*> changed;
+    changed.reserve(changes.size());
+    std::size_t linked = 0;
+    try {
+        for (auto& change : changes) {
+            Cell* cell = GetOrCreateCell(change.pos);
+            cell->UnlinkReferences();
+            change.content = cell->Exchange(std::move(change.content));
+            changed.push_back(cell);
+        }
+        for (Cell* cell : changed) {
+            cell->LinkReferences();
+            ++linked;
+        }
+        for (Cell* cell : changed) {
+            InvalidateDependents(cell);
+            if (cell->IsDirty()) {
+                MarkDirty(cell);
+            }
+        }
+        CheckCycles(changed);
+    } catch (...) {
+        // прежний граф восстанавливается тем же порядком; формулы, кеш
+        // которых успел сброситься, просто пересчитаются заново. Связывание
+        // новых формул могло создать пустые ячейки для их ссылок.
+        std::vector<Position> referenced;
+        for (std::size_t i = 0; i < linked; ++i) {
+            if (changed[i]->IsReferenced()) {
+                const auto cells = changed[i]->GetReferencedCells();
+                referenced.insert(referenced.end(), cells.begin(), cells.end());
+            }
+            changed[i]->UnlinkReferences();
+        }
+        for (std::size_t i = 0; i < changed.size(); ++i) {
+            changes[i].content = changed[i]->Exchange(std::move(changes[i].content));
+        }
+        for (Cell* cell : changed) {
+            cell->LinkReferences();
+        }
+        for (Cell* cell : changed) {
+            InvalidateDependents(cell);
+            if (cell->IsDirty()) {
+                MarkDirty(cell);
+            }
+            if (cell->IsEmpty() && !cell->HasInfluences()) {
+                cells_.Erase(cell->pos_);
+                DestroyCell(cell);
+            }
+        }
+        DestroyUnusedCells(referenced);
+        release_formulas();
+        throw;
     }
-    if (printable_size_.cols < pos.col + 1) {
-        printable_size_.cols = pos.col + 1;
+
+    for (std::size_t i = 0; i < changes.size(); ++i) {
+        Cell* cell = changed[i];
+        const auto pos = changes[i].pos;
+        const bool was_empty = changes[i].content.kind == Cell::Kind::Empty;
+        NoteChanged(pos);
+        if (was_empty != cell->IsEmpty()) {
+            UpdatePrintableSize(pos, was_empty);
+        }
+        if (cell->IsEmpty() && !cell->HasInfluences()) {
+            cells_.Erase(pos);
+            DestroyCell(cell);
+        }
     }
+    release_formulas();
 }
 
-void Sheet::RelaxPrintableSize() {
-    for (int i = printable_size_.rows - 1; i >= 0; --i) {
-        bool is_empty = true;
-        for (int j = 0; j < printable_size_.cols; ++j) {
-            const auto& cell = cells_.at(i).at(j);
-            if (cell && !cell->GetText().empty()) {
-                is_empty = false;
+void Sheet::RollbackBatch() {
+    assert(batch_open_);
+    batch_.clear();
+    batch_open_ = false;
+}
+
+void Sheet::SaveSnapshot(OutputSink& sink) const {
+    Tracer::Span span(tracer_, "SaveSnapshot");
+    SnapshotWriter writer;
+    // номера формул таблицы в снимке
+    std::unordered_map<std::uint32_t, std::uint32_t> formulas;
+    const auto [rows, cols] = printable_size_;
+    if (rows) {
+        cells_.ForEachInRange({0, 0}, {rows - 1, cols - 1}, [&](Position pos, const Cell* cell) {
+            switch (cell->kind_) {
+            case Cell::Kind::Empty:
+                break;
+            case Cell::Kind::Text:
+                writer.AddText(pos, cell->text_);
                 break;
+            case Cell::Kind::Formula: {
+                auto [it, added] = formulas.emplace(cell->formula_, 0);
+                if (added) {
+                    it->second = writer.AddFormula(cell->GetFormula());
+                }
+                std::optional<FormulaInterface::Value> cashe;
+                if (cell->cashe_state_ == Cell::CasheState::Value) {
+                    cashe = cell->cashe_value_;
+                } else if (cell->cashe_state_ == Cell::CasheState::Error) {
+                    cashe = FormulaError(cell->cashe_error_);
+                }
+                writer.AddFormulaCell(pos, it->second, cashe);
+                break;
+            }
+            }
+        });
+    }
+    writer.Write(sink);
+}
+
+void Sheet::LoadSnapshot(std::string_view data) {
+    Tracer::Span span(tracer_, "LoadSnapshot");
+    if (!(printable_size_ == Size{})) {
+        throw SnapshotException("Snapshot: the sheet is not empty"s);
+    }
+    SnapshotReader reader(data);
+
+    // формулы собираются заранее: вместе с ними проверяется, что ссылки
+    // каждой ячейки остаются в пределах таблицы
+    std::vector<std::unique_ptr<RelativeFormula>> formulas(reader.GetFormulaCount());
+    // прямоугольник, накрывающий ссылки формулы, относительно её anchor
+    std::vector<CellRange> extents(formulas.size());
+    for (std::size_t i = 0; i < formulas.size(); ++i) {
+        formulas[i] = reader.ReadFormula(i);
+        const auto anchor = formulas[i]->GetAnchor();
+        CellRange extent{{0, 0}, {0, 0}};
+        const auto cover = [&extent, anchor](Position pos) {
+            extent.from.row = std::min(extent.from.row, pos.row - anchor.row);
+            extent.from.col = std::min(extent.from.col, pos.col - anchor.col);
+            extent.to.row = std::max(extent.to.row, pos.row - anchor.row);
+            extent.to.col = std::max(extent.to.col, pos.col - anchor.col);
+        };
+        for (const auto pos : formulas[i]->GetAST().GetCells()) {
+            cover(pos);
+        }
+        for (const auto& range : formulas[i]->GetAST().GetRanges()) {
+            cover(range.from);
+            cover(range.to);
+        }
+        extents[i] = extent;
+    }
+
+    std::vector<Cell*> loaded;
+    loaded.reserve(reader.GetCellCount());
+    std::vector<std::uint32_t> formula_ids(formulas.size(), CellTables::NONE);
+    std::size_t linked = 0;
+    try {
+        for (std::size_t i = 0; i < reader.GetCellCount(); ++i) {
+            const auto record = reader.ReadCell(i);
+            const auto pos = record.pos;
+            if (record.formula != SnapshotReader::NO_FORMULA) {
+                const auto& extent = extents[record.formula];
+                if (!Position{pos.row + extent.from.row, pos.col + extent.from.col}.IsValid()
+                        || !Position{pos.row + extent.to.row, pos.col + extent.to.col}.IsValid()) {
+                    throw SnapshotException("Snapshot: formula in cell "s + pos.ToString()
+                            + " refers outside the table"s);
+                }
             }
+            Cell* cell = FindCell(pos);
+            if (!cell) {
+                cell = CreateCell(pos);
+                cells_.Set(pos, cell);
+            } else if (!cell->IsEmpty()) {
+                throw SnapshotException("Snapshot: cell "s + pos.ToString() + " is repeated"s);
+            }
+            loaded.push_back(cell);
+            if (record.formula == SnapshotReader::NO_FORMULA) {
+                cell->Load(std::string(record.text));
+            } else {
+                auto& id = formula_ids[record.formula];
+                if (id == CellTables::NONE) {
+                    try {
+                        id = tables_.AdoptFormula(std::move(formulas[record.formula]));
+                    } catch (const FormulaException& e) {
+                        throw SnapshotException("Snapshot: "s + e.what());
+                    }
+                }
+                cell->LoadFormula(id);
+            }
+            // печатная область пересчитывается один раз после цикла
+            occupied_rows_.Add(pos.row);
+            occupied_cols_.Add(pos.col);
+            NoteChanged(pos);
+        }
+        printable_size_ = {occupied_rows_.GetExtent(), occupied_cols_.GetExtent()};
+        FinishImport(loaded, linked);
+    } catch (...) {
+        RollbackImport(loaded, linked);
+        throw;
+    }
+
+    // снимок сохранён вместе со значениями, пересчитывать нужно только
+    // формулы, которые не были вычислены и при сохранении
+    for (std::size_t i = 0; i < loaded.size(); ++i) {
+        if (const auto cashe = reader.ReadCell(i).cashe) {
+            loaded[i]->StoreCashe(*cashe);
         }
-        if (is_empty) {
-            --printable_size_.rows;
+    }
+    dirty_.erase(std::remove_if(dirty_.begin(), dirty_.end(), [](Cell* cell) {
+        cell->dirty_slot_ = CellTables::NONE;
+        return !cell->IsDirty();
+    }), dirty_.end());
+    for (std::size_t slot = 0; slot < dirty_.size(); ++slot) {
+        dirty_[slot]->dirty_slot_ = static_cast<std::uint32_t>(slot);
+    }
+}
+
+void Sheet::LoadSnapshotFile(const std::string& path) {
+    const MappedFile file(path);
+    LoadSnapshot(file.GetData());
+}
+
+std::variant<double, FormulaError> Sheet::GetNumericValue(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException(""s);
+    }
+    const Cell* cell = FindCell(pos);
+    if (!cell) {
+        return 0.;
+    }
+    return cell->GetNumericValue();
+}
+
+std::optional<FormulaError> Sheet::GetRangeValues(Position from, Position to,
+                                                  std::vector<double>& values) const {
+    std::optional<FormulaError> error;
+    cells_.ForEachInRange(from, to, [&values, &error](Position, Cell* cell) {
+        if (error || cell->IsEmpty()) {
+            return;
+        }
+        const auto value = cell->GetNumericValue();
+        if (std::holds_alternative<double>(value)) {
+            values.push_back(std::get<double>(value));
         } else {
-            break;
+            error = std::get<FormulaError>(value);
+        }
+    });
+    return error;
+}
+
+void Sheet::Recalculate() {
+    Tracer::Span span(tracer_, "Recalculate");
+    std::vector<Cell*> pending;
+    for (Cell* cell : dirty_) {
+        cell->dirty_slot_ = CellTables::NONE;
+        if (cell->IsDirty()) {
+            pending.push_back(cell);
         }
     }
+    dirty_.clear();
+    span.SetValue(pending.size());
 
-    if (!printable_size_.rows) {
-        printable_size_.cols = 0;
-        return;
+    // формулы уровня пишут только в собственный кеш, а читают закешированные
+    // на прошлых уровнях значения, поэтому потокам не нужны блокировки;
+    // ParallelFor возвращается после завершения всех задач уровня
+    constexpr std::size_t CELLS_PER_TASK = 64;
+    ForEachLevel(pending, [this](const std::vector<Cell*>& level) {
+        Tracer::Span level_span(tracer_, "Recalculate level", level.size());
+        const auto evaluate = [&level](std::size_t task) {
+            const auto begin = task * CELLS_PER_TASK;
+            const auto end = std::min(begin + CELLS_PER_TASK, level.size());
+            for (auto i = begin; i < end; ++i) {
+                level[i]->GetValue();
+            }
+        };
+        const auto tasks = (level.size() + CELLS_PER_TASK - 1) / CELLS_PER_TASK;
+        if (recalc_pool_) {
+            // задачи считают вычисления в собственные счётчики, чтобы потоки
+            // не делили одну строку кеша
+            task_counters_.assign(tasks, EvaluationCounters{});
+            recalc_pool_->ParallelFor(tasks, [this, &evaluate](std::size_t task) {
+                EvaluationScope scope(task_counters_[task]);
+                evaluate(task);
+            });
+            for (const auto& counters : task_counters_) {
+                evaluation_counters_ += counters;
+            }
+        } else {
+            for (std::size_t task = 0; task < tasks; ++task) {
+                evaluate(task);
+            }
+        }
+    });
+}
+
+template <typename F>
+std::size_t Sheet::ForEachLevel(const std::vector<Cell*>& pending, F on_level) {
+    // сброс кеша распространяется на всех зависимых, поэтому невычисленные
+    // аргументы невычисленной формулы тоже лежат в pending, а зависимые
+    // формулы из pending - устаревшие
+    std::vector<Cell*> level;
+    for (Cell* cell : pending) {
+        std::uint32_t dirty_args = 0;
+        for (const auto pos : cell->GetReferencedCells()) {
+            const Cell* arg = FindCell(pos);
+            if (arg && arg->IsDirty()) {
+                ++dirty_args;
+            }
+        }
+        // ячейка, накрытая несколькими диапазонами формулы, учитывается
+        // столько же раз, сколько её потом вернёт ForEachDependent
+        for (const auto& range : cell->GetReferencedRanges()) {
+            cells_.ForEachInRange(range.from, range.to, [&dirty_args](Position, const Cell* arg) {
+                if (arg->IsDirty()) {
+                    ++dirty_args;
+                }
+            });
+        }
+        cell->waiting_args_ = dirty_args;
+        if (!dirty_args) {
+            level.push_back(cell);
+        }
     }
 
-    for (int j = printable_size_.cols - 1; j >= 0; --j) {
-        bool is_empty = true;
-        for (int i = 0; i < printable_size_.rows; ++i) {
-            const auto& cell = cells_.at(i).at(j);
-            if (cell && !cell->GetText().empty()) {
-                is_empty = false;
-                break;
+    std::size_t processed = 0;
+    std::vector<Cell*> next_level;
+    while (!level.empty()) {
+        on_level(static_cast<const std::vector<Cell*>&>(level));
+        processed += level.size();
+
+        next_level.clear();
+        for (Cell* cell : level) {
+            ForEachDependent(cell, [&next_level](Cell* dependent) {
+                if (dependent->IsDirty() && --dependent->waiting_args_ == 0) {
+                    next_level.push_back(dependent);
+                }
+            });
+        }
+        level.swap(next_level);
+    }
+    return processed;
+}
+
+void Sheet::SetRecalculationThreads(std::size_t thread_count) {
+    if (thread_count <= 1) {
+        recalc_pool_.reset();
+    } else if (!recalc_pool_ || recalc_pool_->GetThreadCount() != thread_count) {
+        recalc_pool_ = std::make_unique<ThreadPool>(thread_count);
+    }
+}
+
+void Sheet::Publish() {
+    Tracer::Span span(tracer_, "Publish");
+    Recalculate();
+    const auto& current = versions_.GetCurrent();
+    auto version = std::make_unique<SheetVersion>(current, current.GetNumber() + 1, printable_size_);
+    const auto rebuild = [this, &version](Position origin) {
+        std::shared_ptr<SheetVersion::Chunk> chunk;
+        cells_.ForEachInRange(origin, {origin.row + CHUNK_ROWS - 1, origin.col + CHUNK_COLS - 1},
+                              [&chunk](Position pos, const Cell* cell) {
+            if (cell->IsEmpty()) {
+                return;
+            }
+            if (!chunk) {
+                chunk = std::make_shared<SheetVersion::Chunk>();
+            }
+            chunk->Set(pos, cell->GetTextView(), cell->GetValueView());
+        });
+        version->SetChunk(origin, std::move(chunk));
+    };
+
+    if (!published_) {
+        // все непустые ячейки лежат в печатной области
+        for (int row = 0; row < printable_size_.rows; row += CHUNK_ROWS) {
+            for (int col = 0; col < printable_size_.cols; col += CHUNK_COLS) {
+                rebuild({row, col});
             }
         }
-        if (is_empty) {
-            --printable_size_.cols;
-        } else {
-            break;
+        changed_chunks_.assign(ChunkIndex({Position::MAX_ROWS - 1, Position::MAX_COLS - 1}) + 1, false);
+        published_ = true;
+    } else {
+        span.SetValue(changed_list_.size());
+        for (const auto origin : changed_list_) {
+            rebuild(origin);
+            changed_chunks_[ChunkIndex(origin)] = false;
         }
+        changed_list_.clear();
+    }
+    versions_.Publish(std::move(version));
+}
+
+const SheetVersions& Sheet::GetVersions() const {
+    return versions_;
+}
+
+SheetStats Sheet::GetStats() const {
+    auto stats = stats_;
+    stats.formula_parses = tables_.GetParseCount();
+    stats.parse_nanoseconds = static_cast<std::uint64_t>(tables_.GetParseTime().count());
+    stats.evaluations = evaluation_counters_.evaluations;
+    stats.cache_hits = evaluation_counters_.cache_hits;
+    stats.storage_chunks = cells_.GetChunkCount();
+    stats.storage_resizes = cells_.GetResizeCount();
+    return stats;
+}
+
+void Sheet::EnableTracing(bool enabled) {
+    tracer_.Enable(enabled);
+}
+
+void Sheet::WriteTrace(OutputSink& sink) const {
+    tracer_.Write(sink);
+}
+
+EvaluationCounters& Sheet::GetEvaluationCounters() const {
+    return evaluation_counters_;
+}
+
+Cell* Sheet::FindCell(Position pos) const {
+    const auto* slot = cells_.Find(pos);
+    return slot ? *slot : nullptr;
+}
+
+Cell* Sheet::GetOrCreateCell(Position pos) {
+    Cell* cell = FindCell(pos);
+    if (!cell) {
+        cell = CreateCell(pos);
+        cells_.Set(pos, cell);
+    }
+    return cell;
+}
+
+void Sheet::MarkDirty(Cell* cell) {
+    NoteChanged(cell->pos_);
+    if (cell->dirty_slot_ == CellTables::NONE) {
+        cell->dirty_slot_ = static_cast<std::uint32_t>(dirty_.size());
+        dirty_.push_back(cell);
+    }
+}
+
+void Sheet::InvalidateDependents(Cell* cell) {
+    // значение вычисленной формулы зависит только от аргументов, которые она
+    // прочитала при вычислении, а они не могли устареть без сброса её кеша;
+    // поэтому обход останавливается на устаревших формулах (см. sheet.h).
+    // Устаревание само служит отметкой посещения, и каждая формула попадает
+    // в стек не больше одного раза
+    ++stats_.invalidations;
+    const auto push_dependents = [this](const Cell* from) {
+        ForEachDependent(from, [this](Cell* dependent) {
+            if (dependent->IsDirty()) {
+                return;
+            }
+            dependent->cashe_state_ = Cell::CasheState::Empty;
+            ++stats_.invalidated_cells;
+            MarkDirty(dependent);
+            walk_stack_.push_back(dependent);
+        });
+    };
+
+    push_dependents(cell);
+    while (!walk_stack_.empty()) {
+        const Cell* current = walk_stack_.back();
+        walk_stack_.pop_back();
+        push_dependents(current);
+    }
+}
+
+std::optional<Position> Sheet::FindDependentAmong(const Cell* cell,
+                                                  const std::vector<Position>& cells,
+                                                  const std::vector<CellRange>& ranges) {
+    const auto is_candidate = [&cells, &ranges](const Cell* target) {
+        return std::binary_search(cells.begin(), cells.end(), target->pos_)
+            || std::any_of(ranges.begin(), ranges.end(), [target](const CellRange& range) {
+                   return range.Contains(target->pos_);
+               });
+    };
+    ++stats_.cycle_checks;
+    if (is_candidate(cell)) {
+        return cell->pos_;
+    }
+
+    const auto visited_mark = NextVisitMark();
+    const Cell* found = nullptr;
+    walk_stack_.push_back(cell);
+    while (!walk_stack_.empty() && !found) {
+        const Cell* current = walk_stack_.back();
+        walk_stack_.pop_back();
+        ForEachDependent(current, [&](Cell* dependent) {
+            if (found || dependent->visit_mark_ == visited_mark) {
+                return;
+            }
+            dependent->visit_mark_ = visited_mark;
+            ++stats_.cycle_check_visits;
+            if (is_candidate(dependent)) {
+                found = dependent;
+            }
+            walk_stack_.push_back(dependent);
+        });
+    }
+    walk_stack_.clear();
+    if (found) {
+        return found->pos_;
+    }
+    return std::nullopt;
+}
+
+void Sheet::AddRangeInfluence(CellRange range, Cell* dependent) {
+    range_influences_.Add(range, dependent);
+}
+
+void Sheet::RemoveRangeInfluence(CellRange range, Cell* dependent) {
+    range_influences_.Remove(range, dependent);
+}
+
+template <typename F>
+void Sheet::ForEachDependent(const Cell* cell, F f) const {
+    if (cell->HasInfluences()) {
+        for (Cell* dependent : tables_.GetInfluences(cell->influences_)) {
+            f(dependent);
+        }
+    }
+    range_influences_.ForEachCovering(cell->pos_, f);
+}
+
+std::uint32_t Sheet::NextVisitMark() {
+    if (++visit_mark_ == 0) {
+        // счётчик переполнился: старые отметки могли бы совпасть с новыми
+        cells_.ForEach([](Position, Cell* cell) {
+            cell->visit_mark_ = 0;
+        });
+        visit_mark_ = 1;
+    }
+    return visit_mark_;
+}
+
+Cell* Sheet::CreateCell(Position pos) {
+    void* block = cell_pool_.Allocate();
+    return new (block) Cell(this, tables_, pos);
+}
+
+void Sheet::DestroyCell(Cell* cell) {
+    if (const auto slot = cell->dirty_slot_; slot != CellTables::NONE) {
+        dirty_[slot] = dirty_.back();
+        dirty_[slot]->dirty_slot_ = slot;
+        dirty_.pop_back();
+    }
+    cell->~Cell();
+    cell_pool_.Deallocate(cell);
+}
+
+void Sheet::UpdatePrintableSize(Position pos, bool filled) {
+    if (filled) {
+        occupied_rows_.Add(pos.row);
+        occupied_cols_.Add(pos.col);
+    } else {
+        occupied_rows_.Remove(pos.row);
+        occupied_cols_.Remove(pos.col);
+    }
+    printable_size_ = {occupied_rows_.GetExtent(), occupied_cols_.GetExtent()};
+}
+
+void Sheet::NoteChanged(Position pos) {
+    if (!published_) {
+        return;
+    }
+    const auto index = ChunkIndex(pos);
+    if (!changed_chunks_[index]) {
+        changed_chunks_[index] = true;
+        changed_list_.push_back({pos.row - pos.row % CHUNK_ROWS, pos.col - pos.col % CHUNK_COLS});
     }
 }
 
@@ -3,16 +3,27 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "cell.h"
 #include "common.h"
+#include "input.h"
+#include "output.h"
+#include "pool.h"
+#include "sheet_version.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "storage.h"
+#include "thread_pool.h"
 
 
 
 class Sheet : public SheetInterface {
 public:
-    using Table = std::vector<std::vector<std::unique_ptr<CellInterface>>>;
+    using Table = ChunkedStorage<Cell*>;
 
     Sheet() = default;
     ~Sheet();
@@ -28,29 +39,191 @@ public:
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
-
+    // То же, что PrintValues и PrintTexts, но в произвольный приёмник.
+    // Числа форматируются без потоков, пустые ячейки не просматриваются.
+    void ExportValues(OutputSink& sink) const;
+    void ExportTexts(OutputSink& sink) const;
+
+    // Загружает TSV в формате PrintTexts, начиная с ячейки A1; пустые поля
+    // пропускаются. Непустые поля должны попадать в пустые ячейки, иначе
+    // бросается InvalidPositionException. Рёбра графа, проверка циклов и
+    // сброс кеша зависимых выполняются одним проходом после чтения всех
+    // ячеек. При любой ошибке (в том числе FormulaException и
+    // CircularDependencyException) таблица остаётся прежней.
+    void Import(InputSource& source);
+    void Import(std::istream& input);
+
+    // Пакетная правка: после BeginBatch вызовы SetCell и ClearCell только
+    // проверяют позицию и запоминают правку, а таблица до CommitBatch
+    // остаётся прежней. CommitBatch применяет правки (из правок одной
+    // ячейки - последнюю) одним проходом: рёбра графа, сброс кеша зависимых
+    // и проверка циклов выполняются один раз для всех изменённых ячеек.
+    // Если формула не разбирается (FormulaException) или правки замыкают
+    // цикл (CircularDependencyException), таблица остаётся прежней.
+    // RollbackBatch отбрасывает правки. Пакет закрывается в любом случае.
+    void BeginBatch();
+    void CommitBatch();
+    void RollbackBatch();
+
+    // Сохраняет снимок таблицы (см. snapshot.h): тексты, скомпилированные
+    // формулы и вычисленные значения. Одинаковые относительные формулы
+    // сохраняются один раз.
+    void SaveSnapshot(OutputSink& sink) const;
+    // Загружает снимок в пустую таблицу, не разбирая формул: рёбра графа
+    // строятся по ссылкам формул, вычисленные значения восстанавливаются
+    // без пересчёта. Бросает SnapshotException, если снимок повреждён или
+    // таблица не пуста, и CircularDependencyException, если формулы снимка
+    // образуют цикл; при ошибке таблица остаётся пустой.
+    void LoadSnapshot(std::string_view data);
+    // То же для файла: он отображается в память и читается одним проходом.
+    void LoadSnapshotFile(const std::string& path);
+
+    std::variant<double, FormulaError> GetNumericValue(Position pos) const override;
+    std::optional<FormulaError> GetRangeValues(Position from, Position to,
+                                               std::vector<double>& values) const override;
+
+    // Вычисляет все формулы с устаревшим значением. Формулы разбиваются на
+    // уровни топологического порядка: формулы одного уровня не зависят друг
+    // от друга, а их аргументы вычислены на предыдущих уровнях. Поэтому
+    // каждая формула вычисляется один раз, без рекурсии по цепочке
+    // зависимостей, а уровень можно считать параллельно.
+    void Recalculate();
+    // Задаёт число потоков для Recalculate (вместе с вызывающим).
+    // При 1 пересчёт идёт в вызывающем потоке.
+    void SetRecalculationThreads(std::size_t thread_count);
+
+    // Публикует текущее состояние таблицы для читателей (см. GetVersions):
+    // пересчитывает формулы и собирает новую версию, в которой заново
+    // построены только блоки, изменённые после прошлой публикации.
+    void Publish();
+    // Опубликованные версии. В отличие от самой таблицы, их можно читать из
+    // любых потоков одновременно с правками и публикацией.
+    const SheetVersions& GetVersions() const;
+
+    // Счётчики работы таблицы с момента её создания (см. SheetStats).
+    SheetStats GetStats() const;
+    // Журнал интервалов времени крупных операций: пересчёта и каждого его
+    // уровня, загрузки, снимков, пакетных правок и публикации. WriteTrace
+    // выгружает его в формате Chrome trace events (см. Tracer).
+    void EnableTracing(bool enabled);
+    void WriteTrace(OutputSink& sink) const;
+
+    // Счётчики, в которые ячейки учитывают вычисления вне задач пересчёта.
+    EvaluationCounters& GetEvaluationCounters() const;
+
+    // Внутренний доступ к ячейкам для графа зависимостей: позиция уже
+    // проверена, возвращается конкретный тип без приведения.
+    Cell* FindCell(Position pos) const;
+    // Возвращает ячейку, при необходимости создавая пустую.
+    Cell* GetOrCreateCell(Position pos);
+    // Ставит формулу со сброшенным кешем в очередь пересчёта.
+    void MarkDirty(Cell* cell);
+    // Сбрасывает кеш всех формул, транзитивно зависящих от cell. Обход не
+    // заходит в уже устаревшие формулы: когда формула устарела, её
+    // вычисленные зависимые были сброшены, а вычисленная с тех пор зависимая
+    // либо вычислила её, либо не читала (вычисление останавливается на
+    // первой ошибке). Поэтому у устаревшей формулы могут быть вычисленные
+    // зависимые, и по очереди устаревших нельзя судить о графе (например,
+    // искать в нём циклы).
+    void InvalidateDependents(Cell* cell);
+    // Ищет среди ячеек cells (отсортированных) и ячеек диапазонов ranges ту,
+    // что совпадает с cell или транзитивно от неё зависит, и возвращает её
+    // позицию. Обходятся только формулы, зависящие от cell.
+    std::optional<Position> FindDependentAmong(const Cell* cell, const std::vector<Position>& cells,
+                                               const std::vector<CellRange>& ranges);
+    // Рёбра от ячеек диапазона к формуле, которая на него ссылается.
+    void AddRangeInfluence(CellRange range, Cell* dependent);
+    void RemoveRangeInfluence(CellRange range, Cell* dependent);
 
 private:
+    // арена объявлена раньше таблицы: ячейки должны умирать раньше неё
+    BlockArena arena_;
+    FixedBlockPool& cell_pool_ = arena_.GetPool(sizeof(Cell));
+    CellTables tables_{arena_};
     Table cells_;
-    Size size_;
+    // число непустых ячеек в каждой строке и столбце
+    OccupancyIndex occupied_rows_;
+    OccupancyIndex occupied_cols_;
     Size printable_size_;
+    // формулы, ссылающиеся на диапазоны, по накрытым ими прямоугольникам
+    RangeIndex<Cell*> range_influences_;
+    // формулы, кеш которых сбрасывался после последнего Recalculate
+    std::vector<Cell*> dirty_;
+    // стек обходов графа зависимостей, переживающий вызовы
+    std::vector<const Cell*> walk_stack_;
+    // последняя выданная отметка обхода (Cell::visit_mark_)
+    std::uint32_t visit_mark_ = 0;
+    // пул потоков пересчёта; не создаётся, пока задан один поток
+    std::unique_ptr<ThreadPool> recalc_pool_;
+    SheetVersions versions_;
+    // блоки, изменённые после последней публикации (отметки и список их
+    // левых верхних углов); до первой публикации не отслеживаются
+    bool published_ = false;
+    std::vector<bool> changed_chunks_;
+    std::vector<Position> changed_list_;
+    // счётчики обходов графа; остальные поля собирает GetStats
+    SheetStats stats_;
+    mutable EvaluationCounters evaluation_counters_;
+    // счётчики задач одного уровня пересчёта
+    std::vector<EvaluationCounters> task_counters_;
+    // журнал пишут и константные операции (SaveSnapshot)
+    mutable Tracer tracer_;
+    // открыт ли пакет и его правки (пустой текст - очистка)
+    bool batch_open_ = false;
+    std::vector<std::pair<Position, std::string>> batch_;
 
 private:
-    struct ValueGetter {
-        std::ostream& out;
+    struct ValueWriter {
+        BufferedWriter& out;
 
-        void operator()(const std::string& s) {
-            out << s;
+        void operator()(std::string_view s) {
+            out.Write(s);
         }
         void operator()(double value) {
-            out << value;
+            out.WriteNumber(value);
         }
-        void operator()(const FormulaError& e) {
-            out << e;
+        void operator()(FormulaError e) {
+            out.Write(e.ToString());
         }
     };
 
-    void AdjustSize(Position pos);
-    void AdjustPrintableSize(Position pos);
-    void RelaxPrintableSize();
+    // Выгружает печатную область построчно, вызывая write(const Cell*,
+    // BufferedWriter&) для непустых ячеек; пропуски заполняются табуляциями.
+    template <typename F>
+    void Export(OutputSink& sink, F write_cell) const;
+
+    // Связывает загруженные ячейки с графом и проверяет, что циклов нет.
+    void FinishImport(const std::vector<Cell*>& imported, std::size_t& linked);
+    // Отменяет загрузку: первые linked формул уже связаны с графом.
+    void RollbackImport(const std::vector<Cell*>& imported, std::size_t linked);
+    // Бросает CircularDependencyException, если рёбра графа, заведённые от
+    // изменённых ячеек changed, замкнули цикл; граф до изменения был без
+    // циклов.
+    void CheckCycles(const std::vector<Cell*>& changed);
+
+    // Раскладывает устаревшие формулы pending по уровням топологического
+    // порядка и вызывает on_level(const std::vector<Cell*>&) для каждого
+    // уровня. Возвращает число разложенных формул: формулы на цикле и
+    // зависящие от них не попадают ни в один уровень.
+    template <typename F>
+    std::size_t ForEachLevel(const std::vector<Cell*>& pending, F on_level);
+
+    // Новая отметка обхода, не совпадающая ни с одной из выставленных.
+    std::uint32_t NextVisitMark();
+
+    // Вызывает f(Cell*) для каждой формулы, которая ссылается на cell
+    // напрямую или через диапазон.
+    template <typename F>
+    void ForEachDependent(const Cell* cell, F f) const;
+
+    Cell* CreateCell(Position pos);
+    void DestroyCell(Cell* cell);
+    // Удаляет ячейки positions, которые пусты и ни на что не влияют:
+    // заглушки, созданные для ссылок отменённых формул.
+    void DestroyUnusedCells(const std::vector<Position>& positions);
+
+    // Учитывает появление (filled) или исчезновение непустой ячейки.
+    void UpdatePrintableSize(Position pos, bool filled);
+    // Отмечает, что текст или значение ячейки pos изменились.
+    void NoteChanged(Position pos);
 };
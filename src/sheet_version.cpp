@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <limits>
+#include <thread>
+
+#include "sheet_version.h"
+
+
+
+namespace {
+int SlotIndex(Position pos) {
+    return (pos.row % SheetVersion::CHUNK_ROWS) * SheetVersion::CHUNK_COLS
+        + pos.col % SheetVersion::CHUNK_COLS;
+}
+}  // namespace
+
+// ------------ SheetVersion --------------
+void SheetVersion::Chunk::Set(Position pos, std::string_view text,
+                              const CellInterface::ValueView& value) {
+    auto& slot = slots_[SlotIndex(pos)];
+    slot.text_begin = static_cast<std::uint32_t>(texts_.size());
+    slot.text_size = static_cast<std::uint32_t>(text.size());
+    texts_.append(text);
+    if (const auto* number = std::get_if<double>(&value)) {
+        slot.kind = Kind::Number;
+        slot.number = *number;
+    } else if (const auto* error = std::get_if<FormulaError>(&value)) {
+        slot.kind = Kind::Error;
+        slot.error = error->GetCategory();
+    } else {
+        // значение текста - его запись без экранирующего символа
+        slot.kind = Kind::Text;
+        slot.value_offset = static_cast<std::uint32_t>(
+            text.size() - std::get<std::string_view>(value).size());
+    }
+}
+
+SheetVersion::SheetVersion(const SheetVersion& base, std::uint64_t number, Size printable_size)
+    : number_(number)
+    , printable_size_(printable_size)
+    , rows_(base.rows_)
+    , own_rows_(rows_.size(), false)
+    {}
+
+std::uint64_t SheetVersion::GetNumber() const {
+    return number_;
+}
+
+Size SheetVersion::GetPrintableSize() const {
+    return printable_size_;
+}
+
+CellInterface::ValueView SheetVersion::GetValue(Position pos) const {
+    const auto* slot = FindSlot(pos);
+    if (!slot) {
+        return std::string_view{};
+    }
+    switch (slot->kind) {
+    case Chunk::Kind::Number:
+        return slot->number;
+    case Chunk::Kind::Error:
+        return FormulaError(slot->error);
+    default:
+        break;
+    }
+    // FindSlot уже нашёл блок
+    const auto& chunk = *(*rows_[pos.row / CHUNK_ROWS])[pos.col / CHUNK_COLS];
+    return GetTextOf(chunk, *slot).substr(slot->value_offset);
+}
+
+std::string_view SheetVersion::GetText(Position pos) const {
+    const auto* slot = FindSlot(pos);
+    if (!slot) {
+        return {};
+    }
+    const auto& chunk = *(*rows_[pos.row / CHUNK_ROWS])[pos.col / CHUNK_COLS];
+    return GetTextOf(chunk, *slot);
+}
+
+void SheetVersion::SetChunk(Position pos, std::shared_ptr<const Chunk> chunk) {
+    const auto chunk_row = static_cast<std::size_t>(pos.row / CHUNK_ROWS);
+    const auto chunk_col = static_cast<std::size_t>(pos.col / CHUNK_COLS);
+    if (rows_.size() <= chunk_row) {
+        if (!chunk) {
+            return;
+        }
+        rows_.resize(chunk_row + 1);
+        own_rows_.resize(chunk_row + 1, false);
+    }
+
+    // строка прежней версии копируется при первом изменении
+    auto& row = rows_[chunk_row];
+    if (!own_rows_[chunk_row]) {
+        row = row ? std::make_shared<ChunkRow>(*row) : std::make_shared<ChunkRow>();
+        own_rows_[chunk_row] = true;
+    }
+    auto& chunks = *row;
+    if (chunks.size() <= chunk_col) {
+        if (!chunk) {
+            return;
+        }
+        chunks.resize(chunk_col + 1);
+    }
+    chunks[chunk_col] = std::move(chunk);
+}
+
+const SheetVersion::Chunk::Slot* SheetVersion::FindSlot(Position pos) const {
+    const auto chunk_row = static_cast<std::size_t>(pos.row / CHUNK_ROWS);
+    const auto chunk_col = static_cast<std::size_t>(pos.col / CHUNK_COLS);
+    if (chunk_row >= rows_.size() || !rows_[chunk_row]) {
+        return nullptr;
+    }
+    const auto& chunks = *rows_[chunk_row];
+    if (chunk_col >= chunks.size() || !chunks[chunk_col]) {
+        return nullptr;
+    }
+    const auto& slot = chunks[chunk_col]->slots_[SlotIndex(pos)];
+    return slot.kind == Chunk::Kind::Empty ? nullptr : &slot;
+}
+
+std::string_view SheetVersion::GetTextOf(const Chunk& chunk, const Chunk::Slot& slot) const {
+    return std::string_view(chunk.texts_).substr(slot.text_begin, slot.text_size);
+}
+
+// ------------ SheetVersions::ReadGuard --------------
+SheetVersions::ReadGuard::ReadGuard(std::atomic<std::uint64_t>* slot, const SheetVersion* version)
+    : slot_(slot)
+    , version_(version)
+    {}
+
+SheetVersions::ReadGuard::ReadGuard(ReadGuard&& other)
+    : slot_(std::exchange(other.slot_, nullptr))
+    , version_(other.version_)
+    {}
+
+SheetVersions::ReadGuard::~ReadGuard() {
+    if (slot_) {
+        slot_->store(0);
+    }
+}
+
+// ------------ SheetVersions --------------
+SheetVersions::SheetVersions()
+    : current_(new SheetVersion())
+    {}
+
+SheetVersions::~SheetVersions() {
+    delete current_.load();
+}
+
+SheetVersions::ReadGuard SheetVersions::Read() const {
+    // поток начинает поиск со своей ячейки, чтобы читатели не сталкивались
+    const auto start = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    for (std::size_t attempt = 0;; ++attempt) {
+        auto& slot = readers_[(start + attempt) % MAX_READERS].epoch;
+        std::uint64_t expected = 0;
+        // все операции последовательно согласованы: если читатель застал
+        // снимаемую версию, писатель увидит его эпоху при освобождении
+        if (slot.load(std::memory_order_relaxed) == 0
+                && slot.compare_exchange_strong(expected, epoch_.load())) {
+            return ReadGuard(&slot, current_.load());
+        }
+        if (attempt % MAX_READERS == MAX_READERS - 1) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+const SheetVersion& SheetVersions::GetCurrent() const {
+    return *current_.load(std::memory_order_relaxed);
+}
+
+void SheetVersions::Publish(std::unique_ptr<SheetVersion> version) {
+    const SheetVersion* previous = current_.exchange(version.release());
+    // читатели, объявившие эпоху не позже этой, могли застать previous
+    const auto epoch = epoch_.fetch_add(1);
+    retired_.emplace_back(epoch, previous);
+    Reclaim();
+}
+
+void SheetVersions::Reclaim() {
+    auto oldest = std::numeric_limits<std::uint64_t>::max();
+    for (const auto& reader : readers_) {
+        if (const auto epoch = reader.epoch.load(); epoch != 0) {
+            oldest = std::min(oldest, epoch);
+        }
+    }
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(), [oldest](const auto& retired) {
+        return retired.first < oldest;
+    }), retired_.end());
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+
+
+// Неизменяемая версия содержимого таблицы: тексты и вычисленные значения
+// ячеек на момент публикации (Sheet::Publish). Версия разбита на те же
+// блоки, что и хранилище ячеек; блоки и строки блоков, не изменившиеся
+// между публикациями, у версий общие. Читается из любых потоков.
+class SheetVersion {
+public:
+    static constexpr int CHUNK_ROWS = 16;
+    static constexpr int CHUNK_COLS = 16;
+
+    // Содержимое одного блока. Собирается писателем до публикации.
+    class Chunk {
+    public:
+        void Set(Position pos, std::string_view text, const CellInterface::ValueView& value);
+
+    private:
+        friend class SheetVersion;
+
+        enum class Kind : std::uint8_t {
+            Empty,
+            Text,
+            Number,
+            Error,
+        };
+
+        struct Slot {
+            std::uint32_t text_begin = 0;
+            std::uint32_t text_size = 0;
+            // значение текста - его запись с этого смещения
+            std::uint32_t value_offset = 0;
+            Kind kind = Kind::Empty;
+            FormulaError::Category error = FormulaError::Category::Value;
+            double number = 0.;
+        };
+
+        std::array<Slot, CHUNK_ROWS * CHUNK_COLS> slots_{};
+        // тексты всех ячеек блока подряд
+        std::string texts_;
+    };
+
+    SheetVersion() = default;
+    // Новая версия number, разделяющая все блоки с base.
+    SheetVersion(const SheetVersion& base, std::uint64_t number, Size printable_size);
+
+    std::uint64_t GetNumber() const;
+    Size GetPrintableSize() const;
+
+    // Значение и текст ячейки; у пустой ячейки - пустая строка. Строки
+    // действительны, пока жива версия.
+    CellInterface::ValueView GetValue(Position pos) const;
+    std::string_view GetText(Position pos) const;
+
+    // Заменяет блок, содержащий pos; пустой chunk удаляет блок. Вызывается
+    // только до публикации версии.
+    void SetChunk(Position pos, std::shared_ptr<const Chunk> chunk);
+
+private:
+    using ChunkRow = std::vector<std::shared_ptr<const Chunk>>;
+
+    std::uint64_t number_ = 0;
+    Size printable_size_;
+    // строки опубликованных версий больше не меняются
+    std::vector<std::shared_ptr<ChunkRow>> rows_;
+    // строки, уже скопированные для этой версии
+    std::vector<bool> own_rows_;
+
+private:
+    const Chunk::Slot* FindSlot(Position pos) const;
+    std::string_view GetTextOf(const Chunk& chunk, const Chunk::Slot& slot) const;
+};
+
+// Опубликованные версии таблицы. Писатель (единственный) подменяет текущую
+// версию атомарно, а читатели берут её без блокировок: читатель объявляет
+// эпоху в свободной ячейке таблицы читателей, и версия, снятая с публикации,
+// освобождается только после того, как все читатели, объявившие эпоху не
+// позже её снятия, закончат чтение.
+class SheetVersions {
+public:
+    // одновременно читающих потоков; остальные ждут освобождения ячейки
+    static constexpr std::size_t MAX_READERS = 64;
+
+    // Доступ к версии: пока жив объект, версия не освобождается.
+    class ReadGuard {
+    public:
+        ReadGuard(ReadGuard&& other);
+        ReadGuard& operator=(ReadGuard&&) = delete;
+        ~ReadGuard();
+
+        const SheetVersion& operator*() const {
+            return *version_;
+        }
+        const SheetVersion* operator->() const {
+            return version_;
+        }
+
+    private:
+        friend class SheetVersions;
+
+        ReadGuard(std::atomic<std::uint64_t>* slot, const SheetVersion* version);
+
+        std::atomic<std::uint64_t>* slot_;
+        const SheetVersion* version_;
+    };
+
+    SheetVersions();
+    SheetVersions(const SheetVersions&) = delete;
+    SheetVersions& operator=(const SheetVersions&) = delete;
+    // К этому моменту читателей быть не должно.
+    ~SheetVersions();
+
+    // Текущая версия; можно вызывать из любого потока.
+    ReadGuard Read() const;
+
+    // Для писателя: текущая версия без защиты и публикация следующей.
+    // Снятые версии освобождаются, как только их никто не читает.
+    const SheetVersion& GetCurrent() const;
+    void Publish(std::unique_ptr<SheetVersion> version);
+
+private:
+    struct alignas(64) ReaderSlot {
+        // эпоха, объявленная читателем; 0 - ячейка свободна
+        std::atomic<std::uint64_t> epoch{0};
+    };
+
+    std::atomic<const SheetVersion*> current_;
+    std::atomic<std::uint64_t> epoch_{1};
+    mutable std::array<ReaderSlot, MAX_READERS> readers_;
+    // снятые с публикации версии и эпохи, в которые их сняли
+    std::vector<std::pair<std::uint64_t, std::unique_ptr<const SheetVersion>>> retired_;
+
+private:
+    void Reclaim();
+};
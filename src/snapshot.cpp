@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <system_error>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+
+
+using namespace std::literals;
+
+namespace {
+constexpr char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+constexpr std::uint32_t VERSION = 2;
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t formula_count;
+    std::uint32_t cell_count;
+    std::uint64_t data_size;
+    // CRC-32 заголовка (с нулём в этом поле) и всех разделов
+    std::uint32_t checksum;
+    std::uint32_t reserved;
+};
+
+// Таблицы программы лежат в данных подряд, начиная с data_offset: числа,
+// инструкции (код и операнд), ячейки, агрегатные функции (функция, число
+// скалярных аргументов, первый диапазон, число диапазонов), диапазоны и
+// текст выражения. Позиции указаны относительно anchor.
+struct FormulaRecord {
+    std::int32_t anchor_row;
+    std::int32_t anchor_col;
+    std::uint32_t stack_depth;
+    std::uint32_t code_size;
+    std::uint32_t number_count;
+    std::uint32_t cell_count;
+    std::uint32_t aggregate_count;
+    std::uint32_t range_count;
+    std::uint32_t expression_size;
+    std::uint32_t reserved;
+    std::uint64_t data_offset;
+};
+
+enum class CellKind : std::uint8_t {
+    Text = 1,
+    Formula = 2,
+};
+
+enum class CasheKind : std::uint8_t {
+    Empty,
+    Value,
+    Error,
+};
+
+struct CellRecord {
+    std::int32_t row;
+    std::int32_t col;
+    CellKind kind;
+    CasheKind cashe_kind;
+    std::uint8_t cashe_error;
+    std::uint8_t reserved;
+    // номер формулы или длина текста
+    std::uint32_t formula_or_size;
+    double cashe_value;
+    std::uint64_t text_offset;
+};
+
+constexpr std::size_t ALIGNMENT = 8;
+
+static_assert(std::is_trivially_copyable_v<Header> && sizeof(Header) % ALIGNMENT == 0);
+static_assert(std::is_trivially_copyable_v<FormulaRecord> && sizeof(FormulaRecord) % ALIGNMENT == 0);
+static_assert(std::is_trivially_copyable_v<CellRecord> && sizeof(CellRecord) % ALIGNMENT == 0);
+static_assert(sizeof(Position) == 8 && sizeof(CellRange) == 16);
+
+template <typename T>
+void Append(std::vector<char>& out, const T* items, std::size_t count) {
+    const auto* bytes = reinterpret_cast<const char*>(items);
+    out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+template <typename T>
+T ReadAt(std::string_view data, std::size_t offset) {
+    T value;
+    std::memcpy(&value, data.data() + offset, sizeof(T));
+    return value;
+}
+
+// Копирует count элементов из данных начиная с offset и сдвигает offset.
+template <typename T>
+std::vector<T> ReadArray(std::string_view data, std::size_t& offset, std::size_t count) {
+    std::vector<T> items(count);
+    if (count) {
+        std::memcpy(items.data(), data.data() + offset, count * sizeof(T));
+    }
+    offset += count * sizeof(T);
+    return items;
+}
+
+// Проверяет, что [offset, offset + size) лежит внутри данных.
+void CheckBounds(std::string_view data, std::uint64_t offset, std::uint64_t size) {
+    if (offset > data.size() || size > data.size() - offset) {
+        throw SnapshotException("Snapshot: record points outside the data"s);
+    }
+}
+}  // namespace
+
+// ------------ SnapshotWriter --------------
+std::uint32_t SnapshotWriter::AddFormula(const RelativeFormula& formula) {
+    const auto& program = formula.GetAST().GetProgram();
+    const auto anchor = formula.GetAnchor();
+    const auto expression = formula.GetExpression(anchor);
+
+    data_.resize((data_.size() + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+    const FormulaRecord record{
+        anchor.row, anchor.col,
+        static_cast<std::uint32_t>(program.stack_depth),
+        static_cast<std::uint32_t>(program.code.size()),
+        static_cast<std::uint32_t>(program.numbers.size()),
+        static_cast<std::uint32_t>(program.cells.size()),
+        static_cast<std::uint32_t>(program.aggregates.size()),
+        static_cast<std::uint32_t>(program.ranges.size()),
+        static_cast<std::uint32_t>(expression.size()),
+        0,
+        data_.size()};
+    Append(formulas_, &record, 1);
+
+    Append(data_, program.numbers.data(), program.numbers.size());
+    for (const auto& instruction : program.code) {
+        const std::uint32_t packed[] = {static_cast<std::uint32_t>(instruction.op),
+                                        instruction.operand};
+        Append(data_, packed, std::size(packed));
+    }
+    Append(data_, program.cells.data(), program.cells.size());
+    for (const auto& aggregate : program.aggregates) {
+        const std::uint32_t packed[] = {static_cast<std::uint32_t>(aggregate.function),
+                                        aggregate.scalar_count, aggregate.first_range,
+                                        aggregate.range_count};
+        Append(data_, packed, std::size(packed));
+    }
+    Append(data_, program.ranges.data(), program.ranges.size());
+    Append(data_, expression.data(), expression.size());
+
+    return formula_count_++;
+}
+
+void SnapshotWriter::AddText(Position pos, std::string_view text) {
+    const CellRecord record{pos.row, pos.col, CellKind::Text, CasheKind::Empty, 0, 0,
+                            static_cast<std::uint32_t>(text.size()), 0., data_.size()};
+    Append(cells_, &record, 1);
+    Append(data_, text.data(), text.size());
+    ++cell_count_;
+}
+
+void SnapshotWriter::AddFormulaCell(Position pos, std::uint32_t formula,
+                                    const std::optional<FormulaInterface::Value>& cashe) {
+    CellRecord record{pos.row, pos.col, CellKind::Formula, CasheKind::Empty, 0, 0,
+                      formula, 0., 0};
+    if (cashe && std::holds_alternative<double>(*cashe)) {
+        record.cashe_kind = CasheKind::Value;
+        record.cashe_value = std::get<double>(*cashe);
+    } else if (cashe) {
+        record.cashe_kind = CasheKind::Error;
+        record.cashe_error = static_cast<std::uint8_t>(std::get<FormulaError>(*cashe).GetCategory());
+    }
+    Append(cells_, &record, 1);
+    ++cell_count_;
+}
+
+void SnapshotWriter::Write(OutputSink& sink) const {
+    Header header{{}, VERSION, BYTE_ORDER_MARK, formula_count_, cell_count_, data_.size(), 0, 0};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    std::uint32_t checksum = Crc32({reinterpret_cast<const char*>(&header), sizeof(header)});
+    checksum = Crc32({formulas_.data(), formulas_.size()}, checksum);
+    checksum = Crc32({cells_.data(), cells_.size()}, checksum);
+    header.checksum = Crc32({data_.data(), data_.size()}, checksum);
+    sink.Write(reinterpret_cast<const char*>(&header), sizeof(header));
+    sink.Write(formulas_.data(), formulas_.size());
+    sink.Write(cells_.data(), cells_.size());
+    sink.Write(data_.data(), data_.size());
+}
+
+// ------------ SnapshotReader --------------
+SnapshotReader::SnapshotReader(std::string_view data) {
+    if (data.size() < sizeof(Header)) {
+        throw SnapshotException("Snapshot: file is too short"s);
+    }
+    const auto header = ReadAt<Header>(data, 0);
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw SnapshotException("Snapshot: bad signature"s);
+    }
+    if (header.byte_order != BYTE_ORDER_MARK) {
+        throw SnapshotException("Snapshot: foreign byte order"s);
+    }
+    if (header.version != VERSION) {
+        throw SnapshotException("Snapshot: unsupported version "s + std::to_string(header.version));
+    }
+
+    // счётчики 32-битные, поэтому сумма размеров не переполняется
+    const std::uint64_t formulas_size = std::uint64_t{header.formula_count} * sizeof(FormulaRecord);
+    const std::uint64_t cells_size = std::uint64_t{header.cell_count} * sizeof(CellRecord);
+    if (header.data_size > data.size()
+            || sizeof(Header) + formulas_size + cells_size + header.data_size != data.size()) {
+        throw SnapshotException("Snapshot: file size does not match the header"s);
+    }
+    // программа формулы сверяется с текстом выражения только по ссылкам,
+    // остальные искажения ловит контрольная сумма
+    auto unsigned_header = header;
+    unsigned_header.checksum = 0;
+    const auto checksum = Crc32({reinterpret_cast<const char*>(&unsigned_header), sizeof(unsigned_header)});
+    if (Crc32(data.substr(sizeof(Header)), checksum) != header.checksum) {
+        throw SnapshotException("Snapshot: checksum mismatch"s);
+    }
+    formulas_ = data.substr(sizeof(Header), formulas_size);
+    cells_ = data.substr(sizeof(Header) + formulas_size, cells_size);
+    data_ = data.substr(sizeof(Header) + formulas_size + cells_size);
+    formula_count_ = header.formula_count;
+    cell_count_ = header.cell_count;
+}
+
+std::size_t SnapshotReader::GetFormulaCount() const {
+    return formula_count_;
+}
+
+std::unique_ptr<RelativeFormula> SnapshotReader::ReadFormula(std::size_t index) const {
+    using ASTImpl::Aggregate;
+    using ASTImpl::Function;
+    using ASTImpl::Instruction;
+    using ASTImpl::OpCode;
+
+    const auto record = ReadAt<FormulaRecord>(formulas_, index * sizeof(FormulaRecord));
+    const Position anchor{record.anchor_row, record.anchor_col};
+    if (!anchor.IsValid()) {
+        throw SnapshotException("Snapshot: formula anchor out of the table"s);
+    }
+    CheckBounds(data_, record.data_offset,
+                (std::uint64_t{record.number_count} + record.code_size + record.cell_count) * 8
+                    + (std::uint64_t{record.aggregate_count} + record.range_count) * 16
+                    + record.expression_size);
+
+    ASTImpl::Program program;
+    std::size_t offset = record.data_offset;
+    program.stack_depth = record.stack_depth;
+    program.numbers = ReadArray<double>(data_, offset, record.number_count);
+    program.code.reserve(record.code_size);
+    for (const auto& [op, operand] : ReadArray<std::array<std::uint32_t, 2>>(data_, offset, record.code_size)) {
+        // неизвестные коды отвергает FormulaAST, но в OpCode они должны поместиться
+        if (op > std::numeric_limits<std::underlying_type_t<OpCode>>::max()) {
+            throw SnapshotException("Snapshot: bad instruction"s);
+        }
+        program.code.push_back(Instruction{static_cast<OpCode>(op), operand});
+    }
+    program.cells = ReadArray<Position>(data_, offset, record.cell_count);
+    program.aggregates.reserve(record.aggregate_count);
+    for (const auto& packed : ReadArray<std::array<std::uint32_t, 4>>(data_, offset, record.aggregate_count)) {
+        if (packed[0] > std::numeric_limits<std::underlying_type_t<Function>>::max()) {
+            throw SnapshotException("Snapshot: bad function"s);
+        }
+        program.aggregates.push_back(
+            Aggregate{static_cast<Function>(packed[0]), packed[1], packed[2], packed[3]});
+    }
+    program.ranges = ReadArray<CellRange>(data_, offset, record.range_count);
+    for (const auto& range : program.ranges) {
+        if (range.to.row < range.from.row || range.to.col < range.from.col) {
+            throw SnapshotException("Snapshot: bad range"s);
+        }
+    }
+    std::string expression(data_.substr(offset, record.expression_size));
+
+    std::unique_ptr<RelativeFormula> formula;
+    try {
+        formula = std::make_unique<RelativeFormula>(FormulaAST(std::move(program)), anchor,
+                                                    std::move(expression));
+    } catch (const ParsingError& e) {
+        throw SnapshotException("Snapshot: "s + e.what());
+    }
+
+    // выражение не разбирается заново, но ссылки в его записи должны быть
+    // теми же, что у программы: по ним ячейке выдаётся текст формулы и
+    // строится ключ общих формул
+    std::vector<Position> written;
+    try {
+        written = ListReferences(formula->GetExpression(anchor));
+    } catch (const FormulaException&) {
+        throw SnapshotException("Snapshot: bad reference in formula expression"s);
+    }
+    const auto& ast = formula->GetAST();
+    std::vector<Position> expected(ast.GetCells().begin(), ast.GetCells().end());
+    for (const auto& range : ast.GetRanges()) {
+        expected.push_back(range.from);
+        expected.push_back(range.to);
+    }
+    for (auto* refs : {&written, &expected}) {
+        std::sort(refs->begin(), refs->end());
+        refs->erase(std::unique(refs->begin(), refs->end()), refs->end());
+    }
+    if (written != expected) {
+        throw SnapshotException("Snapshot: formula expression does not match its program"s);
+    }
+    return formula;
+}
+
+std::size_t SnapshotReader::GetCellCount() const {
+    return cell_count_;
+}
+
+SnapshotReader::Cell SnapshotReader::ReadCell(std::size_t index) const {
+    const auto record = ReadAt<CellRecord>(cells_, index * sizeof(CellRecord));
+    Cell cell;
+    cell.pos = {record.row, record.col};
+    if (!cell.pos.IsValid()) {
+        throw SnapshotException("Snapshot: cell out of the table"s);
+    }
+
+    switch (record.kind) {
+    case CellKind::Text:
+        CheckBounds(data_, record.text_offset, record.formula_or_size);
+        cell.text = data_.substr(record.text_offset, record.formula_or_size);
+        // формула в тексте разбиралась бы заново
+        if (cell.text.empty() || (cell.text.size() > 1u && cell.text[0] == FORMULA_SIGN)) {
+            throw SnapshotException("Snapshot: bad text in cell "s + cell.pos.ToString());
+        }
+        break;
+    case CellKind::Formula:
+        if (record.formula_or_size >= formula_count_) {
+            throw SnapshotException("Snapshot: bad formula in cell "s + cell.pos.ToString());
+        }
+        cell.formula = record.formula_or_size;
+        break;
+    default:
+        throw SnapshotException("Snapshot: bad kind of cell "s + cell.pos.ToString());
+    }
+
+    switch (record.cashe_kind) {
+    case CasheKind::Empty:
+        break;
+    case CasheKind::Value:
+        cell.cashe = record.cashe_value;
+        break;
+    case CasheKind::Error: {
+        const auto category = static_cast<FormulaError::Category>(record.cashe_error);
+        if (category != FormulaError::Category::Ref && category != FormulaError::Category::Value
+                && category != FormulaError::Category::Div0) {
+            throw SnapshotException("Snapshot: bad error in cell "s + cell.pos.ToString());
+        }
+        cell.cashe = FormulaError(category);
+        break;
+    }
+    default:
+        throw SnapshotException("Snapshot: bad value of cell "s + cell.pos.ToString());
+    }
+    if (cell.cashe && cell.formula == NO_FORMULA) {
+        throw SnapshotException("Snapshot: value of text cell "s + cell.pos.ToString());
+    }
+    return cell;
+}
+
+// ------------ MappedFile --------------
+MappedFile::MappedFile(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "fstat " + path);
+    }
+    size_ = static_cast<std::size_t>(info.st_size);
+    // пустой файл не отображается; его отвергнет проверка заголовка
+    if (size_) {
+        data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data_ == MAP_FAILED) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "mmap " + path);
+        }
+        // снимок читается одним проходом от начала к концу
+        ::madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+    // отображение не зависит от дескриптора
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (size_) {
+        ::munmap(data_, size_);
+    }
+}
+
+std::string_view MappedFile::GetData() const {
+    return {static_cast<const char*>(data_), size_};
+}
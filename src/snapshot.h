@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+#include "formula.h"
+#include "output.h"
+
+// Снимок таблицы - двоичный файл, который загружается без разбора формул:
+//   заголовок (сигнатура, версия, метка порядка байтов, число формул и ячеек,
+//   CRC-32 заголовка и разделов)
+//   записи формул фиксированного размера
+//   записи ячеек фиксированного размера
+//   данные: таблицы скомпилированных программ формул и тексты
+// Все числа записаны в порядке байтов машины, сохранившей снимок; снимок с
+// другим порядком байтов не загружается. Разделы и таблицы выровнены на
+// 8 байтов, поэтому файл можно читать прямо из отображения в память.
+
+// Исключение, выбрасываемое при загрузке повреждённого или несовместимого
+// снимка
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Собирает снимок в памяти и выгружает его одним проходом.
+class SnapshotWriter {
+public:
+    // Добавляет формулу и возвращает её номер в снимке.
+    std::uint32_t AddFormula(const RelativeFormula& formula);
+    void AddText(Position pos, std::string_view text);
+    // Ячейка с формулой номер formula; cashe - её вычисленное значение,
+    // если оно есть.
+    void AddFormulaCell(Position pos, std::uint32_t formula,
+                        const std::optional<FormulaInterface::Value>& cashe);
+
+    void Write(OutputSink& sink) const;
+
+private:
+    // записи в том виде, в каком они лежат в файле
+    std::vector<char> formulas_;
+    std::vector<char> cells_;
+    std::vector<char> data_;
+    std::uint32_t formula_count_ = 0;
+    std::uint32_t cell_count_ = 0;
+};
+
+// Читает снимок, лежащий в памяти. Конструктор проверяет заголовок, размеры
+// разделов и контрольную сумму, остальное проверяется при чтении записей.
+// При любой несогласованности бросается SnapshotException.
+class SnapshotReader {
+public:
+    static constexpr std::uint32_t NO_FORMULA = UINT32_MAX;
+
+    struct Cell {
+        Position pos;
+        // текст текстовой ячейки; действителен, пока жив буфер снимка
+        std::string_view text;
+        // номер формулы или NO_FORMULA у текста
+        std::uint32_t formula = NO_FORMULA;
+        std::optional<FormulaInterface::Value> cashe;
+    };
+
+    explicit SnapshotReader(std::string_view data);
+
+    std::size_t GetFormulaCount() const;
+    // Собирает формулу из её программы, не разбирая выражения: с программой
+    // сверяются только ссылки в записи выражения.
+    std::unique_ptr<RelativeFormula> ReadFormula(std::size_t index) const;
+
+    std::size_t GetCellCount() const;
+    Cell ReadCell(std::size_t index) const;
+
+private:
+    std::string_view formulas_;
+    std::string_view cells_;
+    std::string_view data_;
+    std::size_t formula_count_ = 0;
+    std::size_t cell_count_ = 0;
+};
+
+// Файл, отображённый в память только для чтения. При ошибке открытия или
+// отображения бросает std::system_error.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    std::string_view GetData() const;
+
+private:
+    void* data_ = nullptr;
+    std::size_t size_ = 0;
+};
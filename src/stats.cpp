@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+
+#include "stats.h"
+
+
+
+namespace {
+void WriteInteger(BufferedWriter& out, std::uint64_t value) {
+    char buffer[24];
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.Write({buffer, static_cast<std::size_t>(result.ptr - buffer)});
+}
+
+// Микросекунды с тремя знаками после точки: WriteNumber оставляет шесть
+// значащих цифр, и отметки позже секунды от начала журнала огрублялись бы
+void WriteMicroseconds(BufferedWriter& out, std::chrono::steady_clock::duration duration) {
+    // интервал, открытый до повторного включения журнала, начался раньше него
+    const auto nanoseconds = static_cast<std::uint64_t>(std::max<std::int64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), 0));
+    WriteInteger(out, nanoseconds / 1000);
+    const auto fraction = nanoseconds % 1000;
+    out.Put('.');
+    out.Put(static_cast<char>('0' + fraction / 100));
+    out.Put(static_cast<char>('0' + fraction / 10 % 10));
+    out.Put(static_cast<char>('0' + fraction % 10));
+}
+}  // namespace
+
+// ------------ EvaluationCounters --------------
+EvaluationCounters& EvaluationCounters::operator+=(const EvaluationCounters& other) {
+    evaluations += other.evaluations;
+    cache_hits += other.cache_hits;
+    return *this;
+}
+
+// ------------ EvaluationScope --------------
+EvaluationScope::EvaluationScope(EvaluationCounters& counters)
+    : previous_(current_)
+    {
+        current_ = &counters;
+    }
+
+EvaluationScope::~EvaluationScope() {
+    current_ = previous_;
+}
+
+// ------------ Tracer::Span --------------
+Tracer::Span::Span(Tracer& tracer, const char* name, std::uint64_t value)
+    : tracer_(tracer.enabled_ ? &tracer : nullptr)
+    , name_(name)
+    , value_(value)
+    {
+        if (tracer_) {
+            begin_ = std::chrono::steady_clock::now();
+        }
+    }
+
+Tracer::Span::~Span() {
+    if (!tracer_) {
+        return;
+    }
+    const auto end = std::chrono::steady_clock::now();
+    try {
+        tracer_->events_.push_back({name_, value_, begin_ - tracer_->origin_, end - begin_});
+    } catch (...) {
+        // интервал, на который не хватило памяти, теряется
+    }
+}
+
+void Tracer::Span::SetValue(std::uint64_t value) {
+    value_ = value;
+}
+
+// ------------ Tracer --------------
+void Tracer::Enable(bool enabled) {
+    enabled_ = enabled;
+    if (enabled) {
+        events_.clear();
+        origin_ = std::chrono::steady_clock::now();
+    }
+}
+
+bool Tracer::IsEnabled() const {
+    return enabled_;
+}
+
+void Tracer::Write(OutputSink& sink) const {
+    BufferedWriter out(sink);
+    out.Write("{\"traceEvents\":[");
+    bool first = true;
+    for (const auto& event : events_) {
+        if (!first) {
+            out.Put(',');
+        }
+        first = false;
+        // имена - литералы без символов, требующих экранирования
+        out.Write("\n{\"name\":\"");
+        out.Write(event.name);
+        out.Write("\",\"cat\":\"sheet\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":");
+        WriteMicroseconds(out, event.begin);
+        out.Write(",\"dur\":");
+        WriteMicroseconds(out, event.duration);
+        out.Write(",\"args\":{\"value\":");
+        WriteInteger(out, event.value);
+        out.Write("}}");
+    }
+    out.Write("\n]}\n");
+    out.Flush();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "output.h"
+
+
+
+// Счётчики работы таблицы (Sheet::GetStats). Счётчики только растут, поэтому
+// расход отдельной операции - разность снимков до и после неё.
+struct SheetStats {
+    // разобранные формулы (формула с уже известной относительной записью
+    // не разбирается) и время их разбора
+    std::uint64_t formula_parses = 0;
+    std::uint64_t parse_nanoseconds = 0;
+    // вычисления формул; каждое - промах кеша значения
+    std::uint64_t evaluations = 0;
+    // чтения значения формулы из кеша
+    std::uint64_t cache_hits = 0;
+    // обходы сброса кеша зависимых и формулы, устаревшие в этих обходах
+    std::uint64_t invalidations = 0;
+    std::uint64_t invalidated_cells = 0;
+    // проверки циклов при записи формулы и ячейки, пройденные в них
+    std::uint64_t cycle_checks = 0;
+    std::uint64_t cycle_check_visits = 0;
+    // выделенные сейчас блоки хранилища ячеек и расширения его каталога
+    std::uint64_t storage_chunks = 0;
+    std::uint64_t storage_resizes = 0;
+};
+
+// Счётчики вычислений формул. Формулы вычисляются и в потоках пересчёта,
+// поэтому каждая задача пересчёта считает в собственные счётчики (см.
+// EvaluationScope), которые затем прибавляются к счётчикам таблицы.
+struct alignas(64) EvaluationCounters {
+    std::uint64_t evaluations = 0;
+    std::uint64_t cache_hits = 0;
+
+    EvaluationCounters& operator+=(const EvaluationCounters& other);
+};
+
+// Пока жив объект, вычисления в текущем потоке учитываются в counters.
+class EvaluationScope {
+public:
+    explicit EvaluationScope(EvaluationCounters& counters);
+    EvaluationScope(const EvaluationScope&) = delete;
+    EvaluationScope& operator=(const EvaluationScope&) = delete;
+    ~EvaluationScope();
+
+    // Счётчики, заданные в текущем потоке, а если их нет - fallback.
+    static EvaluationCounters& Current(EvaluationCounters& fallback) {
+        return current_ ? *current_ : fallback;
+    }
+
+private:
+    static inline thread_local EvaluationCounters* current_ = nullptr;
+
+    EvaluationCounters* previous_;
+};
+
+// Журнал интервалов времени в формате Chrome trace events (chrome://tracing,
+// ui.perfetto.dev). Выключен по умолчанию; выключенный интервал стоит одной
+// проверки. Интервалы пишутся из одного потока - того, что правит таблицу.
+class Tracer {
+public:
+    // Интервал от создания объекта до его разрушения. Имя - строковый
+    // литерал; value попадает в аргументы события (число ячеек и т.п.).
+    class Span {
+    public:
+        Span(Tracer& tracer, const char* name, std::uint64_t value = 0);
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+        ~Span();
+
+        void SetValue(std::uint64_t value);
+
+    private:
+        // nullptr, если журнал выключен
+        Tracer* tracer_;
+        const char* name_;
+        std::uint64_t value_;
+        std::chrono::steady_clock::time_point begin_;
+    };
+
+    // Включение начинает журнал заново.
+    void Enable(bool enabled);
+    bool IsEnabled() const;
+
+    // Записывает журнал JSON-объектом {"traceEvents": [...]}; время - в
+    // микросекундах от включения журнала.
+    void Write(OutputSink& sink) const;
+
+private:
+    struct Event {
+        const char* name;
+        std::uint64_t value;
+        std::chrono::steady_clock::duration begin;
+        std::chrono::steady_clock::duration duration;
+    };
+
+    bool enabled_ = false;
+    std::chrono::steady_clock::time_point origin_;
+    std::vector<Event> events_;
+};
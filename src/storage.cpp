@@ -0,0 +1,64 @@
+#include "storage.h"
+
+#include <cassert>
+
+
+
+namespace {
+int HighestBit(std::uint64_t word) {
+    assert(word);
+    int bit = 0;
+    for (int shift = 32; shift > 0; shift /= 2) {
+        if (word >> shift) {
+            word >>= shift;
+            bit += shift;
+        }
+    }
+    return bit;
+}
+
+int LastNonZero(const std::vector<std::uint64_t>& words) {
+    for (int i = static_cast<int>(words.size()) - 1; i >= 0; --i) {
+        if (words[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+}  // namespace
+
+// ------------ OccupancyIndex --------------
+
+void OccupancyIndex::Add(int line) {
+    assert(line >= 0);
+    if (counts_.size() <= static_cast<std::size_t>(line)) {
+        counts_.resize(line + 1);
+        lines_.resize(line / WORD_BITS + 1);
+        words_.resize(line / WORD_BITS / WORD_BITS + 1);
+    }
+    if (counts_[line]++ == 0) {
+        const int word = line / WORD_BITS;
+        lines_[word] |= std::uint64_t{1} << (line % WORD_BITS);
+        words_[word / WORD_BITS] |= std::uint64_t{1} << (word % WORD_BITS);
+    }
+}
+
+void OccupancyIndex::Remove(int line) {
+    assert(static_cast<std::size_t>(line) < counts_.size() && counts_[line] > 0);
+    if (--counts_[line] == 0) {
+        const int word = line / WORD_BITS;
+        lines_[word] &= ~(std::uint64_t{1} << (line % WORD_BITS));
+        if (!lines_[word]) {
+            words_[word / WORD_BITS] &= ~(std::uint64_t{1} << (word % WORD_BITS));
+        }
+    }
+}
+
+int OccupancyIndex::GetExtent() const {
+    const int summary = LastNonZero(words_);
+    if (summary < 0) {
+        return 0;
+    }
+    const int word = summary * WORD_BITS + HighestBit(words_[summary]);
+    return word * WORD_BITS + HighestBit(lines_[word]) + 1;
+}
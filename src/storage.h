@@ -0,0 +1,314 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+
+
+
+// Разреженное хранилище значений, адресуемых позицией ячейки.
+// Таблица разбита на блоки CHUNK_ROWS x CHUNK_COLS, которые выделяются только
+// при первой записи и освобождаются, когда в них не остаётся значений, поэтому
+// расход памяти растёт вместе с числом заполненных ячеек, а не с размером
+// ограничивающего прямоугольника. Внутри блока значения лежат построчно.
+// T должен по умолчанию конструироваться "пустым" и приводиться к bool
+// (например, std::unique_ptr или указатель).
+template <typename T>
+class ChunkedStorage {
+public:
+    static constexpr int CHUNK_ROWS = 16;
+    static constexpr int CHUNK_COLS = 16;
+
+    // Возвращает слот по позиции либо nullptr, если блок ещё не выделен.
+    // Менять "пустоту" слота напрямую нельзя - для этого есть Set и Erase.
+    const T* Find(Position pos) const;
+    T* Find(Position pos);
+
+    // Записывает значение, выделяя блок при необходимости.
+    void Set(Position pos, T value);
+    // Удаляет значение. Опустевший блок освобождается.
+    void Erase(Position pos);
+
+    // Обходит все непустые значения: f(Position, T&).
+    template <typename F>
+    void ForEach(F f);
+    // Обходит непустые значения прямоугольника from:to (включительно)
+    // построчно: f(Position, const T&). Невыделенные блоки пропускаются
+    // целиком, внутри блока строка прямоугольника лежит в памяти подряд.
+    template <typename F>
+    void ForEachInRange(Position from, Position to, F f) const;
+
+    std::size_t GetChunkCount() const;
+    // Сколько раз расширялся каталог блоков.
+    std::size_t GetResizeCount() const;
+
+private:
+    struct Chunk {
+        std::array<T, CHUNK_ROWS * CHUNK_COLS> slots{};
+        int occupied = 0;
+    };
+    using ChunkRow = std::vector<std::unique_ptr<Chunk>>;
+
+    std::vector<ChunkRow> directory_;
+    std::size_t chunk_count_ = 0;
+    std::size_t resize_count_ = 0;
+
+private:
+    const std::unique_ptr<Chunk>* FindChunk(Position pos) const;
+    std::unique_ptr<Chunk>& GetOrCreateChunk(Position pos);
+
+    static int SlotIndex(Position pos);
+};
+
+// Счётчики заполненных ячеек по строкам (или столбцам) таблицы. Занятые
+// линии отмечены в двухуровневой битовой карте, поэтому последнюю занятую
+// линию можно найти за несколько машинных слов, не просматривая ячейки.
+class OccupancyIndex {
+public:
+    void Add(int line);
+    void Remove(int line);
+
+    // Номер последней занятой линии плюс один; 0, если занятых линий нет.
+    int GetExtent() const;
+
+private:
+    static constexpr int WORD_BITS = 64;
+
+    std::vector<int> counts_;
+    // бит на каждую линию
+    std::vector<std::uint64_t> lines_;
+    // бит на каждое непустое слово lines_
+    std::vector<std::uint64_t> words_;
+};
+
+// Индекс прямоугольных диапазонов со связанными значениями (например,
+// формулами, которые ссылаются на диапазон). Таблица разбита на плитки
+// TILE_ROWS x TILE_COLS, и диапазон записывается в каждую задетую плитку:
+// поиск диапазонов, накрывающих позицию, просматривает одну плитку, а сами
+// ячейки диапазона не создаются.
+template <typename T>
+class RangeIndex {
+public:
+    static constexpr int TILE_ROWS = 64;
+    static constexpr int TILE_COLS = 16;
+
+    void Add(CellRange range, T value);
+    // Удаляет запись, ранее добавленную с теми же аргументами.
+    void Remove(CellRange range, const T& value);
+
+    // Вызывает f(const T&) для каждого диапазона, содержащего pos.
+    template <typename F>
+    void ForEachCovering(Position pos, F f) const;
+
+private:
+    struct Entry {
+        CellRange range;
+        T value;
+    };
+    using Tile = std::vector<Entry>;
+
+    std::vector<std::vector<Tile>> tiles_;
+};
+
+template <typename T>
+const T* ChunkedStorage<T>::Find(Position pos) const {
+    const auto* chunk = FindChunk(pos);
+    if (!chunk || !*chunk) {
+        return nullptr;
+    }
+    return &(*chunk)->slots[SlotIndex(pos)];
+}
+
+template <typename T>
+T* ChunkedStorage<T>::Find(Position pos) {
+    return const_cast<T*>(static_cast<const ChunkedStorage&>(*this).Find(pos));
+}
+
+template <typename T>
+void ChunkedStorage<T>::Set(Position pos, T value) {
+    if (!value) {
+        Erase(pos);
+        return;
+    }
+    auto& chunk = GetOrCreateChunk(pos);
+    auto& slot = chunk->slots[SlotIndex(pos)];
+    if (!slot) {
+        ++chunk->occupied;
+    }
+    slot = std::move(value);
+}
+
+template <typename T>
+void ChunkedStorage<T>::Erase(Position pos) {
+    auto* chunk = const_cast<std::unique_ptr<Chunk>*>(FindChunk(pos));
+    if (!chunk || !*chunk) {
+        return;
+    }
+    auto& slot = (*chunk)->slots[SlotIndex(pos)];
+    if (!slot) {
+        return;
+    }
+    slot = T{};
+    if (--(*chunk)->occupied == 0) {
+        chunk->reset();
+        --chunk_count_;
+    }
+}
+
+template <typename T>
+template <typename F>
+void ChunkedStorage<T>::ForEach(F f) {
+    for (std::size_t chunk_row = 0; chunk_row < directory_.size(); ++chunk_row) {
+        for (std::size_t chunk_col = 0; chunk_col < directory_[chunk_row].size(); ++chunk_col) {
+            const auto& chunk = directory_[chunk_row][chunk_col];
+            if (!chunk) {
+                continue;
+            }
+            for (int i = 0; i < CHUNK_ROWS * CHUNK_COLS; ++i) {
+                if (auto& slot = chunk->slots[i]) {
+                    const Position pos{static_cast<int>(chunk_row) * CHUNK_ROWS + i / CHUNK_COLS,
+                                       static_cast<int>(chunk_col) * CHUNK_COLS + i % CHUNK_COLS};
+                    f(pos, slot);
+                }
+            }
+        }
+    }
+}
+
+template <typename T>
+template <typename F>
+void ChunkedStorage<T>::ForEachInRange(Position from, Position to, F f) const {
+    const auto last_chunk_row = static_cast<std::size_t>(to.row / CHUNK_ROWS);
+    for (auto chunk_row = static_cast<std::size_t>(from.row / CHUNK_ROWS);
+            chunk_row <= last_chunk_row && chunk_row < directory_.size(); ++chunk_row) {
+        const auto& chunks = directory_[chunk_row];
+        const auto first_chunk_col = static_cast<std::size_t>(from.col / CHUNK_COLS);
+        const auto last_chunk_col = std::min(static_cast<std::size_t>(to.col / CHUNK_COLS) + 1,
+                                             chunks.size());
+        const int row_begin = std::max(from.row, static_cast<int>(chunk_row) * CHUNK_ROWS);
+        const int row_end = std::min(to.row + 1, static_cast<int>(chunk_row + 1) * CHUNK_ROWS);
+        // строки обходятся снаружи, чтобы сохранить построчный порядок
+        for (int row = row_begin; row < row_end; ++row) {
+            for (auto chunk_col = first_chunk_col; chunk_col < last_chunk_col; ++chunk_col) {
+                const auto& chunk = chunks[chunk_col];
+                if (!chunk) {
+                    continue;
+                }
+                const int col_begin = std::max(from.col, static_cast<int>(chunk_col) * CHUNK_COLS);
+                const int col_end = std::min(to.col + 1, static_cast<int>(chunk_col + 1) * CHUNK_COLS);
+                const T* slots = &chunk->slots[SlotIndex({row, col_begin})];
+                for (int col = col_begin; col < col_end; ++col, ++slots) {
+                    if (*slots) {
+                        f(Position{row, col}, *slots);
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <typename T>
+std::size_t ChunkedStorage<T>::GetChunkCount() const {
+    return chunk_count_;
+}
+
+template <typename T>
+std::size_t ChunkedStorage<T>::GetResizeCount() const {
+    return resize_count_;
+}
+
+template <typename T>
+auto ChunkedStorage<T>::FindChunk(Position pos) const -> const std::unique_ptr<Chunk>* {
+    const auto chunk_row = static_cast<std::size_t>(pos.row / CHUNK_ROWS);
+    const auto chunk_col = static_cast<std::size_t>(pos.col / CHUNK_COLS);
+    if (chunk_row >= directory_.size() || chunk_col >= directory_[chunk_row].size()) {
+        return nullptr;
+    }
+    return &directory_[chunk_row][chunk_col];
+}
+
+template <typename T>
+auto ChunkedStorage<T>::GetOrCreateChunk(Position pos) -> std::unique_ptr<Chunk>& {
+    const auto chunk_row = static_cast<std::size_t>(pos.row / CHUNK_ROWS);
+    const auto chunk_col = static_cast<std::size_t>(pos.col / CHUNK_COLS);
+    if (directory_.size() <= chunk_row) {
+        directory_.resize(chunk_row + 1);
+        ++resize_count_;
+    }
+    auto& row = directory_[chunk_row];
+    if (row.size() <= chunk_col) {
+        row.resize(chunk_col + 1);
+        ++resize_count_;
+    }
+    auto& chunk = row[chunk_col];
+    if (!chunk) {
+        chunk = std::make_unique<Chunk>();
+        ++chunk_count_;
+    }
+    return chunk;
+}
+
+template <typename T>
+int ChunkedStorage<T>::SlotIndex(Position pos) {
+    return (pos.row % CHUNK_ROWS) * CHUNK_COLS + pos.col % CHUNK_COLS;
+}
+
+template <typename T>
+void RangeIndex<T>::Add(CellRange range, T value) {
+    const auto last_tile_row = static_cast<std::size_t>(range.to.row / TILE_ROWS);
+    const auto last_tile_col = static_cast<std::size_t>(range.to.col / TILE_COLS);
+    if (tiles_.size() <= last_tile_row) {
+        tiles_.resize(last_tile_row + 1);
+    }
+    for (auto tile_row = static_cast<std::size_t>(range.from.row / TILE_ROWS);
+            tile_row <= last_tile_row; ++tile_row) {
+        auto& row = tiles_[tile_row];
+        if (row.size() <= last_tile_col) {
+            row.resize(last_tile_col + 1);
+        }
+        for (auto tile_col = static_cast<std::size_t>(range.from.col / TILE_COLS);
+                tile_col <= last_tile_col; ++tile_col) {
+            row[tile_col].push_back({range, value});
+        }
+    }
+}
+
+template <typename T>
+void RangeIndex<T>::Remove(CellRange range, const T& value) {
+    const auto last_tile_row = static_cast<std::size_t>(range.to.row / TILE_ROWS);
+    const auto last_tile_col = static_cast<std::size_t>(range.to.col / TILE_COLS);
+    for (auto tile_row = static_cast<std::size_t>(range.from.row / TILE_ROWS);
+            tile_row <= last_tile_row; ++tile_row) {
+        for (auto tile_col = static_cast<std::size_t>(range.from.col / TILE_COLS);
+                tile_col <= last_tile_col; ++tile_col) {
+            auto& tile = tiles_[tile_row][tile_col];
+            const auto it = std::find_if(tile.begin(), tile.end(), [&](const Entry& entry) {
+                return entry.range == range && entry.value == value;
+            });
+            assert(it != tile.end());
+            *it = std::move(tile.back());
+            tile.pop_back();
+        }
+    }
+}
+
+template <typename T>
+template <typename F>
+void RangeIndex<T>::ForEachCovering(Position pos, F f) const {
+    const auto tile_row = static_cast<std::size_t>(pos.row / TILE_ROWS);
+    const auto tile_col = static_cast<std::size_t>(pos.col / TILE_COLS);
+    if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size()) {
+        return;
+    }
+    for (const auto& entry : tiles_[tile_row][tile_col]) {
+        if (entry.range.Contains(pos)) {
+            f(entry.value);
+        }
+    }
+}
@@ -1,13 +1,13 @@
-#include <cctype>
-#include <sstream>
 #include <algorithm>
+#include <charconv>
+#include <iterator>
+#include <tuple>
 
 #include "common.h"
 
 
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = {-1, -1};
@@ -25,26 +25,36 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
+}
+
+char* Position::ToChars(char* buffer) const {
     if (!IsValid()) {
-        return "";
+        return buffer;
     }
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
+    // граница буфера вызывающего: после букв строке остаётся только его
+    // хвост
+    char* const end = buffer + MAX_STRING_LENGTH;
+
+    // буквы столбца получаются с конца, поэтому сначала пишутся во
+    // временный буфер
+    char letters[MAX_POS_LETTER_COUNT];
+    char* letters_begin = std::end(letters);
     int c = col;
     while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
+        *--letters_begin = static_cast<char>('A' + c % LETTERS);
         c = c / LETTERS - 1;
     }
+    buffer = std::copy(letters_begin, std::end(letters), buffer);
 
-    result += std::to_string(row + 1);
-
-    return result;
+    return std::to_chars(buffer, end, row + 1).ptr;
 }
 
 Position Position::FromString(std::string_view str) {
     auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
+        return c < 'A' || c > 'Z';
     });
     auto letters = str.substr(0, it - str.begin());
     auto digits = str.substr(it - str.begin());
@@ -56,13 +66,13 @@ Position Position::FromString(std::string_view str) {
         return Position::NONE;
     }
 
-    if (!std::isdigit(digits[0])) {
+    if (digits[0] < '0' || digits[0] > '9') {
         return Position::NONE;
     }
 
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    const auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (error != std::errc{} || end != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
@@ -75,6 +85,23 @@ Position Position::FromString(std::string_view str) {
     return {row - 1, col - 1};
 }
 
+bool CellRange::operator==(CellRange rhs) const {
+    return from == rhs.from && to == rhs.to;
+}
+
+bool CellRange::operator<(CellRange rhs) const {
+    return std::tie(from, to) < std::tie(rhs.from, rhs.to);
+}
+
+bool CellRange::Contains(Position pos) const {
+    return from.row <= pos.row && pos.row <= to.row
+        && from.col <= pos.col && pos.col <= to.col;
+}
+
+std::string CellRange::ToString() const {
+    return from.ToString() + ':' + to.ToString();
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
@@ -0,0 +1,99 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+
+
+ThreadPool::ThreadPool(std::size_t thread_count) {
+    const auto workers = std::max<std::size_t>(thread_count, 1) - 1;
+    workers_.reserve(workers);
+    for (std::size_t i = 0; i < workers; ++i) {
+        workers_.emplace_back([this] {
+            WorkerLoop();
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    start_cv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+std::size_t ThreadPool::GetThreadCount() const {
+    return workers_.size() + 1;
+}
+
+void ThreadPool::ParallelFor(std::size_t count, const std::function<void(std::size_t)>& body) {
+    if (workers_.empty() || count <= 1) {
+        for (std::size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        body_ = &body;
+        count_ = count;
+        next_index_.store(0, std::memory_order_relaxed);
+        error_ = nullptr;
+        active_workers_ = workers_.size();
+        ++generation_;
+    }
+    start_cv_.notify_all();
+
+    RunTasks();
+
+    std::unique_lock lock(mutex_);
+    done_cv_.wait(lock, [this] {
+        return active_workers_ == 0;
+    });
+    body_ = nullptr;
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::WorkerLoop() {
+    std::size_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            start_cv_.wait(lock, [this, seen_generation] {
+                return stop_ || generation_ != seen_generation;
+            });
+            if (stop_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+
+        RunTasks();
+
+        std::lock_guard lock(mutex_);
+        if (--active_workers_ == 0) {
+            done_cv_.notify_one();
+        }
+    }
+}
+
+void ThreadPool::RunTasks() {
+    for (std::size_t i = next_index_.fetch_add(1, std::memory_order_relaxed); i < count_;
+            i = next_index_.fetch_add(1, std::memory_order_relaxed)) {
+        try {
+            (*body_)(i);
+        } catch (...) {
+            std::lock_guard lock(mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+    }
+}
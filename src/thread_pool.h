@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+
+// Пул потоков фиксированного размера для параллельных циклов. Вызывающий
+// поток тоже участвует в работе, поэтому пул на N потоков создаёт N-1
+// рабочих. Задачи раздаются через атомарный счётчик: освободившийся поток
+// сам берёт следующий индекс, и неравные по стоимости задачи выравниваются.
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    std::size_t GetThreadCount() const;
+
+    // Вызывает body(i) для каждого i из [0, count) и ждёт завершения всех
+    // вызовов. Первое выброшенное исключение пробрасывается вызывающему.
+    void ParallelFor(std::size_t count, const std::function<void(std::size_t)>& body);
+
+private:
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    std::size_t generation_ = 0;
+    std::size_t active_workers_ = 0;
+    bool stop_ = false;
+
+    const std::function<void(std::size_t)>* body_ = nullptr;
+    std::size_t count_ = 0;
+    std::atomic<std::size_t> next_index_{0};
+    std::exception_ptr error_;
+
+private:
+    void WorkerLoop();
+    void RunTasks();
+};